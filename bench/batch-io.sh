@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Compare the POSIX and io_uring backends of the batch mode.
+# > Usage: bench/batch-io.sh (NSUB) (COUNT)
+#   NSUB : the nsub program to test (defaults to bin/nsub)
+#   COUNT: the number of small files to convert (defaults to 100000)
+#
+# Note: the files are created in a temporary directory, which is removed at
+#       the end; set TMPDIR to benchmark on a specific disk.
+#
+
+NSUB="${1:-bin/nsub}"
+COUNT="${2:-100000}"
+
+if [ ! -x "$NSUB" ]; then
+	echo "Program not found: $NSUB (run make first)" >&2
+	exit 1
+fi
+
+dir="`mktemp -d`" || exit 1
+trap 'rm -rf "$dir"' EXIT INT TERM
+
+echo "Creating $COUNT small SRT files in $dir..."
+mkdir "$dir/in" "$dir/out"
+awk -v dir="$dir/in" -v count="$COUNT" 'BEGIN {
+	for (i = 1; i <= count; i++) {
+		file = dir "/" i ".srt";
+		for (j = 1; j <= 10; j++) {
+			printf "%d\n00:00:%02d,000 --> 00:00:%02d,500\n", j, j, j > file;
+			printf "Subtitle %d of file %d\n\n", j, i > file;
+		}
+		close(file);
+	}
+}'
+
+# time_it LABEL IO: convert all the files with the given backend
+time_it() {
+	rm -f "$dir/out/"*
+	start=`date +%s%N`
+	( cd "$dir/in" && ls ) | sed "s:^:$dir/in/:" \
+		| "$NSUB" --batch --to vtt --io "$2" --output "$dir/out"
+	rep=$?
+	stop=`date +%s%N`
+	echo "$1: `expr \( $stop - $start \) / 1000000` ms (exit code $rep)"
+}
+
+# Warm up the page cache so both backends start from the same state
+time_it "warm-up" posix >/dev/null
+
+time_it "posix   " posix
+time_it "io_uring" uring
+time_it "posix   " posix
+time_it "io_uring" uring
@@ -17,21 +17,46 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "nsub.h"
 #include "cutils/cutils.h"
 
+/* Declarations */
+
+// a lyric to sort (by start, then by original index)
+typedef struct {
+	int start;
+	size_t index;
+} sort_key_t;
+
+static int cmp_sort_key(const void *a, const void *b);
+// set the text of a new lyric (shared if the song wants it)
+static void set_text(song_t *song, lyric_t *lyric, const char *text);
+// share all the texts of the song that are not shared yet
+static void intern_texts(song_t *song);
+// the greatest common divisor (Euclid), positive (1 if both are 0)
+static long long gcd(long long a, long long b);
+
 /* Public */
 
 song_t *new_song() {
 	song_t *song = malloc(sizeof(song_t));
 	song->lyrics = new_array(sizeof(lyric_t), 64);
 	song->metas = new_array(sizeof(meta_t), 10);
+	song->words = new_array(sizeof(word_t), 64);
+	song->strings = NULL;
+	song->intern = 0;
+	song->threads = 1;
 	song->offset = 0;
 	song->current_num = 0;
 	song->lang = NULL;
+	song->fps.num = 0;
+	song->fps.den = 0;
+	song->reader = NULL;
 	return song;
 }
 
@@ -47,10 +72,14 @@ void free_song(song_t *song) {
 	free_array(song->metas);
 
 	array_loop(song->lyrics, lyric, lyric_t)
-		free(lyric->text);
+		uninit_lyric(lyric);
 	free_array(song->lyrics);
+	free_array(song->words);
+
+	free_strings(song->strings);
 
 	free(song->lang);
+	free(song->reader);
 	free(song);
 }
 
@@ -58,30 +87,43 @@ void song_add_unknown(song_t *song, char *text) {
 	lyric_t *lyric = array_new(song->lyrics);
 	lyric->type = NSUB_UNKNOWN;
 	lyric->num = 0;
+	lyric->id = 0;
 	lyric->start = 0;
 	lyric->stop = 0;
 	lyric->name = NULL;
-	lyric->text = text ? strdup(text) : NULL;
+	lyric->style = NULL;
+	set_text(song, lyric, text);
+	lyric->word = 0;
+	lyric->words = 0;
 }
 
 void song_add_empty(song_t *song) {
 	lyric_t *lyric = array_new(song->lyrics);
 	lyric->type = NSUB_EMPTY;
 	lyric->num = 0;
+	lyric->id = 0;
 	lyric->start = 0;
 	lyric->stop = 0;
 	lyric->name = NULL;
+	lyric->style = NULL;
 	lyric->text = NULL;
+	lyric->shared = 0;
+	lyric->word = 0;
+	lyric->words = 0;
 }
 
 void song_add_comment(song_t *song, char *comment) {
 	lyric_t *lyric = array_new(song->lyrics);
 	lyric->type = NSUB_COMMENT;
 	lyric->num = 0;
+	lyric->id = 0;
 	lyric->start = 0;
 	lyric->stop = 0;
 	lyric->name = NULL;
-	lyric->text = comment ? strdup(comment) : NULL;
+	lyric->style = NULL;
+	set_text(song, lyric, comment);
+	lyric->word = 0;
+	lyric->words = 0;
 }
 
 void song_add_lyric(song_t *song, int start, int stop, char *name, char *text) {
@@ -90,10 +132,14 @@ void song_add_lyric(song_t *song, int start, int stop, char *name, char *text) {
 	lyric_t *lyric = array_new(song->lyrics);
 	lyric->type = NSUB_LYRIC;
 	lyric->num = song->current_num;
+	lyric->id = 0;
 	lyric->start = start;
 	lyric->stop = stop;
 	lyric->name = name ? strdup(name) : NULL;
-	lyric->text = text ? strdup(text) : NULL;
+	lyric->style = NULL;
+	set_text(song, lyric, text);
+	lyric->word = 0;
+	lyric->words = 0;
 }
 
 void song_add_meta(song_t *song, char *key, char *value) {
@@ -107,72 +153,247 @@ void uninit_lyric(lyric_t *lyric) {
 		return;
 
 	free(lyric->name);
-	free(lyric->text);
+	free(lyric->style);
+	if (!lyric->shared)
+		free(lyric->text);
+}
+
+void song_add_shared(song_t *song, int start, int stop, char *name,
+		char *text) {
+	song_add_lyric(song, start, stop, name, NULL);
+
+	lyric_t *lyric = array_last(song->lyrics);
+	lyric->text = text;
+	lyric->shared = 1;
+}
+
+int lyric_same_text(lyric_t *a, lyric_t *b) {
+	if (a->text == b->text)
+		return 1;
+	if (!a->text || !b->text || (a->shared && b->shared))
+		return 0;
+
+	return !strcmp(a->text, b->text);
+}
+
+void song_sort(song_t *song) {
+	size_t count = array_count(song->lyrics);
+	sort_key_t *keys = malloc(count * sizeof(sort_key_t));
+	if (!keys)
+		return;
+
+	// The comments go with the next lyric (or at the end if none)
+	int next = INT_MAX;
+	for (size_t i = count; i > 0; i--) {
+		lyric_t *lyric = array_get(song->lyrics, i - 1);
+		if (lyric->type == NSUB_LYRIC)
+			next = lyric->start;
+
+		keys[i - 1].start = next;
+		keys[i - 1].index = i - 1;
+	}
+
+	// The index makes it stable
+	qsort(keys, count, sizeof(sort_key_t), cmp_sort_key);
+
+	array_t *sorted = new_array(sizeof(lyric_t), count ? count : 1);
+	int num = 0;
+	for (size_t i = 0; i < count; i++) {
+		lyric_t *lyric = array_new(sorted);
+		memcpy(lyric, array_get(song->lyrics, keys[i].index), sizeof(lyric_t));
+		if (lyric->type == NSUB_LYRIC)
+			lyric->num = ++num;
+	}
+
+	free_array(song->lyrics);
+	song->lyrics = sorted;
+	free(keys);
 }
 
 song_t *nsub_read(FILE *in, NSUB_FORMAT fmt) {
-	song_t *song = NULL;
-	cstring_t *line = NULL;
+	song_t *song = new_song();
+	if (!nsub_read_into(song, in, fmt)) {
+		free_song(song);
+		return NULL;
+	}
+
+	return song;
+}
+
+int nsub_read_into(song_t *song, FILE *in, NSUB_FORMAT fmt) {
+	reader_t *reader = new_reader(song, fmt);
+	if (!reader)
+		return 0;
 
-	/* Which reader? */
-	int (*read_a_line)(song_t *, char *) = NULL;
+	int ok = reader_read(reader, in);
+	ok = reader_end(reader) && ok;
+
+	// The readers that build the texts line by line
+	if (ok && song->intern)
+		intern_texts(song);
+
+	free_reader(reader);
+	return ok;
+}
+
+int nsub_write(FILE *out, song_t *song, NSUB_FORMAT fmt) {
 	switch (fmt) {
 	case NSUB_FMT_LRC:
-		read_a_line = nsub_read_lrc;
-		break;
+		return nsub_write_lrc(out, song, fmt);
+	case NSUB_FMT_WEBVTT:
+		return nsub_write_webvtt(out, song, fmt);
 	case NSUB_FMT_SRT:
-		read_a_line = nsub_read_srt;
-		break;
+		return nsub_write_srt(out, song, fmt);
+	case NSUB_FMT_ASS:
+		return nsub_write_ass(out, song, fmt);
+	case NSUB_FMT_TTML:
+		return nsub_write_ttml(out, song, fmt);
+	case NSUB_FMT_MICRODVD:
+		return nsub_write_microdvd(out, song, fmt);
+	case NSUB_FMT_SUBVIEWER:
+		return nsub_write_subviewer(out, song, fmt);
+	case NSUB_FMT_JSONL:
+		return nsub_write_jsonl(out, song, fmt);
+	default:
+		fprintf(stderr, "Unsupported write format %d\n", fmt);
+		return 0;
+	}
+}
+
+int nsub_writer(NSUB_FORMAT fmt, writer_t *writer) {
+	switch (fmt) {
+	case NSUB_FMT_LRC:
+		nsub_writer_lrc(writer);
+		return 1;
 	case NSUB_FMT_WEBVTT:
-		read_a_line = nsub_read_webvtt;
-		break;
+		nsub_writer_webvtt(writer);
+		return 1;
+	case NSUB_FMT_SRT:
+		nsub_writer_srt(writer);
+		return 1;
+	case NSUB_FMT_JSONL:
+		nsub_writer_jsonl(writer);
+		return 1;
 	default:
-		fprintf(stderr, "Unsupported read format %d\n", fmt);
-		goto fail;
+		return 0;
 	}
+}
 
-	/* Read it */
-	song = new_song();
-	line = new_cstring();
-	size_t i = 0;
-	while (cstring_readline(line, in)) {
-		// UTF-8 BOM detection if any
-		if (!i && cstring_starts_with(line->string, "\xEF\xBB\xBF", 0)) {
-			cstring_t *tmp = cstring_substring(line->string, 3, 0);
-			free_cstring(line);
-			line = tmp;
-		}
+cstring_t *nsub_word_text(song_t *song, lyric_t *lyric,
+		char *(*time_str)(int time, int show_sign), int inside) {
+	cstring_t *text = new_cstring();
+	const char *ptr = lyric->text ? lyric->text : "";
+	int done = 0;
 
-		i++;
+	for (int i = 0; i < lyric->words; i++) {
+		word_t *word = array_get(song->words, lyric->word + i);
+		if (inside && (word->start <= lyric->start
+				|| word->start >= lyric->stop))
+			continue;
 
-		if (!read_a_line(song, line->string)) {
-			fprintf(stderr, "Read error on line %zu: <%s>\n", i, line->string);
-			song = NULL;
-			goto fail;
-		}
+		cstring_addn(text, ptr + done, word->offset - done);
+		done = word->offset;
+
+		char *time = time_str(word->start, 0);
+		cstring_addf(text, "<%s>", time);
+		free(time);
 	}
 
-	fail:
+	cstring_add(text, ptr + done);
+	return text;
+}
 
-	free_cstring(line);
-	return song;
+NSUB_FORMAT nsub_parse_fmt(char *type, int required) {
+	// Look past the compression suffix if any (i.e., "srt.gz")
+	char buf[16];
+	char *dot = strchr(type, '.');
+	if (dot) {
+		size_t len = dot - type;
+		if (len >= sizeof(buf) 
+				|| nsub_parse_compression(dot) == NSUB_COMP_NONE)
+			return required ? NSUB_FMT_ERROR : NSUB_FMT_UNKNOWN;
+
+		memcpy(buf, type, len);
+		buf[len] = '\0';
+		type = buf;
+	}
+
+	if (!strcmp("lrc", type)) {
+		return NSUB_FMT_LRC;
+	} else if (!strcmp("srt", type)) {
+		return NSUB_FMT_SRT;
+	} else if (!strcmp("webvtt", type)) {
+		return NSUB_FMT_WEBVTT;
+	} else if (!strcmp("vtt", type)) {
+		return NSUB_FMT_WEBVTT;
+	} else if (!strcmp("ass", type)) {
+		return NSUB_FMT_ASS;
+	} else if (!strcmp("ssa", type)) {
+		return NSUB_FMT_ASS;
+	} else if (!strcmp("ttml", type)) {
+		return NSUB_FMT_TTML;
+	} else if (!strcmp("dfxp", type)) {
+		return NSUB_FMT_TTML;
+	} else if (!strcmp("sub", type)) {
+		return NSUB_FMT_MICRODVD;
+	} else if (!strcmp("microdvd", type)) {
+		return NSUB_FMT_MICRODVD;
+	} else if (!strcmp("subviewer", type)) {
+		return NSUB_FMT_SUBVIEWER;
+	} else if (!strcmp("sbv", type)) {
+		return NSUB_FMT_SUBVIEWER;
+	} else if (!strcmp("stl", type)) {
+		return NSUB_FMT_EBUSTL;
+	} else if (!strcmp("jsonl", type)) {
+		return NSUB_FMT_JSONL;
+	}
+
+	if (required)
+		return NSUB_FMT_ERROR;
+
+	return NSUB_FMT_UNKNOWN;
 }
 
-int nsub_write(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv) {
+char *nsub_file_ext(char *path) {
+	char *ext = strrchr(path, '.');
+	if (!ext)
+		return NULL;
+
+	// "file.srt.gz" -> "srt.gz"
+	if (nsub_parse_compression(ext) != NSUB_COMP_NONE) {
+		char *prev = ext;
+		while (prev > path && *(prev - 1) != '.' && *(prev - 1) != '/')
+			prev--;
+		if (prev > path && *(prev - 1) == '.')
+			ext = prev - 1;
+	}
+
+	return ext + 1;
+}
+
+const char *nsub_fmt_ext(NSUB_FORMAT fmt) {
 	switch (fmt) {
 	case NSUB_FMT_LRC:
-		return nsub_write_lrc(out, song, fmt, apply_offset, 
-			add_offset, conv);
+		return "lrc";
 	case NSUB_FMT_WEBVTT:
-		return nsub_write_webvtt(out, song, fmt, apply_offset, 
-			add_offset, conv);
+		return "vtt";
 	case NSUB_FMT_SRT:
-		return nsub_write_srt(out, song, fmt, apply_offset, 
-			add_offset, conv);
+		return "srt";
+	case NSUB_FMT_ASS:
+		return "ass";
+	case NSUB_FMT_TTML:
+		return "ttml";
+	case NSUB_FMT_MICRODVD:
+		return "sub";
+	case NSUB_FMT_SUBVIEWER:
+		// not "sub": that is MicroDVD
+		return "sbv";
+	case NSUB_FMT_EBUSTL:
+		return "stl";
+	case NSUB_FMT_JSONL:
+		return "jsonl";
 	default:
-		fprintf(stderr, "Unsupported write format %d\n", fmt);
-		return 0;
+		return NULL;
 	}
 }
 
@@ -198,10 +419,8 @@ int nsub_to_ms(const char line[], char deci_sym) {
 
 	int has_milli = 0;
 
-	size_t end = strlen(line) - 1;
-
-	for (size_t i = end; i >= 0; i--) {
-		char car = line[i];
+	for (size_t i = strlen(line); i > 0; i--) {
+		char car = line[i - 1];
 
 		int digit = (car >= '0' && car <= '9');
 		int dot = car == deci_sym;
@@ -211,6 +430,12 @@ int nsub_to_ms(const char line[], char deci_sym) {
 			break;
 		}
 
+		if (dot && igroup >= 0) {
+			// ".8" is 800 ms, ".80" too
+			for (int i = itmp; i < 3; i++)
+				group[igroup] *= 10;
+		}
+
 		if (digit) {
 			if (itmp == 0)
 				igroup++;
@@ -273,13 +498,200 @@ int nsub_is_timing(const char line[], char deci_sym, int max_deci) {
 	return 1;
 }
 
-int apply_conv(int time, double conv) {
-	// Just so we don't require -lm...
-	double tmp = time * conv;
-	double diff = tmp - (int)tmp;
-	
-	if (diff >= 0.5)
-		return (int)tmp + 1;
-	return (int)tmp;
+int nsub_parse_ratio(const char *str, ratio_t *ratio) {
+	// num and den stay <= RATIO_MAX, so that a product of two of them fits
+	// in a long long (nsub_fps_ratio refuses the combinations that do not)
+	const long long RATIO_MAX = 1000000000;
+	long long num = 0;
+	long long den = 1;
+	int digits = 0;
+	int deci = 0;
+	int rounded = 0;
+
+	// Numerator, possibly decimal (extra decimals are rounded off)
+	for (; *str; str++) {
+		if (*str >= '0' && *str <= '9') {
+			int digit = *str - '0';
+			digits++;
+			if (rounded) {
+				continue;
+			} else if (num <= (RATIO_MAX - digit) / 10
+					&& (!deci || den < RATIO_MAX)) {
+				num = num * 10 + digit;
+				if (deci)
+					den *= 10;
+			} else if (deci) {
+				rounded = 1;
+				num += digit >= 5;
+			} else {
+				return 0;
+			}
+		} else if (*str == '.' && !deci) {
+			deci = 1;
+		} else {
+			break;
+		}
+	}
+
+	// Denominator
+	if (*str == '/' && !deci) {
+		long long div = 0;
+		for (str++; *str >= '0' && *str <= '9'; str++) {
+			div = div * 10 + (*str - '0');
+			if (div > RATIO_MAX)
+				return 0;
+		}
+		den = div;
+	}
+
+	if (*str || !digits || !num || !den)
+		return 0;
+
+	ratio->num = num;
+	ratio->den = den;
+	*ratio = nsub_fps_ratio((ratio_t ) { 1, 1 }, *ratio);
+	return 1;
+}
+
+ratio_t nsub_fps_ratio(ratio_t from, ratio_t to) {
+	// to.num * from.den / (to.den * from.num): with both terms reduced, and
+	// then reduced across, the products are the reduced ratio (so they only
+	// overflow if it does not fit)
+	long long f = gcd(from.num, from.den);
+	from.num /= f;
+	from.den /= f;
+	long long t = gcd(to.num, to.den);
+	to.num /= t;
+	to.den /= t;
+
+	long long a = gcd(to.num, from.num);
+	long long b = gcd(from.den, to.den);
+	long long num1 = to.num / a;
+	long long num2 = from.den / b;
+	long long den1 = to.den / b;
+	long long den2 = from.num / a;
+
+	if ((num2 && num1 > LLONG_MAX / num2) || (den2 && den1 > LLONG_MAX / den2))
+		return (ratio_t ) { 0, 0 };
+
+	return (ratio_t ) { num1 * num2, den1 * den2 };
+}
+
+int apply_ratio(int time, ratio_t ratio) {
+	if (ratio.num == ratio.den)
+		return time;
+
+	// time * num / den without overflowing: num = q * den + r, and then
+	// time * r / den (bit by bit if time * r does not fit)
+	long long mag = time < 0 ? -(long long) time : time;
+	long long q = ratio.num / ratio.den;
+	long long r = ratio.num % ratio.den;
+	if (q && mag > INT_MAX / q)
+		return time < 0 ? -INT_MAX : INT_MAX;
+
+	unsigned long long den = ratio.den;
+	unsigned long long quot;
+	unsigned long long rem;
+	if (!r || mag <= LLONG_MAX / r) {
+		quot = (mag * r) / den;
+		rem = (mag * r) % den;
+	} else {
+		// rem < den < 2^63: rem * 2 and rem + r cannot overflow
+		quot = 0;
+		rem = 0;
+		for (int bit = 30; bit >= 0; bit--) {
+			quot <<= 1;
+			rem <<= 1;
+			if (rem >= den) {
+				rem -= den;
+				quot++;
+			}
+			if ((mag >> bit) & 1) {
+				rem += r;
+				if (rem >= den) {
+					rem -= den;
+					quot++;
+				}
+			}
+		}
+	}
+
+	// Halves away from zero
+	if (rem * 2 >= den)
+		quot++;
+
+	long long conv = q * mag + (long long) quot;
+	if (conv > INT_MAX)
+		conv = INT_MAX;
+
+	return (int) (time < 0 ? -conv : conv);
+}
+
+int snap_to_frame(int time, ratio_t fps) {
+	// frame = round(time * fps / 1000), time = round(frame * 1000 / fps)
+	ratio_t to_frames = { fps.num, fps.den * 1000 };
+	ratio_t to_ms = { fps.den * 1000, fps.num };
+
+	return apply_ratio(apply_ratio(time, to_frames), to_ms);
+}
+
+int song_sorted(song_t *song) {
+	int last = INT_MIN;
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type != NSUB_LYRIC)
+			continue;
+		if (lyric->start < last)
+			return 0;
+		last = lyric->start;
+	}
+
+	return 1;
+}
+
+/* Private */
+
+static int cmp_sort_key(const void *a, const void *b) {
+	const sort_key_t *ka = a;
+	const sort_key_t *kb = b;
+
+	if (ka->start != kb->start)
+		return ka->start < kb->start ? -1 : 1;
+
+	return ka->index < kb->index ? -1 : (ka->index > kb->index);
+}
+
+static void set_text(song_t *song, lyric_t *lyric, const char *text) {
+	if (text && song->intern) {
+		lyric->text = song_intern(song, text);
+		lyric->shared = 1;
+	} else {
+		lyric->text = text ? strdup(text) : NULL;
+		lyric->shared = 0;
+	}
+}
+
+static void intern_texts(song_t *song) {
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (!lyric->text || lyric->shared)
+			continue;
+
+		char *text = song_intern(song, lyric->text);
+		free(lyric->text);
+		lyric->text = text;
+		lyric->shared = 1;
+	}
 }
 
+static long long gcd(long long a, long long b) {
+	while (b) {
+		long long tmp = a % b;
+		a = b;
+		b = tmp;
+	}
+
+	if (a < 0)
+		a = -a;
+	return a ? a : 1;
+}
@@ -25,7 +25,8 @@
  * @brief Subtitle/Lyrics conversion program (webvtt/srt/lrc)
  *
  * A small program to convert between subtitles and lyrics formats.
- * It supports webvtt, srt and lrc files.
+ * It supports webvtt, srt, lrc, ass, ttml, microdvd, subviewer and jsonl
+ * files (and can read ebu-stl files).
  *
  * Use <tt>nsub --help</tt> for more information.
  */
@@ -39,6 +40,7 @@
  * @note all timings are in milliseconds.
  */
 #include "cutils/array.h"
+#include "cutils/cstring.h"
 
 /**
  * A subtitle or lyric format to import from/export to.
@@ -55,6 +57,38 @@ typedef int NSUB_FORMAT;
 #define NSUB_FMT_WEBVTT 2
 /** A de-facto standard for video subtitles (from the program SubRip). */
 #define NSUB_FMT_SRT 3
+/** Advanced SubStation Alpha (and SubStation Alpha) subtitles. */
+#define NSUB_FMT_ASS 4
+/** The W3C Timed Text Markup Language (and DFXP, IMSC1). */
+#define NSUB_FMT_TTML 5
+/** The frame-based MicroDVD subtitles (usually with a .sub extension). */
+#define NSUB_FMT_MICRODVD 6
+/** The SubViewer 2.0 subtitles (also with a .sub extension). */
+#define NSUB_FMT_SUBVIEWER 7
+/** The EBU Tech 3264 binary subtitles (EBU-STL), read only. */
+#define NSUB_FMT_EBUSTL 8
+/** JSON Lines: one JSON object per line and per lyric (machine-readable). */
+#define NSUB_FMT_JSONL 9
+
+/**
+ * A compression scheme applied on top of a subtitle or lyric format.
+ */
+typedef int NSUB_COMPRESSION;
+
+/** No compression (plain text). */
+#define NSUB_COMP_NONE 0
+/** Gzip compression (requires zlib at build time). */
+#define NSUB_COMP_GZIP 1
+/** Zstandard compression (requires libzstd at build time). */
+#define NSUB_COMP_ZSTD 2
+
+/**
+ * An exact ratio (num/den), for instance a frame rate like 30000/1001.
+ */
+typedef struct {
+	long long num;
+	long long den;
+} ratio_t;
 
 /**
  * A type of lyric.
@@ -81,6 +115,10 @@ typedef struct {
 	 * @note the numbering start at 1
 	 */
 	int num;
+	/**
+	 * The number this lyric had in the source file, if any (0 if none).
+	 */
+	int id;
 	/**
 	 * The time in milliseconds (total song/video play time) after which this
 	 * lyric start.
@@ -98,12 +136,41 @@ typedef struct {
 	 * 		it altogether (example: « Chorus 1 »)
 	 */
 	char *name;
+	/**
+	 * The style of this lyric, for the formats that have some (ASS), NULL
+	 * for the default one.
+	 */
+	char *style;
 	/**
 	 * The actual content of this lyric or comment.
 	 */
 	char *text;
+	/**
+	 * TRUE if the text is shared with other lyrics (it then belongs to the
+	 * song, see song_intern()).
+	 *
+	 * @note a shared text must not be freed nor modified in place
+	 */
+	int shared;
+	/**
+	 * The index of the first word timing of this lyric in song_t.words (only
+	 * valid if it has words).
+	 */
+	int word;
+	/** The number of word timings of this lyric (0 if none). */
+	int words;
 } lyric_t;
 
+/**
+ * The timing of a word (karaoke), in the side table of the song.
+ */
+typedef struct {
+	/** The offset (in bytes) of the word in the text of its lyric. */
+	int offset;
+	/** The time in milliseconds at which this word starts. */
+	int start;
+} word_t;
+
 /**
  * Some piece of meta-data.
  */
@@ -112,6 +179,18 @@ typedef struct {
 	char *value;
 } meta_t;
 
+/**
+ * A set of texts, each text being kept only once (a hash set keyed by content).
+ */
+typedef struct {
+	/** The texts, NULL for the free slots. */
+	char **slots;
+	/** The number of slots (a power of 2). */
+	size_t size;
+	/** The number of texts. */
+	size_t count;
+} strings_t;
+
 /**
  * A song (or video).
  *
@@ -122,6 +201,33 @@ typedef struct {
 	array_t *lyrics;
 	/** The meta-data if any. */
 	array_t *metas;
+	/**
+	 * The word timings of all the lyrics (word_t), in order.
+	 *
+	 * @see lyric_t.word
+	 */
+	array_t *words;
+	/**
+	 * The texts shared by several lyrics, owned by the song (NULL if none).
+	 *
+	 * @see song_intern()
+	 */
+	strings_t *strings;
+	/**
+	 * TRUE to share the identical texts of the lyrics instead of keeping a
+	 * copy for each of them.
+	 *
+	 * @note FALSE by default: set it before reading, and then do not modify
+	 * 		the texts in place (see lyric_t.shared)
+	 */
+	int intern;
+	/**
+	 * The number of threads used to format the lyrics when writing a big
+	 * song (1 by default: no extra thread).
+	 *
+	 * @see nsub_write_lyrics()
+	 */
+	int threads;
 	/** An offset to apply to every lyrics timings. */
 	int offset;
 	/**
@@ -132,6 +238,18 @@ typedef struct {
 	int current_num;
 	/** The language of the lyrics. */
 	char *lang;
+	/**
+	 * The frame rate, for the frame-based formats (0/0 if unknown).
+	 *
+	 * @note set it before reading to force the frame rate of the input, and
+	 * 		before writing to choose the one of the output (23.976 is used
+	 * 		when unknown)
+	 */
+	ratio_t fps;
+	/**
+	 * Private state of the reader while reading (freed by nsub_read).
+	 */
+	void *reader;
 } song_t;
 
 /* Song & Lyric */
@@ -145,6 +263,96 @@ void song_add_lyric(song_t *song, int start, int stop, char *name, char *text);
 void song_add_meta(song_t *song, char *key, char *value);
 void uninit_lyric(lyric_t *lyric);
 
+/**
+ * Keep this text in the song, so it can be shared by several lyrics.
+ *
+ * @note identical texts give the same pointer, so two shared texts can be
+ * 		compared by address
+ *
+ * @param song the song that will own the text
+ * @param text the text to share (copied if not already known)
+ *
+ * @return the shared text (do not free it)
+ */
+char *song_intern(song_t *song, const char *text);
+
+/**
+ * Check if two lyrics have the same text.
+ *
+ * @note this is a simple address check when both texts are shared
+ *
+ * @return TRUE if they do
+ */
+int lyric_same_text(lyric_t *a, lyric_t *b);
+
+strings_t *new_strings();
+void free_strings(strings_t *strings);
+
+/**
+ * Add a lyric whose text is shared with other lyrics.
+ *
+ * @param song the song to add the lyric to
+ * @param start the start time in milliseconds
+ * @param stop the stop time in milliseconds
+ * @param name the name of the lyric (copied), or NULL
+ * @param text a shared text, as returned by song_intern()
+ */
+void song_add_shared(song_t *song, int start, int stop, char *name,
+		char *text);
+
+/**
+ * Sort the lyrics by start time (stable), the comments and empty lines staying
+ * just before the lyric that followed them.
+ *
+ * @note the lyrics are renumbered
+ *
+ * @param song the song to sort
+ */
+void song_sort(song_t *song);
+
+/**
+ * Check if the lyrics are in start time order (see song_sort()).
+ *
+ * @param song the song to check
+ *
+ * @return TRUE if they are
+ */
+int song_sorted(song_t *song);
+
+/* Formats */
+
+/**
+ * Parse a format name or file extension (for instance, "srt" or "vtt").
+ *
+ * @note a compression suffix is allowed and ignored (i.e., "srt.gz")
+ *
+ * @param type the name of the format
+ * @param required TRUE to return NSUB_FMT_ERROR instead of NSUB_FMT_UNKNOWN
+ * 		when the format is not recognised
+ *
+ * @return the format
+ */
+NSUB_FORMAT nsub_parse_fmt(char *type, int required);
+
+/**
+ * Find the format extension of a file name, looking past the compression
+ * suffix if any (i.e., "srt.gz" for "file.srt.gz").
+ *
+ * @param path the file name
+ *
+ * @return a pointer inside path just after the dot, or NULL if none
+ */
+char *nsub_file_ext(char *path);
+
+/**
+ * The usual file extension of the given format (without the dot).
+ *
+ * @param fmt the format
+ *
+ * @return the extension, or NULL for unsupported formats
+ */
+const char *nsub_fmt_ext(NSUB_FORMAT fmt);
+
 /* Read */
 
 /**
@@ -182,30 +390,953 @@ int nsub_to_ms(const char line[], char deci_sym);
 int nsub_is_timing(const char line[], char deci_sym, int max_deci);
 
 /**
- * Apply a conversion ratio to the given time.
+ * Parse an exact ratio: a fraction ("30000/1001"), an integer ("25") or a
+ * decimal number ("23.976", which means 23976/1000).
+ * Both terms are limited to 10^9: the decimals beyond that are rounded off.
+ *
+ * @param str the text to parse
+ * @param ratio the parsed ratio (reduced)
+ *
+ * @return TRUE if it was a valid, positive ratio
+ */
+int nsub_parse_ratio(const char *str, ratio_t *ratio);
+
+/**
+ * The ratio to apply to timings to go from one frame rate to another
+ * (i.e., <tt>to / from</tt>).
+ *
+ * @param from the source frame rate
+ * @param to the target frame rate
+ *
+ * @return the ratio (reduced), 0/0 if its terms do not fit in a long long
+ */
+ratio_t nsub_fps_ratio(ratio_t from, ratio_t to);
+
+/**
+ * Apply a conversion ratio to the given time, in integer arithmetic, rounded to
+ * the nearest millisecond (halves away from zero).
  *
  * @param time the initial time to compute from
- * @param conv the conversion ratio to apply (i.e., 1 = no conversion)
+ * @param ratio the conversion ratio to apply (i.e., 1/1 = no conversion)
  *
  * @return the converted time
  */
-int apply_conv(int time, double conv);
+int apply_ratio(int time, ratio_t ratio);
+
+/**
+ * Move the given time to the nearest frame boundary.
+ *
+ * @param time the time to snap
+ * @param fps the frame rate
+ *
+ * @return the time of the nearest frame
+ */
+int snap_to_frame(int time, ratio_t fps);
 
 song_t *nsub_read(FILE *in, NSUB_FORMAT fmt);
+
+/**
+ * Read the lyrics into the given (new) song, which can be set up before (for
+ * instance, with its frame rate).
+ *
+ * @param song the song to fill
+ * @param in the input stream
+ * @param fmt the format of the input
+ *
+ * @return FALSE in case of error
+ */
+int nsub_read_into(song_t *song, FILE *in, NSUB_FORMAT fmt);
 int nsub_read_lrc(song_t *song, char *line);
+int nsub_read_lrc_end(song_t *song);
 int nsub_read_webvtt(song_t *song, char *line);
 int nsub_read_srt(song_t *song, char *line);
+int nsub_read_ass(song_t *song, char *line);
+int nsub_read_ttml(song_t *song, char *line);
+int nsub_read_microdvd(song_t *song, char *line);
+int nsub_read_subviewer(song_t *song, char *line);
+int nsub_read_jsonl(song_t *song, char *line);
+
+/**
+ * A reader of any input format, fed with chunks of bytes of any size (a line
+ * or a block can span several chunks), so the input can come from a file, a
+ * pipe, a decompressor, a network stream...
+ *
+ * The line formats are cut in lines for their reader (nsub_read_srt()...),
+ * the chunk formats (EBU STL) read the chunks as they come and keep their
+ * state in song_t.reader until the end.
+ */
+typedef struct reader_t reader_t;
+
+/**
+ * Start reading a song.
+ *
+ * @param song the song to fill
+ * @param fmt the format of the input
+ *
+ * @return the reader (to free with free_reader()), NULL if the format is
+ * 		not supported
+ */
+reader_t *new_reader(song_t *song, NSUB_FORMAT fmt);
+
+/**
+ * Read the next chunk of the input.
+ *
+ * @param reader the reader
+ * @param data the bytes
+ * @param size the number of bytes
+ *
+ * @return FALSE in case of error (the next calls will fail too)
+ */
+int reader_feed(reader_t *reader, const char *data, size_t size);
+
+/**
+ * Check if the reader holds the start of a line, still waiting for its end.
+ *
+ * @param reader the reader
+ *
+ * @return TRUE if it does
+ */
+int reader_pending(reader_t *reader);
+
+/**
+ * Keep the lyrics in the order of the input, for a song consumed by batches
+ * while it is read (streams): the lyrics already taken cannot be sorted at
+ * the end (for the formats whose lyrics need not be in order, like ASS).
+ *
+ * @param reader the reader
+ */
+void reader_keep_order(reader_t *reader);
+
+/**
+ * Read a whole stream: mapped in memory if it is a file, by chunks if not.
+ *
+ * @param reader the reader
+ * @param in the input stream
+ *
+ * @return FALSE in case of error
+ */
+int reader_read(reader_t *reader, FILE *in);
+
+/**
+ * The input is over: read what was left (a last line without a new line,
+ * the end of the song...).
+ *
+ * @param reader the reader
+ *
+ * @return FALSE in case of error (now or before)
+ */
+int reader_end(reader_t *reader);
+void free_reader(reader_t *reader);
+
+/**
+ * Read the next chunk of an EBU STL input (into song_t.reader).
+ *
+ * @return FALSE if it is not an EBU STL file
+ */
+int nsub_read_ebustl(song_t *song, const char *data, size_t size);
+
+/**
+ * End an EBU STL input, and release the state of the reader.
+ *
+ * @param song the song
+ * @param ok FALSE if reading already failed (then only release the state)
+ *
+ * @return FALSE in case of error (now or before)
+ */
+int nsub_read_ebustl_end(song_t *song, int ok);
+
+/* Transform */
+
+/**
+ * A type of transformation stage.
+ */
+typedef int NSUB_STAGE;
+
+/** Add a fixed number of milliseconds to the timings. */
+#define NSUB_STAGE_SHIFT 1
+/** Multiply the timings by a ratio. */
+#define NSUB_STAGE_SCALE 2
+/** Apply the song offset to the timings (and reset it to 0). */
+#define NSUB_STAGE_APPLY_OFFSET 3
+/** Make sure no timing is negative and no lyric stops before it starts. */
+#define NSUB_STAGE_CLAMP 4
+/** Extend the lyrics so they last at least a number of milliseconds. */
+#define NSUB_STAGE_MIN_DURATION 5
+/** Remove the comments. */
+#define NSUB_STAGE_DROP_COMMENTS 6
+/** Move the timings to the nearest frame boundary (of a frame rate). */
+#define NSUB_STAGE_SNAP 9
+/** Remove the formatting tags (&lt;i&gt;, {\\an8}...) from the text. */
+#define NSUB_STAGE_STRIP_TAGS 7
+/** Number the lyrics again, starting at 1. */
+#define NSUB_STAGE_RENUMBER 8
+/**
+ * Merge a lyric into the previous one when they have the same text and
+ * follow each other (at most a number of milliseconds apart).
+ */
+#define NSUB_STAGE_DEDUP 10
+/** Stop the overlapping lyrics when the next one starts (see NSUB_OVERLAP). */
+#define NSUB_STAGE_TRUNCATE_OVERLAPS 11
+/** Merge the overlapping lyrics into one (see NSUB_OVERLAP). */
+#define NSUB_STAGE_MERGE_OVERLAPS 12
+/** Split the overlapping lyrics at each change (see NSUB_OVERLAP). */
+#define NSUB_STAGE_STACK_OVERLAPS 13
+
+/**
+ * A transformation stage.
+ */
+typedef struct {
+	NSUB_STAGE type;
+	/**
+	 * The milliseconds to use (NSUB_STAGE_SHIFT, NSUB_STAGE_MIN_DURATION,
+	 * NSUB_STAGE_DEDUP).
+	 */
+	int ms;
+	/** The ratio to use (NSUB_STAGE_SCALE) or frame rate (NSUB_STAGE_SNAP). */
+	ratio_t ratio;
+} stage_t;
+
+/**
+ * An ordered list of transformation stages, applied between read and write.
+ */
+typedef struct {
+	/** The stages, in order. */
+	array_t *stages;
+} pipeline_t;
+
+pipeline_t *new_pipeline();
+void free_pipeline(pipeline_t *pipeline);
+void pipeline_add(pipeline_t *pipeline, NSUB_STAGE type);
+void pipeline_add_ms(pipeline_t *pipeline, NSUB_STAGE type, int ms);
+void pipeline_add_ratio(pipeline_t *pipeline, NSUB_STAGE type, ratio_t ratio);
+
+/**
+ * Apply all the stages of the pipeline to the song, in place.
+ *
+ * All the stages are applied to a lyric before going to the next one, so the
+ * lyrics are only traversed once; dropped lyrics are removed on the fly.
+ *
+ * @param song the song to transform
+ * @param pipeline the stages to apply (can be NULL)
+ *
+ * @return TRUE if success
+ */
+int nsub_transform(song_t *song, pipeline_t *pipeline);
+
+/**
+ * Check if a pipeline contains a stage of the given type.
+ *
+ * @param pipeline the stages to check (can be NULL)
+ * @param type the type of stage to look for
+ *
+ * @return TRUE if it does
+ */
+int nsub_pipeline_has(pipeline_t *pipeline, NSUB_STAGE type);
+
+/**
+ * Check that a pipeline can be applied to the lyrics batch by batch, when
+ * the whole song is not available (no overlap or dedup stage).
+ *
+ * @param pipeline the stages to apply (can be NULL)
+ *
+ * @return TRUE if it can
+ */
+int nsub_pipeline_streamable(pipeline_t *pipeline);
+
+/**
+ * Apply all the stages of a streamable pipeline to the next batch of lyrics
+ * of a song (the lyrics of the song).
+ *
+ * @param song the song to transform, with only the lyrics of the batch
+ * @param pipeline the stages to apply (can be NULL)
+ * @param num the last lyric number given by NSUB_STAGE_RENUMBER, 0 before
+ * 		the first batch (updated)
+ *
+ * @return FALSE if the pipeline is not streamable
+ */
+int nsub_transform_batch(song_t *song, pipeline_t *pipeline, int *num);
+
+/**
+ * Check that a pipeline only changes the timings of the lyrics, one by one
+ * (the stages about the comments and the numbering are accepted too, as they
+ * change nothing to a song of lyrics only, numbered in order).
+ *
+ * @param pipeline the stages to apply (can be NULL)
+ *
+ * @return TRUE if it only changes the timings
+ */
+int nsub_pipeline_timings_only(pipeline_t *pipeline);
+
+/**
+ * Apply the stages of a pipeline to the timings of one lyric.
+ *
+ * @note only for a pipeline that changes nothing else (see
+ * 		nsub_pipeline_timings_only())
+ *
+ * @param song the song of the lyric (for its offset)
+ * @param pipeline the stages to apply (can be NULL)
+ * @param start the start time of the lyric (updated)
+ * @param stop the stop time of the lyric (updated)
+ */
+void nsub_transform_timings(song_t *song, pipeline_t *pipeline, int *start,
+		int *stop);
+
+/**
+ * How to resolve the overlapping lyrics.
+ */
+typedef int NSUB_OVERLAP;
+
+/**
+ * Stop a lyric when the next one starts (the lyrics starting at the same time
+ * are merged).
+ */
+#define NSUB_OVERLAP_TRUNCATE 1
+/** Merge the overlapping lyrics into one, one text per line. */
+#define NSUB_OVERLAP_MERGE 2
+/**
+ * Split the overlapping lyrics at each start and stop, each part showing all
+ * the texts displayed at that time (one per line).
+ */
+#define NSUB_OVERLAP_STACK 3
+
+/**
+ * Find the overlapping lyrics (sweep line on the lyrics sorted by start, in
+ * O(n log n)) and resolve them.
+ *
+ * @note the word timings of a merged lyric are the ones of its first lyric,
+ * 		and a stacked lyric has none
+ * @note the lyrics are not renumbered
+ *
+ * @param song the song to fix
+ * @param policy how to resolve them
+ *
+ * @return the number of overlapping lyrics found
+ */
+int nsub_fix_overlaps(song_t *song, NSUB_OVERLAP policy);
+
+/**
+ * Find the timing change that makes a song match a reference track of the
+ * same film or song (for instance, another language or another cut).
+ *
+ * The activity of both tracks (when a lyric is displayed or not) is
+ * cross-correlated (by FFT) for the usual speed changes (23.976, 24, 25 fps),
+ * then the offset and ratio are refined by least squares on the lyrics that
+ * match.
+ *
+ * The new timings are: apply_ratio(time, ratio) + shift.
+ *
+ * @param song the song to align (not modified)
+ * @param ref the correctly timed reference
+ * @param ratio the ratio to apply (out)
+ * @param shift the milliseconds to add, after the ratio (out)
+ *
+ * @return FALSE if they cannot be aligned
+ */
+int nsub_align(song_t *song, song_t *ref, ratio_t *ratio, int *shift);
 
 /* Write */
 
-// conv = time conversion ratio
-int nsub_write(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv);
-int nsub_write_lrc(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv);
-int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt,
-		int apply_offset, int add_offset, double conv);
-int nsub_write_srt(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv);
+/**
+ * Write the song in the given format.
+ *
+ * @note the song offset is only kept by the formats that support it (LRC), the
+ * 		others ignore it; use a NSUB_STAGE_APPLY_OFFSET stage to apply it
+ *
+ * @param out the output stream
+ * @param song the song to write
+ * @param fmt the format to write in
+ *
+ * @return TRUE if success
+ */
+int nsub_write(FILE *out, song_t *song, NSUB_FORMAT fmt);
+
+/**
+ * The text of a lyric with its word timings as tags (i.e., "<00:12.50>").
+ *
+ * @param song the song (which holds the word timings)
+ * @param lyric the lyric
+ * @param time_str the time format to use in the tags
+ * @param inside only keep the timings strictly inside the lyric timings
+ *
+ * @return the text, to free with free_cstring()
+ */
+cstring_t *nsub_word_text(song_t *song, lyric_t *lyric,
+		char *(*time_str)(int time, int show_sign), int inside);
+/**
+ * How to write a format lyric by lyric.
+ *
+ * @see nsub_writer()
+ */
+typedef struct {
+	/** Write what comes before the lyrics (the header, the metas...). */
+	void (*write_header)(FILE *out, song_t *song);
+	/** Write one lyric and update the state (if any). */
+	void (*write_lyric)(FILE *out, song_t *song, lyric_t *lyric, void *state);
+	/**
+	 * Set the (zeroed) state as it is just before the given lyric, when all
+	 * the previous ones have been written (NULL if no state).
+	 */
+	void (*init_state)(song_t *song, size_t ilyric, void *state);
+	/** The size of the state (0 if no state). */
+	size_t state_size;
+} writer_t;
+
+/**
+ * Get the lyric by lyric writer of a format.
+ *
+ * @param fmt the format to write in
+ * @param writer the writer to fill
+ *
+ * @return FALSE if this format cannot be written lyric by lyric
+ */
+int nsub_writer(NSUB_FORMAT fmt, writer_t *writer);
+void nsub_writer_lrc(writer_t *writer);
+void nsub_writer_webvtt(writer_t *writer);
+void nsub_writer_srt(writer_t *writer);
+void nsub_writer_jsonl(writer_t *writer);
+
+/**
+ * Write all the lyrics of a song, one after the other.
+ *
+ * A big song is cut in slices of lyrics which are formatted in parallel (see
+ * song_t.threads) and then written in order, so the output is the same as
+ * when writing the lyrics one by one.
+ *
+ * @param out the output stream
+ * @param song the song to write
+ * @param writer the writer of the format
+ *
+ * @return FALSE in case of error
+ */
+int nsub_write_lyrics(FILE *out, song_t *song, const writer_t *writer);
+
+int nsub_write_lrc(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_srt(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_ass(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_ttml(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_microdvd(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_subviewer(FILE *out, song_t *song, NSUB_FORMAT fmt);
+int nsub_write_jsonl(FILE *out, song_t *song, NSUB_FORMAT fmt);
+
+/* Batch */
+
+/**
+ * The I/O backend used for batch conversions.
+ */
+typedef int NSUB_IO;
+
+/** Use io_uring if available, plain POSIX I/O otherwise. */
+#define NSUB_IO_AUTO 0
+/** Plain POSIX I/O (open/read/write/close). */
+#define NSUB_IO_POSIX 1
+/** Linux io_uring (falls back to POSIX I/O if not available). */
+#define NSUB_IO_URING 2
+
+/**
+ * The parameters of a batch conversion.
+ */
+typedef struct {
+	/** The input format, or NSUB_FMT_UNKNOWN to guess it for each file. */
+	NSUB_FORMAT from;
+	/** The output format. */
+	NSUB_FORMAT to;
+	/** The output directory, or NULL to write next to the input files. */
+	char *outdir;
+	/** The transformations to apply, or NULL. */
+	pipeline_t *pipeline;
+	/** The I/O backend to use. */
+	NSUB_IO io;
+	/** The frame rate of the frame-based formats (0/0 = from the files). */
+	ratio_t fps;
+} batch_t;
+
+/**
+ * Convert a list of files in one go.
+ *
+ * Each output file is named after its input file, with the extension of the
+ * output format.
+ *
+ * With the io_uring backend, the opens, reads and writes of many files are
+ * submitted in batches, and the kernel works on them while the files already
+ * read are being parsed.
+ *
+ * @param batch the parameters of the conversion
+ * @param files the input files
+ * @param count the number of input files
+ *
+ * @return 0 if all the files were converted, an error code (as returned by the
+ * 		program) if not
+ */
+int nsub_batch(batch_t *batch, char **files, size_t count);
+
+/* Check */
+
+/**
+ * The rules of a check (validation of the files without conversion).
+ */
+typedef struct {
+	/** The input format, or NSUB_FMT_UNKNOWN to guess it for each file. */
+	NSUB_FORMAT from;
+	/** The maximum number of characters per line (0 = no check). */
+	int max_line;
+	/** The maximum number of characters per second (0 = no check). */
+	int max_cps;
+	/** The frame rate of the frame-based formats (0/0 = from the files). */
+	ratio_t fps;
+} check_t;
+
+/**
+ * Check the lyrics of a song in one pass: overlapping lyrics, zero or negative
+ * durations, lyrics out of order, bad numbering, lines too long and too many
+ * characters per second.
+ *
+ * Each issue is reported on one line, with tab-separated fields: name, lyric
+ * number, start time (ms), rule ("duration", "order", "overlap", "numbering",
+ * "line" or "cps") and a value (the offending quantity).
+ *
+ * @param song the song to check
+ * @param check the rules to apply
+ * @param name the name to use in the report
+ * @param out the report to append the issues to
+ *
+ * @return the number of issues found
+ */
+int nsub_check(song_t *song, check_t *check, const char *name,
+		cstring_t *out);
+
+/**
+ * Check many files in parallel, and write the report into the given stream.
+ *
+ * @note an unreadable file is reported with the rule "unreadable"
+ *
+ * @param check the rules to apply
+ * @param files the files to check
+ * @param count the number of files
+ * @param threads the number of threads to use (0 = one per CPU)
+ * @param out the stream to write the report to
+ *
+ * @return 0 if no issues were found, 44 if some were found, 22 if some files
+ * 		could not be read
+ */
+int nsub_check_files(check_t *check, char **files, size_t count,
+		int threads, FILE *out);
+
+/* Stats */
+
+/** The number of buckets of a histogram (not counting below and above). */
+#define NSUB_BUCKETS 100
+
+/**
+ * A histogram with fixed buckets: the histograms with the same bounds merge by
+ * adding their counts, so each thread can fill its own.
+ */
+typedef struct {
+	/** The lower bound of the first bucket. */
+	int min;
+	/** The width of each bucket. */
+	int width;
+	/** The number of values below min. */
+	size_t below;
+	/** The number of values in each bucket. */
+	size_t buckets[NSUB_BUCKETS];
+	/** The number of values from the end of the last bucket. */
+	size_t above;
+	/** The number of values. */
+	size_t count;
+	/** The sum of the values. */
+	long long sum;
+	/** The smallest value (only valid if count). */
+	int lowest;
+	/** The biggest value (only valid if count). */
+	int highest;
+} histogram_t;
+
+/**
+ * The files and lyrics of a language.
+ */
+typedef struct {
+	/** The language (NULL if unknown). */
+	char *lang;
+	size_t files;
+	size_t lyrics;
+} lang_t;
+
+/**
+ * Statistics over a set of songs, mergeable (see stats_merge()).
+ */
+typedef struct {
+	/** The number of songs. */
+	size_t files;
+	/** The number of files that could not be read. */
+	size_t unreadable;
+	/** The number of lyrics. */
+	size_t lyrics;
+	/** The durations of the lyrics (ms). */
+	histogram_t duration;
+	/** The characters per second of the lyrics (with a duration). */
+	histogram_t cps;
+	/** The gaps between a lyric and the next one (ms, negative if they
+	 * overlap). */
+	histogram_t gap;
+	/** The number of lines of the lyrics. */
+	histogram_t lines;
+	/** The languages of the songs (lang_t). */
+	array_t *langs;
+} stats_t;
+
+/**
+ * Create empty statistics.
+ *
+ * @return the statistics (free them with free_stats())
+ */
+stats_t *new_stats();
+
+/**
+ * Free the given statistics.
+ *
+ * @param stats the statistics to free (can be NULL)
+ */
+void free_stats(stats_t *stats);
+
+/**
+ * Add a song to the statistics.
+ *
+ * @param stats the statistics to update
+ * @param song the song to add
+ */
+void nsub_stats(stats_t *stats, song_t *song);
+
+/**
+ * Add some statistics to others.
+ *
+ * @param stats the statistics to update
+ * @param other the statistics to add (not modified)
+ */
+void stats_merge(stats_t *stats, stats_t *other);
+
+/**
+ * Write the statistics, as text (a summary and the non-empty buckets of each
+ * histogram) or as a JSON object.
+ *
+ * @note the percentiles are given to the bucket (its lower bound)
+ *
+ * @param stats the statistics to write
+ * @param json TRUE for a JSON object (on one line)
+ * @param out the stream to write to
+ */
+void stats_write(stats_t *stats, int json, FILE *out);
+
+/**
+ * Compute the statistics of many files in parallel (each thread fills its own
+ * statistics, merged at the end), and write them into the given stream.
+ *
+ * @param from the input format, or NSUB_FMT_UNKNOWN to guess it for each file
+ * @param fps the frame rate of the frame-based formats (0/0 = from the files)
+ * @param files the files to read
+ * @param count the number of files
+ * @param threads the number of threads to use (0 = one per CPU)
+ * @param json TRUE for a JSON object, FALSE for text (see stats_write())
+ * @param out the stream to write the statistics to
+ *
+ * @return 0 if all the files were read, 22 if some could not be
+ */
+int nsub_stats_files(NSUB_FORMAT from, ratio_t fps, char **files,
+		size_t count, int threads, int json, FILE *out);
+
+/* Index */
+
+/** The time covered by each entry of a sidecar index, in milliseconds. */
+#define NSUB_INDEX_BUCKET 10000
+
+/**
+ * The name of the sidecar index of a file (the file name plus
+ * <tt>.nsi</tt>).
+ *
+ * @param path the indexed file
+ *
+ * @return the name of its index (to free)
+ */
+char *nsub_index_path(const char *path);
+
+/**
+ * Write the sidecar index of a (big) SRT or WebVTT file: for each bucket of
+ * time, the byte offset and number of the first cue starting in it or later.
+ *
+ * If the file already has an index (and grew since), only the new part of
+ * the file is scanned and the new entries are appended to the index.
+ *
+ * @note the cues must be in time order
+ *
+ * @param path the file to index
+ * @param fmt its format (NSUB_FMT_SRT or NSUB_FMT_WEBVTT)
+ *
+ * @return FALSE in case of error
+ */
+int nsub_build_index(const char *path, NSUB_FORMAT fmt);
+
+/**
+ * Read only the lyrics displayed between two times.
+ *
+ * With an index, the input is read from the cues a bucket before the window
+ * and stops after it; without one (or if the input cannot seek), everything
+ * is read then filtered.
+ *
+ * @param song the song to fill
+ * @param in the input stream
+ * @param fmt the format of the input
+ * @param index_path the sidecar index of the input, or NULL
+ * @param from the start of the window in milliseconds
+ * @param to the end of the window in milliseconds
+ *
+ * @return FALSE in case of error
+ */
+int nsub_read_window(song_t *song, FILE *in, NSUB_FORMAT fmt,
+		const char *index_path, int from, int to);
+
+/* Library */
+
+/**
+ * Index the text of the cues of many files into a library index (a trigram
+ * inverted index), for nsub_library_search().
+ *
+ * The library keeps the files already indexed: the files that did not change
+ * since are not read again, the changed ones are read again and the ones that
+ * disappeared are removed from it. The files are read in parallel.
+ *
+ * @note the formatting tags are removed and the offsets applied, the timings
+ * 		are the ones displayed
+ *
+ * @param path the library index (created if needed)
+ * @param from the input format, or NSUB_FMT_UNKNOWN to guess it from each
+ * 		file name
+ * @param files the files to add (or update)
+ * @param count the number of files
+ * @param threads the number of threads to use (0 = one per CPU)
+ *
+ * @return 0 if OK, 22 if some files could not be read (the others are
+ * 		indexed), 3 if the library index cannot be written
+ */
+int nsub_library_index(const char *path, NSUB_FORMAT from, char **files,
+		size_t count, int threads);
+
+/**
+ * Search a phrase in a library index and write the cues containing it, one
+ * per line (tab-separated: file, lyric number, start and stop times in
+ * milliseconds, text).
+ *
+ * The case and the punctuation are ignored (the words must follow each other
+ * in the same cue, as whole words: "line 2" does not match "line 22").
+ *
+ * @param path the library index (see nsub_library_index())
+ * @param query the phrase to search for
+ * @param out the stream to write the matches to
+ *
+ * @return 0 if OK (even without matches), 2 if the library index cannot be
+ * 		read, 5 if the phrase has no words
+ */
+int nsub_library_search(const char *path, const char *query, FILE *out);
+
+/* Rewrite */
+
+/**
+ * Check that a conversion can be done by nsub_rewrite().
+ *
+ * @param from the input format (SRT or WebVTT)
+ * @param to the output format (SRT or WebVTT)
+ * @param pipeline the stages to apply (see nsub_pipeline_timings_only())
+ *
+ * @return TRUE if it can
+ */
+int nsub_can_rewrite(NSUB_FORMAT from, NSUB_FORMAT to, pipeline_t *pipeline);
+
+/**
+ * Convert an SRT or WebVTT stream without building a song: the texts are
+ * copied as they are, only the numbers and the timing lines are written
+ * again.
+ *
+ * The output is the same as reading, transforming then writing the song.
+ *
+ * @param in the input stream
+ * @param from the input format
+ * @param out the output stream
+ * @param to the output format
+ * @param pipeline the stages to apply (can be NULL)
+ *
+ * @return FALSE in case of error (as soon as the first cue, so nothing is
+ * 		written in that case)
+ */
+int nsub_rewrite(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline);
+
+/* Stream */
+
+/**
+ * Check that a conversion can be streamed (see nsub_stream()).
+ *
+ * @param from the input format (a line format that never goes back to a
+ * 		previous lyric: not LRC nor EBU STL)
+ * @param to the output format (see nsub_writer())
+ * @param pipeline the stages to apply (see nsub_pipeline_streamable())
+ *
+ * @return TRUE if it can
+ */
+int nsub_can_stream(NSUB_FORMAT from, NSUB_FORMAT to, pipeline_t *pipeline);
+
+/**
+ * Convert a stream without waiting for the whole song: an I/O thread reads
+ * the input by chunks, a parser thread turns them into batches of lyrics and
+ * the calling thread transforms and writes those batches as they come.
+ *
+ * The output is the same as reading, transforming then writing the song, as
+ * long as the metas are all before the first lyric.
+ *
+ * @param in the input stream
+ * @param from the input format
+ * @param out the output stream
+ * @param to the output format
+ * @param pipeline the stages to apply (can be NULL)
+ * @param fps the frame rate of the input (0/0 if unknown)
+ *
+ * @return FALSE in case of error
+ */
+int nsub_stream(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps);
+
+/**
+ * Convert a live stream (a pipe fed as things happen): like nsub_stream(), but
+ * each lyric is written (and flushed) as soon as it is complete, that is as
+ * soon as its block ends (its line for ASS, MicroDVD and JSON Lines, an empty
+ * line for SRT, WebVTT and SubViewer), or when no input came for some time
+ * (and its last line is complete).
+ *
+ * Only the lyrics not written yet are kept, so the memory stays bounded
+ * however long the stream runs.
+ *
+ * @param in the input stream
+ * @param from the input format
+ * @param out the output stream
+ * @param to the output format
+ * @param pipeline the stages to apply (can be NULL)
+ * @param fps the frame rate of the input (0/0 if unknown)
+ * @param idle the time in milliseconds after which the last lyric is written
+ * 		anyway when no input comes (0 to wait for the end of its block)
+ *
+ * @note the text that comes for a lyric after it was written is ignored,
+ * 		with a warning
+ *
+ * @return FALSE in case of error
+ */
+int nsub_live(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps, int idle);
+
+/* Watch */
+
+/**
+ * Watch a directory and convert the files as soon as they change, until the
+ * program is interrupted (SIGINT or SIGTERM).
+ *
+ * A file is converted once no more changes were seen on it for a short time
+ * (so a file being written is converted only once), by a pool of worker
+ * threads.
+ *
+ * @note the files already there are not converted, only the ones that change
+ * @note if the outputs are written in the watched directory, the files in
+ * 		one of the target formats are not converted
+ *
+ * @param batch the parameters of the conversions (its output format and
+ * 		pipeline are not used)
+ * @param to the target formats
+ * @param pipelines the transformations to apply for each target format (the
+ * 		offset is applied or not depending on the format)
+ * @param nto the number of target formats
+ * @param dir the directory to watch
+ * @param threads the number of worker threads (0 = one per CPU)
+ *
+ * @return 0 when interrupted, 2 if the directory cannot be watched
+ */
+int nsub_watch(batch_t *batch, NSUB_FORMAT *to, pipeline_t **pipelines,
+		size_t nto, const char *dir, int threads);
+
+/* Pool */
+
+/**
+ * A pool of worker threads processing the items of a queue.
+ */
+typedef struct pool_t pool_t;
+
+/**
+ * The number of CPUs available.
+ *
+ * @return the number of CPUs (at least 1)
+ */
+int nsub_cpus();
+
+/**
+ * Start a pool of worker threads.
+ *
+ * @param threads the number of threads (0 = one per CPU)
+ * @param work the function to call for each item (from any thread), with the
+ * 		data given here, the item and the index of the thread in the pool
+ * @param data the data to pass to the work function
+ *
+ * @return the pool, or NULL if no thread could be started
+ */
+pool_t *new_pool(int threads, void (*work)(void *data, void *item,
+		int ithread), void *data);
+int pool_threads(pool_t *pool);
+void pool_add(pool_t *pool, void *item);
+/** Wait until all the items queued so far have been processed. */
+void pool_wait(pool_t *pool);
+/** Process the remaining items, then stop the threads and free the pool. */
+void free_pool(pool_t *pool);
+
+/* Compression */
+
+/**
+ * Guess the compression scheme from the file name (<tt>.gz</tt> or
+ * <tt>.zst</tt> suffix).
+ *
+ * @param path the file name (can be NULL)
+ *
+ * @return the compression scheme, NSUB_COMP_NONE if none
+ */
+NSUB_COMPRESSION nsub_parse_compression(const char *path);
+
+/**
+ * Check if this compression scheme was compiled in.
+ *
+ * @param comp the compression scheme
+ *
+ * @return TRUE if it is supported
+ */
+int nsub_has_compression(NSUB_COMPRESSION comp);
+
+/**
+ * Detect a compressed input by its magic bytes and return a stream that
+ * decompresses it on the fly (no temporary file involved).
+ *
+ * @note if the input is not compressed, it is returned as-is (or wrapped if it
+ * 		cannot be rewound, like a pipe)
+ * @note closing the returned stream also closes the input
+ *
+ * @param in the input stream
+ *
+ * @return the (possibly decompressing) stream, or NULL on error
+ */
+FILE *nsub_decompress(FILE *in);
+
+/**
+ * Return a stream that compresses everything written to it on the fly.
+ *
+ * @note closing the returned stream finishes the compressed data and closes
+ * 		the output
+ *
+ * @param out the output stream
+ * @param comp the compression scheme to apply
+ *
+ * @return the (possibly compressing) stream, or NULL on error
+ */
+FILE *nsub_compress(FILE *out, NSUB_COMPRESSION comp);
 
 #endif /* NSUB_H */
@@ -0,0 +1,332 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// the size of a bin of the activity signals, in milliseconds
+#define ALIGN_BIN 100
+// the maximum distance between two matching lyrics after the rough alignment
+#define ALIGN_MATCH 600
+// the maximum number of least squares passes
+#define ALIGN_PASSES 64
+
+// the usual speed changes between two cuts (23.976, 24 and 25 fps, and NTSC
+// 30000/1001 vs 30 fps), as ref/song
+static const long long ratios[][2] = {
+	{ 1, 1 },
+	{ 25, 24 }, { 24, 25 },
+	{ 25025, 24000 }, { 24000, 25025 },
+	{ 1001, 1000 }, { 1000, 1001 },
+};
+
+// the (effective) start times of the lyrics, sorted
+static int *starts(song_t *song, size_t *count);
+// the activity signal (1 with a lyric, -1 without, 0 after the end) of the
+// song with its timings scaled by a ratio, return its length in bins
+static size_t activity(song_t *song, double ratio, double *re, size_t size);
+// in-place radix-2 FFT (size must be a power of 2)
+static void fft(double *re, double *im, size_t size, int inverse);
+// fit ref = slope * time + intercept on the lyrics that match (least
+// squares, only the intercept if fixed), return the number of matches
+static size_t fit(int *times, size_t count, int *refs, size_t nrefs,
+		double *slope, double *intercept, int fixed);
+
+/* Public */
+
+int nsub_align(song_t *song, song_t *ref, ratio_t *ratio, int *shift) {
+	size_t count = 0;
+	size_t nrefs = 0;
+	int *times = starts(song, &count);
+	int *refs = starts(ref, &nrefs);
+	if (!count || !nrefs) {
+		fprintf(stderr, "Cannot align: no lyrics to align\n");
+		free(times);
+		free(refs);
+		return 0;
+	}
+
+	// Room for both signals (no wrap around), and for the faster ratio
+	size_t bins = 0;
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type == NSUB_LYRIC && lyric->stop + song->offset > 0)
+			bins = (size_t) (lyric->stop + song->offset) / ALIGN_BIN + 1;
+	}
+	array_loop(ref->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type == NSUB_LYRIC && lyric->stop + ref->offset > 0) {
+			size_t b = (size_t) (lyric->stop + ref->offset) / ALIGN_BIN + 1;
+			if (b > bins)
+				bins = b;
+		}
+	}
+
+	size_t size = 1;
+	while (size < 3 * bins)
+		size *= 2;
+
+	double *ref_re = calloc(size, sizeof(double));
+	double *ref_im = calloc(size, sizeof(double));
+	double *re = calloc(size, sizeof(double));
+	double *im = calloc(size, sizeof(double));
+	if (!ref_re || !ref_im || !re || !im) {
+		fprintf(stderr, "Cannot align: not enough memory\n");
+		free(ref_re);
+		free(ref_im);
+		free(re);
+		free(im);
+		free(times);
+		free(refs);
+		return 0;
+	}
+
+	activity(ref, 1, ref_re, size);
+	fft(ref_re, ref_im, size, 0);
+
+	// Rough alignment: the best cross-correlation of the activity signals,
+	// for each usual ratio
+	size_t best_ratio = 0;
+	long long best_lag = 0;
+	double best_score = -1;
+	for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); i++) {
+		double r = (double) ratios[i][0] / ratios[i][1];
+		memset(im, 0, size * sizeof(double));
+		double norm = sqrt((double) activity(song, r, re, size) + 1);
+		fft(re, im, size, 0);
+
+		// conj(song) * ref
+		for (size_t j = 0; j < size; j++) {
+			double a = re[j];
+			double b = -im[j];
+			re[j] = a * ref_re[j] - b * ref_im[j];
+			im[j] = a * ref_im[j] + b * ref_re[j];
+		}
+		fft(re, im, size, 1);
+
+		for (size_t j = 0; j < size; j++) {
+			double score = re[j] / size / norm;
+			if (score > best_score) {
+				best_score = score;
+				best_ratio = i;
+				// the second half are the negative lags
+				best_lag = j < size / 2 ? (long long) j
+						: (long long) j - (long long) size;
+			}
+		}
+	}
+
+	free(ref_re);
+	free(ref_im);
+	free(re);
+	free(im);
+
+	// Fine alignment: least squares on the matching lyrics
+	double r = (double) ratios[best_ratio][0] / ratios[best_ratio][1];
+	double slope = r;
+	double intercept = (double) best_lag * ALIGN_BIN;
+	// (each pass matches more lyrics when the ratio is not a usual one)
+	for (int pass = 0; pass < ALIGN_PASSES; pass++) {
+		double s = slope;
+		double b = intercept;
+		if (fit(times, count, refs, nrefs, &s, &b, 0) < 2)
+			break;
+
+		int stable = fabs(s - slope) < 1e-7 && fabs(b - intercept) < 1;
+		slope = s;
+		intercept = b;
+		if (stable)
+			break;
+	}
+
+	// Keep the exact usual ratio when it is close enough
+	if (fabs(slope - r) < 1e-4) {
+		slope = r;
+		fit(times, count, refs, nrefs, &slope, &intercept, 1);
+		*ratio = (ratio_t) { ratios[best_ratio][0], ratios[best_ratio][1] };
+	} else {
+		ratio_t tmp = { llround(slope * 1000000), 1000000 };
+		*ratio = nsub_fps_ratio((ratio_t) { 1, 1 }, tmp);
+	}
+
+	free(times);
+	free(refs);
+
+	// The fit is on the effective times (with the offsets), but the result
+	// is applied to the lyric timings (the song offset is kept)
+	*shift = (int) llround(intercept) + apply_ratio(song->offset, *ratio)
+			- song->offset;
+
+	return 1;
+}
+
+/* Private */
+
+static int cmp_int(const void *a, const void *b) {
+	int ia = *(const int *) a;
+	int ib = *(const int *) b;
+	return (ia > ib) - (ia < ib);
+}
+
+static int *starts(song_t *song, size_t *count) {
+	int *times = malloc((array_count(song->lyrics) + 1) * sizeof(int));
+	*count = 0;
+	if (!times)
+		return NULL;
+
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type == NSUB_LYRIC)
+			times[(*count)++] = lyric->start + song->offset;
+	}
+
+	qsort(times, *count, sizeof(int), cmp_int);
+	return times;
+}
+
+static size_t activity(song_t *song, double ratio, double *re, size_t size) {
+	// Only the first third is used, the rest is padding
+	size_t used = size / 3;
+	size_t end = 0;
+	memset(re, 0, size * sizeof(double));
+
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type != NSUB_LYRIC)
+			continue;
+
+		double start = (lyric->start + song->offset) * ratio / ALIGN_BIN;
+		double stop = (lyric->stop + song->offset) * ratio / ALIGN_BIN;
+		size_t from = start > 0 ? (size_t) start : 0;
+		size_t to = stop > 0 ? (size_t) stop : 0;
+		if (to > used)
+			to = used;
+		for (size_t i = from; i < to; i++)
+			re[i] = 1;
+		if (to > end)
+			end = to;
+	}
+
+	for (size_t i = 0; i < end; i++) {
+		if (!re[i])
+			re[i] = -1;
+	}
+
+	return end;
+}
+
+static void fft(double *re, double *im, size_t size, int inverse) {
+	// Bit reversal permutation
+	for (size_t i = 1, j = 0; i < size; i++) {
+		size_t bit = size >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+
+		if (i < j) {
+			double tmp = re[i];
+			re[i] = re[j];
+			re[j] = tmp;
+			tmp = im[i];
+			im[i] = im[j];
+			im[j] = tmp;
+		}
+	}
+
+	// Butterflies
+	for (size_t len = 2; len <= size; len <<= 1) {
+		double angle = 2 * M_PI / len * (inverse ? 1 : -1);
+		double wre = cos(angle);
+		double wim = sin(angle);
+		for (size_t i = 0; i < size; i += len) {
+			double cre = 1;
+			double cim = 0;
+			for (size_t j = 0; j < len / 2; j++) {
+				size_t a = i + j;
+				size_t b = i + j + len / 2;
+				double vre = re[b] * cre - im[b] * cim;
+				double vim = re[b] * cim + im[b] * cre;
+				re[b] = re[a] - vre;
+				im[b] = im[a] - vim;
+				re[a] += vre;
+				im[a] += vim;
+
+				double tmp = cre * wre - cim * wim;
+				cim = cre * wim + cim * wre;
+				cre = tmp;
+			}
+		}
+	}
+}
+
+static size_t fit(int *times, size_t count, int *refs, size_t nrefs,
+		double *slope, double *intercept, int fixed) {
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	size_t n = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		double guess = *slope * times[i] + *intercept;
+
+		// The nearest reference lyric (binary search)
+		size_t lo = 0;
+		size_t hi = nrefs;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (refs[mid] < guess)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == nrefs || (lo && guess - refs[lo - 1] < refs[lo] - guess))
+			lo--;
+
+		if (fabs(refs[lo] - guess) > ALIGN_MATCH)
+			continue;
+
+		sx += times[i];
+		sy += refs[lo];
+		sxx += (double) times[i] * times[i];
+		sxy += (double) times[i] * refs[lo];
+		n++;
+	}
+
+	if (n < 2)
+		return n;
+
+	double den = n * sxx - sx * sx;
+	if (fixed || fabs(den) < 1e-9) {
+		*intercept = (sy - *slope * sx) / n;
+	} else {
+		*slope = (n * sxy - sx * sy) / den;
+		*intercept = (sy - *slope * sx) / n;
+	}
+
+	return n;
+}
@@ -0,0 +1,668 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// fmemopen(), open_memstream() and syscall()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef NSUB_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// initial size of the input buffers (most subtitles will fit)
+#define BATCH_BUF 65536
+
+// the output name of the given input file
+static char *out_name(batch_t *batch, const char *path);
+// convert an input file (in memory) into an output file (in memory)
+static int convert(batch_t *batch, const char *path, char *data, size_t len,
+		char **out, size_t *out_len);
+
+// the plain POSIX implementation
+static int batch_posix(batch_t *batch, char **files, size_t count);
+static int read_file(const char *path, char **data, size_t *len);
+static int write_file(const char *path, char *data, size_t len);
+
+#ifdef NSUB_URING
+
+// number of files processed at the same time
+#define URING_SLOTS 64
+// number of entries in the submission queue
+#define URING_ENTRIES 256
+
+// the io_uring rings (no liburing required)
+typedef struct {
+	int fd;
+	unsigned entries;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned tail;
+	unsigned pending;
+	unsigned inflight;
+} uring_t;
+
+// the state of a file being converted
+typedef enum {
+	SLOT_FREE, SLOT_OPEN, SLOT_READ, SLOT_READY, SLOT_CREATE, SLOT_WRITE
+} SLOT_STATE;
+
+// one file being converted
+typedef struct {
+	SLOT_STATE state;
+	char *path;
+	char *out_path;
+	int fd;
+	char *data;
+	size_t len;
+	size_t cap;
+	char *out;
+	size_t out_len;
+	size_t written;
+} slot_t;
+
+// the user_data of an operation: slot index and operation
+#define URING_OP_CLOSE 7
+#define URING_DATA(islot, op) ((((__u64) (islot)) << 3) | (op))
+
+static int batch_uring(batch_t *batch, char **files, size_t count);
+static int uring_init(uring_t *ring);
+static void uring_exit(uring_t *ring);
+static int uring_probe(uring_t *ring);
+static struct io_uring_sqe *uring_sqe(uring_t *ring);
+static int uring_enter(uring_t *ring, unsigned wait);
+static int slot_submit(uring_t *ring, slot_t *slot, size_t islot);
+static void slot_close(uring_t *ring, int fd);
+static void slot_free(slot_t *slot);
+#endif
+
+/* Public */
+
+int nsub_batch(batch_t *batch, char **files, size_t count) {
+#ifdef NSUB_URING
+	if (batch->io != NSUB_IO_POSIX) {
+		int rep = batch_uring(batch, files, count);
+		if (rep >= 0)
+			return rep;
+
+		if (batch->io == NSUB_IO_URING)
+			fprintf(stderr, "io_uring is not available, "
+					"falling back to POSIX I/O\n");
+	}
+#else
+	if (batch->io == NSUB_IO_URING)
+		fprintf(stderr, "nsub was compiled without io_uring support, "
+				"falling back to POSIX I/O\n");
+#endif
+
+	return batch_posix(batch, files, count);
+}
+
+/* Private */
+
+static char *out_name(batch_t *batch, const char *path) {
+	const char *base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+
+	cstring_t *name = new_cstring();
+	if (batch->outdir) {
+		cstring_add(name, batch->outdir);
+		if (name->length && name->string[name->length - 1] != '/')
+			cstring_add_car(name, '/');
+	} else {
+		cstring_addn(name, path, base - path);
+	}
+
+	// strip the extension (and compression suffix) if any
+	char *ext = nsub_file_ext((char *) base);
+	cstring_addn(name, base, ext ? (size_t) (ext - 1 - base) : strlen(base));
+	cstring_add_car(name, '.');
+	cstring_add(name, nsub_fmt_ext(batch->to));
+
+	if (!strcmp(name->string, path)) {
+		fprintf(stderr, "Refusing to overwrite the input file: %s\n", path);
+		free_cstring(name);
+		return NULL;
+	}
+
+	return cstring_convert(name);
+}
+
+static int convert(batch_t *batch, const char *path, char *data, size_t len,
+		char **out, size_t *out_len) {
+	NSUB_FORMAT from = batch->from;
+	if (from == NSUB_FMT_UNKNOWN) {
+		char *ext = nsub_file_ext((char *) path);
+		if (ext)
+			from = nsub_parse_fmt(ext, 0);
+	}
+
+	if (from == NSUB_FMT_UNKNOWN) {
+		fprintf(stderr, "Cannot detect input format: %s\n", path);
+		return 0;
+	}
+
+	// fmemopen() does not like empty buffers
+	static char empty[1] = { '\0' };
+	FILE *in = fmemopen(len ? data : empty, len ? len : 1, "r");
+	if (in && !len)
+		getc(in);
+	if (in)
+		in = nsub_decompress(in);
+	if (!in) {
+		fprintf(stderr, "Cannot read input file: %s\n", path);
+		return 0;
+	}
+
+	// SRT and WebVTT conversions of the timings only need no song at all
+	if (nsub_can_rewrite(from, batch->to, batch->pipeline)) {
+		FILE *mem = open_memstream(out, out_len);
+		int ok = mem && nsub_rewrite(in, from, mem, batch->to,
+				batch->pipeline);
+		fclose(in);
+		if (mem)
+			ok = !fclose(mem) && ok;
+		if (!ok)
+			fprintf(stderr, "Cannot parse input file: %s\n", path);
+		return ok;
+	}
+
+	song_t *song = new_song();
+	song->fps = batch->fps;
+	song->intern = 1;
+	int read = nsub_read_into(song, in, from);
+	fclose(in);
+	if (!read) {
+		fprintf(stderr, "Cannot parse input file: %s\n", path);
+		free_song(song);
+		return 0;
+	}
+
+	int ok = nsub_transform(song, batch->pipeline);
+	FILE *mem = ok ? open_memstream(out, out_len) : NULL;
+	if (mem) {
+		ok = nsub_write(mem, song, batch->to);
+		ok = !fclose(mem) && ok;
+	}
+
+	free_song(song);
+	return ok;
+}
+
+static int batch_posix(batch_t *batch, char **files, size_t count) {
+	int rep = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		char *data = NULL;
+		char *out = NULL;
+		size_t len = 0;
+		size_t out_len = 0;
+
+		char *out_path = out_name(batch, files[i]);
+		if (!out_path) {
+			rep = 33;
+			continue;
+		}
+
+		if (!read_file(files[i], &data, &len)) {
+			fprintf(stderr, "Cannot open input file: %s\n", files[i]);
+			rep = 22;
+		} else if (!convert(batch, files[i], data, len, &out, &out_len)) {
+			rep = 22;
+		} else if (!write_file(out_path, out, out_len)) {
+			fprintf(stderr, "Cannot create output file: %s\n", out_path);
+			rep = 33;
+		}
+
+		free(data);
+		free(out);
+		free(out_path);
+	}
+
+	return rep;
+}
+
+static int read_file(const char *path, char **data, size_t *len) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	struct stat st;
+	size_t cap = BATCH_BUF;
+	if (!fstat(fd, &st) && st.st_size > 0)
+		cap = st.st_size + 1;
+
+	*data = malloc(cap);
+	*len = 0;
+
+	ssize_t n = 1;
+	while (*data && n > 0) {
+		if (*len == cap) {
+			cap *= 2;
+			char *tmp = realloc(*data, cap);
+			if (!tmp) {
+				free(*data);
+				*data = NULL;
+				break;
+			}
+			*data = tmp;
+		}
+
+		n = read(fd, *data + *len, cap - *len);
+		if (n > 0)
+			*len += n;
+	}
+
+	close(fd);
+	return *data && !n;
+}
+
+static int write_file(const char *path, char *data, size_t len) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return 0;
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = write(fd, data + done, len - done);
+		if (n < 0 && errno != EINTR)
+			break;
+		if (n > 0)
+			done += n;
+	}
+
+	return !close(fd) && done == len;
+}
+
+#ifdef NSUB_URING
+
+/*
+ * Each file goes through: open -> read (until a short read) -> parse and
+ * format -> create -> write, with the closes submitted as fire-and-forget.
+ * Up to URING_SLOTS files are in flight, so the kernel keeps doing I/O for
+ * the other files while we parse the ones that are ready.
+ */
+static int batch_uring(batch_t *batch, char **files, size_t count) {
+	uring_t ring;
+	if (!uring_init(&ring))
+		return -1;
+
+	if (!uring_probe(&ring)) {
+		uring_exit(&ring);
+		return -1;
+	}
+
+	int rep = 0;
+	slot_t slots[URING_SLOTS];
+	memset(slots, 0, sizeof(slots));
+
+	size_t next = 0;
+	size_t active = 0;
+	while (next < count || active) {
+		// Start new files
+		for (size_t i = 0; next < count && i < URING_SLOTS; i++) {
+			if (slots[i].state != SLOT_FREE)
+				continue;
+			if (ring.inflight + ring.pending >= ring.entries)
+				break;
+
+			slot_t *slot = &slots[i];
+			slot->path = files[next++];
+			slot->out_path = out_name(batch, slot->path);
+			if (!slot->out_path) {
+				rep = 33;
+				continue;
+			}
+
+			slot->state = SLOT_OPEN;
+			slot_submit(&ring, slot, i);
+			active++;
+		}
+
+		// Let the kernel work while we parse
+		if (ring.pending && uring_enter(&ring, 0) < 0) {
+			rep = 22;
+			break;
+		}
+
+		int busy = 0;
+		for (size_t i = 0; i < URING_SLOTS; i++) {
+			slot_t *slot = &slots[i];
+			if (slot->state != SLOT_READY)
+				continue;
+			if (ring.inflight + ring.pending + 2 >= ring.entries)
+				break;
+
+			busy = 1;
+			if (convert(batch, slot->path, slot->data, slot->len, &slot->out,
+					&slot->out_len)) {
+				slot->state = SLOT_CREATE;
+				slot_submit(&ring, slot, i);
+			} else {
+				rep = 22;
+				slot_free(slot);
+				active--;
+			}
+		}
+
+		if (!active)
+			continue;
+
+		// Wait for at least one event if we have nothing else to do
+		if ((ring.pending || !busy) && uring_enter(&ring, busy ? 0 : 1) < 0) {
+			rep = 22;
+			break;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			int op = cqe->user_data & 7;
+			slot_t *slot = &slots[cqe->user_data >> 3];
+			int res = cqe->res;
+
+			ring.inflight--;
+			if (op == URING_OP_CLOSE)
+				continue;
+
+			// An error ends the file (its fd is closed if it was opened)
+			int err = res < 0 ? -res : 0;
+			switch (err ? -1 : op) {
+			case SLOT_OPEN:
+				slot->fd = res;
+				slot->cap = BATCH_BUF;
+				slot->data = malloc(slot->cap);
+				if (!slot->data) {
+					err = ENOMEM;
+					break;
+				}
+				slot->state = SLOT_READ;
+				slot_submit(&ring, slot, cqe->user_data >> 3);
+				break;
+			case SLOT_READ:
+				slot->len += res;
+				if (slot->len < slot->cap) {
+					// Short read on a regular file: we are at EOF
+					slot_close(&ring, slot->fd);
+					slot->state = SLOT_READY;
+				} else {
+					char *data = realloc(slot->data, slot->cap * 2);
+					if (!data) {
+						err = ENOMEM;
+						break;
+					}
+					slot->cap *= 2;
+					slot->data = data;
+					slot_submit(&ring, slot, cqe->user_data >> 3);
+				}
+				break;
+			case SLOT_CREATE:
+				slot->fd = res;
+				slot->state = SLOT_WRITE;
+				slot_submit(&ring, slot, cqe->user_data >> 3);
+				break;
+			case SLOT_WRITE:
+				slot->written += res;
+				if (slot->written < slot->out_len && !res) {
+					// Nothing written: the output would be truncated
+					err = EIO;
+				} else if (slot->written < slot->out_len) {
+					slot_submit(&ring, slot, cqe->user_data >> 3);
+				} else {
+					slot_close(&ring, slot->fd);
+					slot_free(slot);
+					active--;
+				}
+				break;
+			}
+
+			if (err) {
+				fprintf(stderr, "%s: %s\n",
+					op == SLOT_OPEN || op == SLOT_READ ?
+						slot->path : slot->out_path,
+					strerror(err)
+				);
+				rep = (op == SLOT_OPEN || op == SLOT_READ) ? 22 : 33;
+				if (res >= 0 || op == SLOT_READ || op == SLOT_WRITE)
+					slot_close(&ring, slot->fd);
+				slot_free(slot);
+				active--;
+			}
+		}
+
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Submit the last closes
+	while (ring.pending || ring.inflight) {
+		if (uring_enter(&ring, ring.inflight ? 1 : 0) < 0)
+			break;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		ring.inflight -= tail - *ring.cq_head;
+		__atomic_store_n(ring.cq_head, tail, __ATOMIC_RELEASE);
+	}
+
+	uring_exit(&ring);
+	return rep;
+}
+
+static int uring_init(uring_t *ring) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(uring_t));
+
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring->fd < 0)
+		return 0;
+
+	ring->entries = p.sq_entries;
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return 0;
+	}
+
+	ring->cq_ptr = ring->sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_size);
+			close(ring->fd);
+			return 0;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ptr != ring->sq_ptr)
+			munmap(ring->cq_ptr, ring->cq_size);
+		munmap(ring->sq_ptr, ring->sq_size);
+		close(ring->fd);
+		return 0;
+	}
+
+	char *sq = ring->sq_ptr;
+	char *cq = ring->cq_ptr;
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	return 1;
+}
+
+static void uring_exit(uring_t *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_probe(uring_t *ring) {
+	size_t size = sizeof(struct io_uring_probe)
+		+ 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = malloc(size);
+	if (!probe)
+		return 0;
+
+	memset(probe, 0, size);
+	int ok = !syscall(__NR_io_uring_register, ring->fd,
+			IORING_REGISTER_PROBE, probe, 256);
+
+	int ops[] = {
+		IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE
+	};
+	for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+		ok = ops[i] <= probe->last_op
+			&& (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	free(probe);
+	return ok;
+}
+
+static struct io_uring_sqe *uring_sqe(uring_t *ring) {
+	unsigned idx = ring->tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	ring->sq_array[idx] = idx;
+	ring->tail++;
+	ring->pending++;
+
+	return sqe;
+}
+
+static int uring_enter(uring_t *ring, unsigned wait) {
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+	int rep;
+	do {
+		rep = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+				wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (rep < 0 && errno == EINTR);
+
+	if (rep < 0) {
+		fprintf(stderr, "io_uring: %s\n", strerror(errno));
+		return rep;
+	}
+
+	ring->inflight += rep;
+	ring->pending -= rep;
+	return rep;
+}
+
+static int slot_submit(uring_t *ring, slot_t *slot, size_t islot) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->user_data = URING_DATA(islot, slot->state);
+
+	switch (slot->state) {
+	case SLOT_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (__u64) (unsigned long) slot->path;
+		sqe->open_flags = O_RDONLY;
+		break;
+	case SLOT_READ:
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = slot->fd;
+		sqe->addr = (__u64) (unsigned long) (slot->data + slot->len);
+		sqe->len = slot->cap - slot->len;
+		sqe->off = slot->len;
+		break;
+	case SLOT_CREATE:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (__u64) (unsigned long) slot->out_path;
+		sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+		sqe->len = 0666;
+		break;
+	case SLOT_WRITE:
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = slot->fd;
+		sqe->addr = (__u64) (unsigned long) (slot->out + slot->written);
+		sqe->len = slot->out_len - slot->written;
+		sqe->off = slot->written;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+static void slot_close(uring_t *ring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = URING_DATA(0, URING_OP_CLOSE);
+}
+
+static void slot_free(slot_t *slot) {
+	free(slot->data);
+	free(slot->out);
+	free(slot->out_path);
+	memset(slot, 0, sizeof(slot_t));
+}
+
+#endif /* NSUB_URING */
@@ -0,0 +1,208 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the shared state of a parallel check
+typedef struct {
+	check_t *check;
+	FILE *report;
+	pthread_mutex_t lock;
+	size_t issues;
+	int rep;
+} check_run_t;
+
+// check one file (pool worker)
+static void check_file(void *data, void *item, int ithread);
+// add an issue to the report
+static void report(cstring_t *out, const char *name, lyric_t *lyric,
+		const char *rule, int value);
+
+/* Public */
+
+int nsub_check(song_t *song, check_t *check, const char *name,
+		cstring_t *out) {
+	int issues = 0;
+	lyric_t *prev = NULL;
+	// the latest stop so far (a long lyric can overlap several others)
+	int last_stop = 0;
+
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type != NSUB_LYRIC)
+			continue;
+
+		int duration = lyric->stop - lyric->start;
+		if (duration <= 0) {
+			report(out, name, lyric, "duration", duration);
+			issues++;
+		}
+
+		if (prev) {
+			if (lyric->start < prev->start) {
+				report(out, name, lyric, "order", prev->start - lyric->start);
+				issues++;
+			} else if (lyric->start < last_stop) {
+				report(out, name, lyric, "overlap", last_stop - lyric->start);
+				issues++;
+			}
+
+			if (lyric->id && prev->id && lyric->id != prev->id + 1) {
+				report(out, name, lyric, "numbering", lyric->id);
+				issues++;
+			}
+		}
+
+		// Count the characters (not the bytes) of each line
+		int chars = 0;
+		int line = 0;
+		int max_line = 0;
+		for (char *ptr = lyric->text; ptr && *ptr; ptr++) {
+			if (*ptr == '\n') {
+				line = 0;
+			} else if ((*ptr & 0xC0) != 0x80) {
+				line++;
+				chars++;
+				if (line > max_line)
+					max_line = line;
+			}
+		}
+
+		if (check->max_line > 0 && max_line > check->max_line) {
+			report(out, name, lyric, "line", max_line);
+			issues++;
+		}
+
+		if (check->max_cps > 0 && duration > 0
+				&& chars * 1000 > check->max_cps * duration) {
+			report(out, name, lyric, "cps", chars * 1000 / duration);
+			issues++;
+		}
+
+		if (!prev || lyric->stop > last_stop)
+			last_stop = lyric->stop;
+		prev = lyric;
+	}
+
+	return issues;
+}
+
+int nsub_check_files(check_t *check, char **files, size_t count,
+		int threads, FILE *out) {
+	check_run_t run;
+	run.check = check;
+	run.report = out;
+	run.issues = 0;
+	run.rep = 0;
+	pthread_mutex_init(&run.lock, NULL);
+
+	pool_t *pool = new_pool(threads, check_file, &run);
+	if (!pool) {
+		pthread_mutex_destroy(&run.lock);
+		return 22;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		pool_add(pool, files[i]);
+	free_pool(pool);
+
+	fflush(out);
+	pthread_mutex_destroy(&run.lock);
+
+	fprintf(stderr, "%zu issue(s) found in %zu file(s)\n", run.issues, count);
+	if (!run.rep && run.issues)
+		run.rep = 44;
+
+	return run.rep;
+}
+
+/* Private */
+
+static void check_file(void *data, void *item, int ithread) {
+	check_run_t *run = data;
+	char *path = item;
+	song_t *song = NULL;
+
+	NSUB_FORMAT fmt = run->check->from;
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		char *ext = nsub_file_ext(path);
+		if (ext)
+			fmt = nsub_parse_fmt(ext, 0);
+	}
+
+	FILE *in = NULL;
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		fprintf(stderr, "Cannot detect input format: %s\n", path);
+	} else {
+		in = fopen(path, "r");
+		if (!in)
+			fprintf(stderr, "Cannot open input file: %s\n", path);
+	}
+
+	if (in) {
+		FILE *raw = in;
+		in = nsub_decompress(raw);
+		if (in) {
+			song = new_song();
+			song->fps = run->check->fps;
+			if (!nsub_read_into(song, in, fmt)) {
+				free_song(song);
+				song = NULL;
+			}
+			fclose(in);
+		} else {
+			fclose(raw);
+		}
+	}
+
+	if (!song) {
+		pthread_mutex_lock(&run->lock);
+		fprintf(run->report, "%s\t0\t0\tunreadable\t0\n", path);
+		run->rep = 22;
+		pthread_mutex_unlock(&run->lock);
+		return;
+	}
+
+	// The report of a file is written in one go
+	cstring_t *out = new_cstring();
+	int issues = nsub_check(song, run->check, path, out);
+	free_song(song);
+
+	if (issues) {
+		pthread_mutex_lock(&run->lock);
+		fwrite(out->string, 1, out->length, run->report);
+		run->issues += issues;
+		pthread_mutex_unlock(&run->lock);
+	}
+
+	free_cstring(out);
+}
+
+static void report(cstring_t *out, const char *name, lyric_t *lyric,
+		const char *rule, int value) {
+	cstring_addf(out, "%s\t%d\t%d\t%s\t%d\n", name, lyric->num, lyric->start,
+			rule, value);
+}
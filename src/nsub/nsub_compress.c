@@ -0,0 +1,491 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// fopencookie() is a GNU extension
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef NSUB_ZLIB
+#include <zlib.h>
+#endif
+#ifdef NSUB_ZSTD
+#include <zstd.h>
+#endif
+
+#include "nsub.h"
+
+/* Declarations */
+
+// size of the compressed-side buffers
+#define ZBUF_SIZE 65536
+
+// magic bytes
+static const unsigned char GZIP_MAGIC[] = { 0x1f, 0x8b };
+static const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+// state of a (de)compressing stream, shared by all cookies
+typedef struct {
+	FILE *raw;
+	NSUB_COMPRESSION comp;
+	int eof;
+	// reading: in the middle of a gzip member or zstd frame
+	int open;
+	unsigned char *buf;
+	size_t len;
+	size_t pos;
+#ifdef NSUB_ZLIB
+	z_stream z;
+#endif
+#ifdef NSUB_ZSTD
+	ZSTD_DStream *zd;
+	ZSTD_CStream *zc;
+#endif
+} zfile_t;
+
+// read the rest of the magic (n bytes), returns how many were consumed
+static size_t peek_magic(FILE *in, unsigned char *magic,
+		const unsigned char *expected, size_t n);
+// re-inject the already consumed bytes in front of the stream
+static FILE *replay(FILE *in, unsigned char *head, size_t len);
+static zfile_t *new_zfile(FILE *raw, NSUB_COMPRESSION comp);
+static void free_zfile(zfile_t *zfile);
+
+static ssize_t replay_read(void *cookie, char *buf, size_t size);
+static ssize_t zfile_read(void *cookie, char *buf, size_t size);
+static ssize_t zfile_write(void *cookie, const char *buf, size_t size);
+static int zfile_close(void *cookie);
+
+/* Public */
+
+NSUB_COMPRESSION nsub_parse_compression(const char *path) {
+	const char *ext = path ? strrchr(path, '.') : NULL;
+	if (!ext)
+		return NSUB_COMP_NONE;
+
+	ext++;
+	if (!strcmp("gz", ext))
+		return NSUB_COMP_GZIP;
+	if (!strcmp("zst", ext))
+		return NSUB_COMP_ZSTD;
+
+	return NSUB_COMP_NONE;
+}
+
+int nsub_has_compression(NSUB_COMPRESSION comp) {
+	switch (comp) {
+	case NSUB_COMP_NONE:
+		return 1;
+#ifdef NSUB_ZLIB
+	case NSUB_COMP_GZIP:
+		return 1;
+#endif
+#ifdef NSUB_ZSTD
+	case NSUB_COMP_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+FILE *nsub_decompress(FILE *in) {
+	unsigned char magic[4];
+	NSUB_COMPRESSION comp = NSUB_COMP_NONE;
+
+	// Fast path: only '\x1f' and '(' can start a compressed stream
+	int car = getc(in);
+	if (car == EOF)
+		return in;
+	if (car != GZIP_MAGIC[0] && car != ZSTD_MAGIC[0]) {
+		ungetc(car, in);
+		return in;
+	}
+
+	magic[0] = car;
+	size_t len = 1;
+	if (car == GZIP_MAGIC[0])
+		len += peek_magic(in, magic + 1, GZIP_MAGIC + 1, 1);
+	else
+		len += peek_magic(in, magic + 1, ZSTD_MAGIC + 1, 3);
+
+	if (len == 2 && !memcmp(magic, GZIP_MAGIC, 2))
+		comp = NSUB_COMP_GZIP;
+	if (len == 4 && !memcmp(magic, ZSTD_MAGIC, 4))
+		comp = NSUB_COMP_ZSTD;
+
+	if (comp == NSUB_COMP_NONE)
+		return replay(in, magic, len);
+
+	if (!nsub_has_compression(comp)) {
+		fprintf(stderr, "The input is %s-compressed, but nsub was "
+				"compiled without %s support\n",
+			comp == NSUB_COMP_GZIP ? "gzip" : "zstd",
+			comp == NSUB_COMP_GZIP ? "gzip" : "zstd"
+		);
+		return NULL;
+	}
+
+	zfile_t *zfile = new_zfile(in, comp);
+	if (!zfile)
+		return NULL;
+
+	// the magic is part of the compressed stream
+	memcpy(zfile->buf, magic, len);
+	zfile->len = len;
+
+	cookie_io_functions_t io = { zfile_read, NULL, NULL, zfile_close };
+	FILE *cin = fopencookie(zfile, "r", io);
+	if (!cin)
+		free_zfile(zfile);
+
+	return cin;
+}
+
+FILE *nsub_compress(FILE *out, NSUB_COMPRESSION comp) {
+	if (comp == NSUB_COMP_NONE)
+		return out;
+
+	if (!nsub_has_compression(comp)) {
+		fprintf(stderr, "Cannot write %s-compressed output: nsub was "
+				"compiled without %s support\n",
+			comp == NSUB_COMP_GZIP ? "gzip" : "zstd",
+			comp == NSUB_COMP_GZIP ? "gzip" : "zstd"
+		);
+		return NULL;
+	}
+
+	zfile_t *zfile = new_zfile(out, -comp);
+	if (!zfile)
+		return NULL;
+
+	cookie_io_functions_t io = { NULL, zfile_write, NULL, zfile_close };
+	FILE *cout = fopencookie(zfile, "w", io);
+	if (!cout)
+		free_zfile(zfile);
+
+	return cout;
+}
+
+/* Private */
+
+static size_t peek_magic(FILE *in, unsigned char *magic,
+		const unsigned char *expected, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++) {
+		int car = getc(in);
+		if (car == EOF)
+			break;
+
+		magic[i] = car;
+		if (magic[i] != expected[i])
+			return i + 1;
+	}
+
+	return i;
+}
+
+static FILE *replay(FILE *in, unsigned char *head, size_t len) {
+	// A seekable stream can simply be rewound
+	if (!fseek(in, -(long) len, SEEK_CUR))
+		return in;
+
+	zfile_t *zfile = new_zfile(in, NSUB_COMP_NONE);
+	if (!zfile)
+		return NULL;
+
+	memcpy(zfile->buf, head, len);
+	zfile->len = len;
+
+	cookie_io_functions_t io = { replay_read, NULL, NULL, zfile_close };
+	FILE *rin = fopencookie(zfile, "r", io);
+	if (!rin)
+		free_zfile(zfile);
+
+	return rin;
+}
+
+// comp < 0 means compression (writing), comp > 0 decompression (reading)
+static zfile_t *new_zfile(FILE *raw, NSUB_COMPRESSION comp) {
+	zfile_t *zfile = malloc(sizeof(zfile_t));
+	if (!zfile)
+		return NULL;
+
+	memset(zfile, 0, sizeof(zfile_t));
+	zfile->raw = raw;
+	zfile->comp = comp;
+	zfile->buf = malloc(ZBUF_SIZE);
+	if (!zfile->buf) {
+		free(zfile);
+		return NULL;
+	}
+
+	int ok = 1;
+	switch (comp) {
+#ifdef NSUB_ZLIB
+	case NSUB_COMP_GZIP:
+		// 15 + 32: zlib or gzip header, automatically detected
+		ok = inflateInit2(&zfile->z, 15 + 32) == Z_OK;
+		break;
+	case -NSUB_COMP_GZIP:
+		// 15 + 16: gzip header
+		ok = deflateInit2(&zfile->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+				15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		break;
+#endif
+#ifdef NSUB_ZSTD
+	case NSUB_COMP_ZSTD:
+		zfile->zd = ZSTD_createDStream();
+		ok = zfile->zd && !ZSTD_isError(ZSTD_initDStream(zfile->zd));
+		break;
+	case -NSUB_COMP_ZSTD:
+		zfile->zc = ZSTD_createCStream();
+		ok = zfile->zc && !ZSTD_isError(ZSTD_initCStream(zfile->zc,
+				ZSTD_CLEVEL_DEFAULT));
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Cannot initialise the (de)compression stream\n");
+		zfile->comp = NSUB_COMP_NONE;
+		free_zfile(zfile);
+		return NULL;
+	}
+
+	return zfile;
+}
+
+static void free_zfile(zfile_t *zfile) {
+	if (!zfile)
+		return;
+
+	switch (zfile->comp) {
+#ifdef NSUB_ZLIB
+	case NSUB_COMP_GZIP:
+		inflateEnd(&zfile->z);
+		break;
+	case -NSUB_COMP_GZIP:
+		deflateEnd(&zfile->z);
+		break;
+#endif
+#ifdef NSUB_ZSTD
+	case NSUB_COMP_ZSTD:
+		ZSTD_freeDStream(zfile->zd);
+		break;
+	case -NSUB_COMP_ZSTD:
+		ZSTD_freeCStream(zfile->zc);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	free(zfile->buf);
+	free(zfile);
+}
+
+static ssize_t replay_read(void *cookie, char *buf, size_t size) {
+	zfile_t *zfile = cookie;
+
+	if (zfile->pos < zfile->len) {
+		size_t n = zfile->len - zfile->pos;
+		if (n > size)
+			n = size;
+		memcpy(buf, zfile->buf + zfile->pos, n);
+		zfile->pos += n;
+		return n;
+	}
+
+	size_t n = fread(buf, 1, size, zfile->raw);
+	if (!n && ferror(zfile->raw))
+		return -1;
+
+	return n;
+}
+
+static ssize_t zfile_read(void *cookie, char *buf, size_t size) {
+	zfile_t *zfile = cookie;
+	size_t done = 0;
+
+	while (!done) {
+		// Refill the compressed buffer if needed
+		if (zfile->pos >= zfile->len && !zfile->eof) {
+			zfile->len = fread(zfile->buf, 1, ZBUF_SIZE, zfile->raw);
+			zfile->pos = 0;
+			if (zfile->len < ZBUF_SIZE) {
+				if (ferror(zfile->raw))
+					return -1;
+				zfile->eof = 1;
+			}
+		}
+
+		// The end of the input is only fine between two members (frames),
+		// and once the pending output is flushed
+		size_t avail = zfile->len - zfile->pos;
+		if (!avail && zfile->eof && !zfile->open)
+			break;
+
+		switch (zfile->comp) {
+#ifdef NSUB_ZLIB
+		case NSUB_COMP_GZIP: {
+			z_stream *z = &zfile->z;
+			z->next_in = zfile->buf + zfile->pos;
+			z->avail_in = avail;
+			z->next_out = (unsigned char *) buf;
+			z->avail_out = size;
+
+			int rep = inflate(z, Z_NO_FLUSH);
+			zfile->pos += avail - z->avail_in;
+			done = size - z->avail_out;
+
+			// Concatenated gzip members are allowed (as with zcat)
+			zfile->open = rep != Z_STREAM_END;
+			if (rep == Z_STREAM_END) {
+				inflateReset(z);
+			} else if (rep != Z_OK && rep != Z_BUF_ERROR) {
+				fprintf(stderr, "gzip: %s\n", z->msg ? z->msg : "bad data");
+				return -1;
+			}
+			break;
+		}
+#endif
+#ifdef NSUB_ZSTD
+		case NSUB_COMP_ZSTD: {
+			ZSTD_inBuffer zin = { zfile->buf, zfile->len, zfile->pos };
+			ZSTD_outBuffer zout = { buf, size, 0 };
+
+			size_t rep = ZSTD_decompressStream(zfile->zd, &zout, &zin);
+			if (ZSTD_isError(rep)) {
+				fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(rep));
+				return -1;
+			}
+
+			// 0: the frame is over (and flushed)
+			zfile->open = rep != 0;
+			zfile->pos = zin.pos;
+			done = zout.pos;
+			break;
+		}
+#endif
+		default:
+			return -1;
+		}
+
+		if (!done && !avail && zfile->eof && zfile->open) {
+			fprintf(stderr, "%s: unexpected end of file\n",
+					zfile->comp == NSUB_COMP_GZIP ? "gzip" : "zstd");
+			zfile->open = 0; // only report it once
+			return -1;
+		}
+	}
+
+	return done;
+}
+
+static ssize_t zfile_write(void *cookie, const char *buf, size_t size) {
+	zfile_t *zfile = cookie;
+
+	switch (zfile->comp) {
+#ifdef NSUB_ZLIB
+	case -NSUB_COMP_GZIP: {
+		z_stream *z = &zfile->z;
+		z->next_in = (unsigned char *) buf;
+		z->avail_in = size;
+		while (z->avail_in) {
+			z->next_out = zfile->buf;
+			z->avail_out = ZBUF_SIZE;
+			if (deflate(z, Z_NO_FLUSH) == Z_STREAM_ERROR)
+				return -1;
+
+			size_t n = ZBUF_SIZE - z->avail_out;
+			if (fwrite(zfile->buf, 1, n, zfile->raw) != n)
+				return -1;
+		}
+		return size;
+	}
+#endif
+#ifdef NSUB_ZSTD
+	case -NSUB_COMP_ZSTD: {
+		ZSTD_inBuffer zin = { buf, size, 0 };
+		while (zin.pos < zin.size) {
+			ZSTD_outBuffer zout = { zfile->buf, ZBUF_SIZE, 0 };
+			size_t rep = ZSTD_compressStream(zfile->zc, &zout, &zin);
+			if (ZSTD_isError(rep))
+				return -1;
+			if (fwrite(zfile->buf, 1, zout.pos, zfile->raw) != zout.pos)
+				return -1;
+		}
+		return size;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
+
+static int zfile_close(void *cookie) {
+	zfile_t *zfile = cookie;
+	int ok = 1;
+
+	// Flush the end of the compressed stream
+	switch (zfile->comp) {
+#ifdef NSUB_ZLIB
+	case -NSUB_COMP_GZIP: {
+		z_stream *z = &zfile->z;
+		int rep = Z_OK;
+		z->next_in = NULL;
+		z->avail_in = 0;
+		while (ok && rep == Z_OK) {
+			z->next_out = zfile->buf;
+			z->avail_out = ZBUF_SIZE;
+			rep = deflate(z, Z_FINISH);
+			size_t n = ZBUF_SIZE - z->avail_out;
+			ok = (rep == Z_OK || rep == Z_STREAM_END)
+				&& fwrite(zfile->buf, 1, n, zfile->raw) == n;
+		}
+		break;
+	}
+#endif
+#ifdef NSUB_ZSTD
+	case -NSUB_COMP_ZSTD: {
+		size_t rep = 1;
+		while (ok && rep) {
+			ZSTD_outBuffer zout = { zfile->buf, ZBUF_SIZE, 0 };
+			rep = ZSTD_endStream(zfile->zc, &zout);
+			ok = !ZSTD_isError(rep)
+				&& fwrite(zfile->buf, 1, zout.pos, zfile->raw) == zout.pos;
+		}
+		break;
+	}
+#endif
+	default:
+		break;
+	}
+
+	if (fclose(zfile->raw))
+		ok = 0;
+
+	free_zfile(zfile);
+	return ok ? 0 : EOF;
+}
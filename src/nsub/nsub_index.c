@@ -0,0 +1,353 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// fseeko(), ftello(), getline()
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// "NSUBIDX" and the version of the index format
+#define INDEX_MAGIC "NSUBIDX1"
+// magic, format, bucket, entries, resume offset, resume cue, reserved
+#define INDEX_HEADER 40
+// offset, cue number, cue start
+#define INDEX_ENTRY 16
+
+// an entry: the first cue starting in this bucket or later
+typedef struct {
+	uint64_t offset;
+	int num;
+	int start;
+} entry_t;
+
+// a sidecar index in memory
+typedef struct {
+	NSUB_FORMAT fmt;
+	int bucket;
+	// where to start again to update the index (the last cue)
+	uint64_t resume;
+	int resume_num;
+	// the entries (entry_t), one per bucket
+	array_t *entries;
+} index_t;
+
+// load an index, FALSE if there is none or it does not match the file
+static int load_index(const char *path, index_t *index, NSUB_FORMAT fmt,
+		uint64_t size);
+// the start time of a timing line ("00:00:01,000 --> ..."), -1 if it is not
+static int timing_start(char *line, NSUB_FORMAT fmt);
+// little-endian integers (the index can move between machines)
+static void put_u32(unsigned char *buf, uint32_t value);
+static void put_u64(unsigned char *buf, uint64_t value);
+static uint32_t get_u32(const unsigned char *buf);
+static uint64_t get_u64(const unsigned char *buf);
+
+/* Public */
+
+char *nsub_index_path(const char *path) {
+	return cstring_concat(path, ".nsi", NULL);
+}
+
+int nsub_build_index(const char *path, NSUB_FORMAT fmt) {
+	if (fmt != NSUB_FMT_SRT && fmt != NSUB_FMT_WEBVTT) {
+		fprintf(stderr, "Only SRT and WebVTT files can be indexed\n");
+		return 0;
+	}
+
+	FILE *in = fopen(path, "rb");
+	struct stat st;
+	if (!in || fstat(fileno(in), &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Cannot index the file: %s\n", path);
+		if (in)
+			fclose(in);
+		return 0;
+	}
+
+	// Growing files: only the end is scanned again
+	char *index_path = nsub_index_path(path);
+	index_t index;
+	int append = load_index(index_path, &index, fmt, st.st_size);
+	if (!append) {
+		index.fmt = fmt;
+		index.bucket = NSUB_INDEX_BUCKET;
+		index.resume = 0;
+		index.resume_num = 0;
+		index.entries = new_array(sizeof(entry_t), 1024);
+	}
+	size_t old_count = array_count(index.entries);
+
+	int ok = !fseeko(in, index.resume, SEEK_SET);
+	uint64_t offset = index.resume;
+	int num = index.resume_num ? index.resume_num - 1 : 0;
+	long long prev = -1;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while (ok && (len = getline(&line, &cap, in)) > 0) {
+		// A line still being written
+		if (line[len - 1] != '\n')
+			break;
+
+		size_t end = len;
+		while (end && (line[end - 1] == '\n' || line[end - 1] == '\r'))
+			line[--end] = '\0';
+
+		int start = timing_start(line, fmt);
+		if (start >= 0) {
+			// The cue starts at its identifier, if any
+			uint64_t block = prev >= 0 ? (uint64_t) prev : offset;
+			num++;
+
+			size_t bucket = start / index.bucket;
+			while (array_count(index.entries) <= bucket) {
+				entry_t *entry = array_new(index.entries);
+				entry->offset = block;
+				entry->num = num;
+				entry->start = start;
+			}
+
+			index.resume = block;
+			index.resume_num = num;
+		}
+
+		prev = end ? (long long) offset : -1;
+		offset += len;
+	}
+	free(line);
+	fclose(in);
+
+	// Write (or complete) the index
+	FILE *out = ok ? fopen(index_path, append ? "r+b" : "wb") : NULL;
+	if (out) {
+		unsigned char header[INDEX_HEADER] = { 0 };
+		memcpy(header, INDEX_MAGIC, 8);
+		put_u32(header + 8, index.fmt);
+		put_u32(header + 12, index.bucket);
+		put_u32(header + 16, array_count(index.entries));
+		put_u64(header + 24, index.resume);
+		put_u32(header + 32, index.resume_num);
+		ok = fwrite(header, INDEX_HEADER, 1, out) == 1;
+
+		if (ok && append)
+			ok = !fseeko(out, INDEX_HEADER + old_count * INDEX_ENTRY,
+					SEEK_SET);
+
+		for (size_t i = append ? old_count : 0;
+				ok && i < array_count(index.entries); i++) {
+			entry_t *entry = array_get(index.entries, i);
+			unsigned char buf[INDEX_ENTRY];
+			put_u64(buf, entry->offset);
+			put_u32(buf + 8, entry->num);
+			put_u32(buf + 12, entry->start);
+			ok = fwrite(buf, INDEX_ENTRY, 1, out) == 1;
+		}
+
+		if (fclose(out))
+			ok = 0;
+	} else {
+		ok = 0;
+	}
+
+	if (!ok)
+		fprintf(stderr, "Cannot write the index: %s\n", index_path);
+
+	free_array(index.entries);
+	free(index_path);
+	return ok;
+}
+
+int nsub_read_window(song_t *song, FILE *in, NSUB_FORMAT fmt,
+		const char *index_path, int from, int to) {
+	index_t index;
+	struct stat st;
+	int indexed = index_path && fmt != NSUB_FMT_UNKNOWN
+			&& !fstat(fileno(in), &st) && S_ISREG(st.st_mode)
+			&& load_index(index_path, &index, fmt, st.st_size);
+
+	if (!indexed) {
+		if (!nsub_read_into(song, in, fmt))
+			return 0;
+	} else {
+		// Start a bucket early, for the lyrics already displayed at "from"
+		size_t bucket = (from > index.bucket ? from - index.bucket : 0)
+				/ index.bucket;
+		uint64_t offset = index.resume;
+		int num = index.resume_num;
+		if (bucket < array_count(index.entries)) {
+			entry_t *entry = array_get(index.entries, bucket);
+			offset = entry->offset;
+			num = entry->num;
+		}
+		free_array(index.entries);
+
+		if (fseeko(in, offset, SEEK_SET)) {
+			fprintf(stderr, "Cannot seek into the input\n");
+			return 0;
+		}
+
+		// Only the window is parsed: stop at the first lyric after it
+		int (*read_a_line)(song_t *, char *) = fmt == NSUB_FMT_SRT ?
+				nsub_read_srt : nsub_read_webvtt;
+		song->current_num = num - 1;
+		cstring_t *line = new_cstring();
+		while (cstring_readline(line, in)) {
+			if (!read_a_line(song, line->string)) {
+				fprintf(stderr, "Read error after byte %llu: <%s>\n",
+						(unsigned long long) offset, line->string);
+				free_cstring(line);
+				return 0;
+			}
+
+			lyric_t *lyric = array_last(song->lyrics);
+			if (lyric && lyric->start >= to) {
+				uninit_lyric(array_pop(song->lyrics));
+				break;
+			}
+		}
+		free_cstring(line);
+	}
+
+	// Keep only the lyrics displayed during the window
+	size_t kept = 0;
+	for (size_t i = 0; i < array_count(song->lyrics); i++) {
+		lyric_t *lyric = array_get(song->lyrics, i);
+		if (lyric->type == NSUB_LYRIC && (lyric->stop + song->offset <= from
+				|| lyric->start + song->offset >= to)) {
+			uninit_lyric(lyric);
+			continue;
+		}
+
+		if (kept != i)
+			memcpy(array_get(song->lyrics, kept), lyric, sizeof(lyric_t));
+		kept++;
+	}
+	while (array_count(song->lyrics) > kept)
+		array_pop(song->lyrics);
+
+	return 1;
+}
+
+/* Private */
+
+static int load_index(const char *path, index_t *index, NSUB_FORMAT fmt,
+		uint64_t size) {
+	FILE *in = fopen(path, "rb");
+	if (!in)
+		return 0;
+
+	unsigned char header[INDEX_HEADER];
+	if (fread(header, INDEX_HEADER, 1, in) != 1
+			|| memcmp(header, INDEX_MAGIC, 8)) {
+		fprintf(stderr, "Warning: not an index, ignoring: %s\n", path);
+		fclose(in);
+		return 0;
+	}
+
+	index->fmt = get_u32(header + 8);
+	index->bucket = get_u32(header + 12);
+	size_t count = get_u32(header + 16);
+	index->resume = get_u64(header + 24);
+	index->resume_num = get_u32(header + 32);
+
+	// A file that shrunk was replaced, not appended to
+	if (index->fmt != fmt || index->bucket <= 0 || index->resume > size) {
+		fprintf(stderr, "Warning: outdated index, ignoring: %s\n", path);
+		fclose(in);
+		return 0;
+	}
+
+	index->entries = new_array(sizeof(entry_t), count ? count : 1);
+	unsigned char buf[INDEX_ENTRY];
+	for (size_t i = 0; i < count; i++) {
+		if (fread(buf, INDEX_ENTRY, 1, in) != 1) {
+			fprintf(stderr, "Warning: truncated index, ignoring: %s\n", path);
+			free_array(index->entries);
+			fclose(in);
+			return 0;
+		}
+
+		entry_t *entry = array_new(index->entries);
+		entry->offset = get_u64(buf);
+		entry->num = get_u32(buf + 8);
+		entry->start = get_u32(buf + 12);
+	}
+
+	fclose(in);
+	return 1;
+}
+
+static int timing_start(char *line, NSUB_FORMAT fmt) {
+	// 00:00:01,000 --> 00:00:02,000 (00:01.000 --> 00:02.000 in WebVTT)
+	char *arrow = strstr(line, "-->");
+	if (!arrow)
+		return -1;
+
+	char *start = line;
+	while (*start == ' ')
+		start++;
+	char *end = arrow;
+	while (end > start && end[-1] == ' ')
+		end--;
+
+	char time[32];
+	size_t len = end - start;
+	if (!len || len >= sizeof(time))
+		return -1;
+	memcpy(time, start, len);
+	time[len] = '\0';
+
+	char deci = fmt == NSUB_FMT_SRT ? ',' : '.';
+	if (!nsub_is_timing(time, deci, 3))
+		return -1;
+
+	return nsub_to_ms(time, deci);
+}
+
+static void put_u32(unsigned char *buf, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static void put_u64(unsigned char *buf, uint64_t value) {
+	for (int i = 0; i < 8; i++)
+		buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint32_t get_u32(const unsigned char *buf) {
+	uint32_t value = 0;
+	for (int i = 3; i >= 0; i--)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+static uint64_t get_u64(const unsigned char *buf) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--)
+		value = (value << 8) | buf[i];
+	return value;
+}
@@ -0,0 +1,922 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+// fileno(), mmap(), munmap(), struct stat.st_mtim
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// "NSUBLIB" and the version of the library format
+#define LIB_MAGIC "NSUBLIB1"
+// magic, files, cues, trigrams, reserved, then the sections offsets:
+// files, cues, texts, postings, trigrams
+#define LIB_HEADER 64
+// modification time, size, first cue, cues, path length (then the path)
+#define LIB_FILE 28
+// file, number, start, stop, text offset, text length, reserved
+#define LIB_CUE 32
+// trigram, postings, postings offset
+#define LIB_TRIGRAM 16
+
+// a library index, mapped in memory
+typedef struct {
+	unsigned char *map;
+	size_t size;
+	uint32_t nfiles;
+	uint32_t ncues;
+	uint32_t ntrigrams;
+	const unsigned char *cues;
+	const unsigned char *texts;
+	uint64_t texts_size;
+	const unsigned char *postings;
+	uint64_t postings_size;
+	const unsigned char *trigrams;
+	// the start of each file entry (nfiles + 1 items)
+	uint64_t *files;
+} lib_t;
+
+// a cue of the library
+typedef struct {
+	int num;
+	int start;
+	int stop;
+	// the text, in the texts of its file (or of the old library if kept)
+	uint64_t text;
+	uint32_t len;
+} cue_t;
+
+// what happened to a file of the library
+typedef enum {
+	// not part of the library (anymore)
+	FILE_DROPPED,
+	// unchanged, the cues of the old library are kept
+	FILE_KEPT,
+	// new or changed, read again
+	FILE_READ,
+	// cannot be read
+	FILE_ERROR
+} FILE_STATE;
+
+// a file of the library while (re)building it
+typedef struct {
+	char *path;
+	// its index in the old library, -1 if none
+	long long old;
+	// named by the user (so an error is reported if it is missing)
+	int given;
+	FILE_STATE state;
+	uint64_t mtime;
+	uint64_t size;
+	// cue_t
+	array_t *cues;
+	// the texts of the cues, if the file was read
+	cstring_t *texts;
+	// (trigram << 32 | cue in the file), sorted and unique
+	array_t *keys;
+} lib_file_t;
+
+// the shared state of a (parallel) build
+typedef struct {
+	NSUB_FORMAT from;
+	pipeline_t *pipeline;
+	// the old library (map is NULL if none)
+	lib_t *old;
+} build_t;
+
+// map and check a library index, FALSE if it is not one (with a warning)
+static int load_library(const char *path, lib_t *lib, int quiet);
+static void unload_library(lib_t *lib);
+// the path of a file of a library (not NUL-terminated)
+static const char *lib_path(lib_t *lib, uint32_t ifile, uint32_t *len);
+// get a cue from a library, FALSE if out of bounds
+static int lib_cue(lib_t *lib, uint32_t icue, uint32_t *ifile, cue_t *cue);
+// read (or keep) the cues of one file (pool worker)
+static void index_file(void *data, void *item, int ithread);
+// list the trigrams of the cues of one file (pool worker)
+static void list_trigrams(void *data, void *item, int ithread);
+// read a file into cues, FALSE if it cannot be read
+static int read_cues(build_t *build, lib_file_t *file);
+// write the library, FALSE in case of error
+static int write_library(const char *path, lib_file_t *files, size_t count,
+		lib_t *old);
+// the search form of a text: lowercase, words separated by one space (any
+// other ASCII character separates the words, UTF-8 is kept as-is)
+static void normalize(const char *text, size_t len, cstring_t *out);
+// the trigram starting at this position of a normalized text
+static uint32_t trigram(const char *text);
+// order the paths (lib_file_t)
+static int compare_paths(const void *a, const void *b);
+// order the keys (uint64_t)
+static int compare_keys(const void *a, const void *b);
+// LEB128 integers for the postings (deltas of cue numbers)
+static size_t put_varint(unsigned char *buf, uint64_t value);
+static int get_varint(const unsigned char **ptr, const unsigned char *end,
+		uint64_t *value);
+// little-endian integers (the library can move between machines)
+static void put_u32(unsigned char *buf, uint32_t value);
+static void put_u64(unsigned char *buf, uint64_t value);
+static uint32_t get_u32(const unsigned char *buf);
+static uint64_t get_u64(const unsigned char *buf);
+
+/* Public */
+
+int nsub_library_index(const char *path, NSUB_FORMAT from, char **files,
+		size_t count, int threads) {
+	lib_t old;
+	memset(&old, 0, sizeof(old));
+	load_library(path, &old, 1);
+
+	// The old files and the given ones, by path, once each
+	size_t total = old.nfiles + count;
+	lib_file_t *all = calloc(total ? total : 1, sizeof(lib_file_t));
+	for (uint32_t i = 0; i < old.nfiles; i++) {
+		uint32_t len;
+		const char *name = lib_path(&old, i, &len);
+		const unsigned char *entry = old.map + old.files[i];
+		all[i].path = malloc(len + 1);
+		memcpy(all[i].path, name, len);
+		all[i].path[len] = '\0';
+		all[i].old = i;
+		all[i].mtime = get_u64(entry);
+		all[i].size = get_u64(entry + 8);
+	}
+	for (size_t i = 0; i < count; i++) {
+		lib_file_t *file = &all[old.nfiles + i];
+		file->path = strdup(files[i]);
+		file->old = -1;
+		file->given = 1;
+	}
+
+	qsort(all, total, sizeof(lib_file_t), compare_paths);
+	size_t kept = 0;
+	for (size_t i = 0; i < total; i++) {
+		if (kept && !strcmp(all[kept - 1].path, all[i].path)) {
+			lib_file_t *prev = &all[kept - 1];
+			if (all[i].old >= 0) {
+				prev->old = all[i].old;
+				prev->mtime = all[i].mtime;
+				prev->size = all[i].size;
+			}
+			prev->given |= all[i].given;
+			free(all[i].path);
+			continue;
+		}
+
+		all[kept++] = all[i];
+	}
+	total = kept;
+
+	// Read the new and changed files, then list the trigrams, in parallel
+	build_t build;
+	build.from = from;
+	build.pipeline = new_pipeline();
+	pipeline_add(build.pipeline, NSUB_STAGE_APPLY_OFFSET);
+	pipeline_add(build.pipeline, NSUB_STAGE_STRIP_TAGS);
+	build.old = &old;
+
+	int rep = 0;
+	pool_t *pool = new_pool(threads, index_file, &build);
+	if (pool) {
+		for (size_t i = 0; i < total; i++)
+			pool_add(pool, &all[i]);
+		free_pool(pool);
+	} else {
+		rep = 22;
+	}
+
+	size_t states[4] = { 0, 0, 0, 0 };
+	size_t cues = 0;
+	for (size_t i = 0; !rep && i < total; i++) {
+		states[all[i].state]++;
+		if (all[i].cues)
+			cues += array_count(all[i].cues);
+	}
+
+	// Nothing changed: the library is already up to date
+	int changed = !old.map || states[FILE_READ] || states[FILE_DROPPED];
+	if (!rep && changed) {
+		pool = new_pool(threads, list_trigrams, &build);
+		if (pool) {
+			for (size_t i = 0; i < total; i++)
+				pool_add(pool, &all[i]);
+			free_pool(pool);
+		} else {
+			rep = 22;
+		}
+	}
+
+	if (!rep) {
+		if (changed && !write_library(path, all, total, &old)) {
+			fprintf(stderr, "Cannot write the library index: %s\n", path);
+			rep = 3;
+		} else {
+			fprintf(stderr, "%zu file(s) indexed (%zu read, %zu unchanged, "
+					"%zu removed), %zu cue(s)\n", states[FILE_KEPT]
+					+ states[FILE_READ], states[FILE_READ],
+					states[FILE_KEPT], states[FILE_DROPPED], cues);
+			if (states[FILE_ERROR])
+				rep = 22;
+		}
+	}
+
+	for (size_t i = 0; i < total; i++) {
+		free(all[i].path);
+		if (all[i].cues)
+			free_array(all[i].cues);
+		if (all[i].texts)
+			free_cstring(all[i].texts);
+		if (all[i].keys)
+			free_array(all[i].keys);
+	}
+	free(all);
+	free_pipeline(build.pipeline);
+	unload_library(&old);
+
+	return rep;
+}
+
+int nsub_library_search(const char *path, const char *query, FILE *out) {
+	lib_t lib;
+	if (!load_library(path, &lib, 0))
+		return 2;
+
+	cstring_t *phrase = new_cstring();
+	normalize(query, strlen(query), phrase);
+	if (!phrase->length) {
+		fprintf(stderr, "Nothing to search for\n");
+		free_cstring(phrase);
+		unload_library(&lib);
+		return 5;
+	}
+
+	// The postings of each trigram of the phrase
+	size_t ngrams = phrase->length >= 3 ? phrase->length - 2 : 0;
+	const unsigned char **lists = malloc((ngrams + 1) * sizeof(void *));
+	uint32_t *sizes = malloc((ngrams + 1) * sizeof(uint32_t));
+	size_t nlists = 0;
+	int none = 0;
+	for (size_t i = 0; i < ngrams && !none; i++) {
+		uint32_t tri = trigram(phrase->string + i);
+
+		size_t lo = 0;
+		size_t hi = lib.ntrigrams;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (get_u32(lib.trigrams + mid * LIB_TRIGRAM) < tri)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		const unsigned char *entry = lib.trigrams + lo * LIB_TRIGRAM;
+		if (lo >= lib.ntrigrams || get_u32(entry) != tri) {
+			none = 1;
+			break;
+		}
+
+		uint64_t offset = get_u64(entry + 8);
+		if (offset > lib.postings_size) {
+			none = 1;
+			break;
+		}
+
+		// Keep the lists from the shortest to the longest, without repeats
+		size_t pos = nlists;
+		int seen = 0;
+		for (size_t j = 0; j < nlists; j++)
+			if (lists[j] == lib.postings + offset)
+				seen = 1;
+		if (seen)
+			continue;
+		while (pos && sizes[pos - 1] > get_u32(entry + 4)) {
+			lists[pos] = lists[pos - 1];
+			sizes[pos] = sizes[pos - 1];
+			pos--;
+		}
+		lists[pos] = lib.postings + offset;
+		sizes[pos] = get_u32(entry + 4);
+		nlists++;
+	}
+
+	// The candidates: the cues having all the trigrams (all the cues for a
+	// phrase too short to have one)
+	array_t *candidates = new_array(sizeof(uint32_t), 64);
+	const unsigned char *end = lib.postings + lib.postings_size;
+	if (none) {
+		// no candidates
+	} else if (!nlists) {
+		for (uint32_t i = 0; i < lib.ncues; i++) {
+			uint32_t *icue = array_new(candidates);
+			*icue = i;
+		}
+	} else {
+		const unsigned char *ptr = lists[0];
+		uint64_t value = 0;
+		uint64_t delta;
+		for (uint32_t i = 0; i < sizes[0] && get_varint(&ptr, end, &delta);
+				i++) {
+			value += delta;
+			uint32_t *icue = array_new(candidates);
+			*icue = value;
+		}
+
+		for (size_t l = 1; l < nlists && array_count(candidates); l++) {
+			ptr = lists[l];
+			value = 0;
+			uint32_t i = 0;
+			size_t kept = 0;
+			int more = sizes[l] && get_varint(&ptr, end, &value);
+			for (size_t c = 0; more && c < array_count(candidates); c++) {
+				uint32_t *icue = array_get(candidates, c);
+				while (more && value < *icue) {
+					more = ++i < sizes[l] && get_varint(&ptr, end, &delta);
+					if (more)
+						value += delta;
+				}
+
+				if (more && value == *icue) {
+					uint32_t *keep = array_get(candidates, kept++);
+					*keep = *icue;
+				}
+			}
+
+			while (array_count(candidates) > kept)
+				array_pop(candidates);
+		}
+	}
+
+	// Check the phrase itself on each candidate, as whole words: both are
+	// wrapped in spaces (the normalized texts have no others at the ends)
+	size_t hits = 0;
+	cstring_t *words = new_cstring();
+	cstring_add_car(words, ' ');
+	cstring_add(words, phrase->string);
+	cstring_add_car(words, ' ');
+	cstring_t *text = new_cstring();
+	cstring_t *line = new_cstring();
+	array_loop(candidates, icue, uint32_t)
+	{
+		uint32_t ifile;
+		cue_t cue;
+		if (!lib_cue(&lib, *icue, &ifile, &cue))
+			continue;
+
+		const char *raw = (const char *) lib.texts + cue.text;
+		normalize(raw, cue.len, line);
+		cstring_clear(text);
+		cstring_add_car(text, ' ');
+		cstring_add(text, line->string);
+		cstring_add_car(text, ' ');
+		if (!strstr(text->string, words->string))
+			continue;
+
+		// One hit per line: no tabs nor newlines in the text
+		cstring_clear(line);
+		cstring_addn(line, raw, cue.len);
+		for (size_t i = 0; i < line->length; i++)
+			if (line->string[i] == '\n' || line->string[i] == '\t'
+					|| line->string[i] == '\r')
+				line->string[i] = ' ';
+
+		uint32_t len;
+		const char *name = lib_path(&lib, ifile, &len);
+		fprintf(out, "%.*s\t%d\t%d\t%d\t%s\n", (int) len, name, cue.num,
+				cue.start, cue.stop, line->string);
+		hits++;
+	}
+
+	fprintf(stderr, "%zu match(es) found\n", hits);
+
+	free_cstring(line);
+	free_cstring(text);
+	free_cstring(words);
+	free_array(candidates);
+	free(lists);
+	free(sizes);
+	free_cstring(phrase);
+	unload_library(&lib);
+	return 0;
+}
+
+/* Private */
+
+static int load_library(const char *path, lib_t *lib, int quiet) {
+	memset(lib, 0, sizeof(lib_t));
+
+	FILE *in = fopen(path, "rb");
+	struct stat st;
+	if (!in || fstat(fileno(in), &st) || !S_ISREG(st.st_mode)) {
+		if (!quiet)
+			fprintf(stderr, "Cannot open the library index: %s\n", path);
+		if (in)
+			fclose(in);
+		return 0;
+	}
+
+	if (st.st_size >= LIB_HEADER) {
+		lib->size = st.st_size;
+		lib->map = mmap(NULL, lib->size, PROT_READ, MAP_PRIVATE,
+				fileno(in), 0);
+		if (lib->map == MAP_FAILED)
+			lib->map = NULL;
+	}
+	fclose(in);
+
+	if (!lib->map || memcmp(lib->map, LIB_MAGIC, 8)) {
+		fprintf(stderr, "Warning: not a library index, ignoring: %s\n", path);
+		unload_library(lib);
+		return 0;
+	}
+
+	lib->nfiles = get_u32(lib->map + 8);
+	lib->ncues = get_u32(lib->map + 12);
+	lib->ntrigrams = get_u32(lib->map + 16);
+	uint64_t files = get_u64(lib->map + 24);
+	uint64_t cues = get_u64(lib->map + 32);
+	uint64_t texts = get_u64(lib->map + 40);
+	uint64_t postings = get_u64(lib->map + 48);
+	uint64_t trigrams = get_u64(lib->map + 56);
+
+	// The sections are in order and within the file
+	int ok = LIB_HEADER <= files && files <= cues && cues <= texts
+			&& texts <= postings && postings <= trigrams
+			&& trigrams <= lib->size
+			&& (texts - cues) / LIB_CUE >= lib->ncues
+			&& (lib->size - trigrams) / LIB_TRIGRAM >= lib->ntrigrams;
+
+	if (ok) {
+		lib->files = malloc((lib->nfiles + 1) * sizeof(uint64_t));
+		uint64_t offset = files;
+		for (uint32_t i = 0; ok && i < lib->nfiles; i++) {
+			lib->files[i] = offset;
+			ok = cues - offset >= LIB_FILE;
+			if (ok) {
+				offset += LIB_FILE;
+				uint32_t len = get_u32(lib->map + offset - 4);
+				ok = cues - offset >= len;
+				offset += len;
+			}
+		}
+		lib->files[lib->nfiles] = offset;
+	}
+
+	if (!ok) {
+		fprintf(stderr, "Warning: corrupted library index, ignoring: %s\n",
+				path);
+		unload_library(lib);
+		return 0;
+	}
+
+	lib->cues = lib->map + cues;
+	lib->texts = lib->map + texts;
+	lib->texts_size = postings - texts;
+	lib->postings = lib->map + postings;
+	lib->postings_size = trigrams - postings;
+	lib->trigrams = lib->map + trigrams;
+
+	return 1;
+}
+
+static void unload_library(lib_t *lib) {
+	if (lib->map)
+		munmap(lib->map, lib->size);
+	free(lib->files);
+	memset(lib, 0, sizeof(lib_t));
+}
+
+static const char *lib_path(lib_t *lib, uint32_t ifile, uint32_t *len) {
+	const unsigned char *entry = lib->map + lib->files[ifile];
+	*len = get_u32(entry + LIB_FILE - 4);
+	return (const char *) entry + LIB_FILE;
+}
+
+static int lib_cue(lib_t *lib, uint32_t icue, uint32_t *ifile, cue_t *cue) {
+	if (icue >= lib->ncues)
+		return 0;
+
+	const unsigned char *entry = lib->cues + (uint64_t) icue * LIB_CUE;
+	*ifile = get_u32(entry);
+	cue->num = (int) get_u32(entry + 4);
+	cue->start = (int) get_u32(entry + 8);
+	cue->stop = (int) get_u32(entry + 12);
+	cue->text = get_u64(entry + 16);
+	cue->len = get_u32(entry + 24);
+
+	return *ifile < lib->nfiles && cue->text <= lib->texts_size
+			&& lib->texts_size - cue->text >= cue->len;
+}
+
+static void index_file(void *data, void *item, int ithread) {
+	build_t *build = data;
+	lib_file_t *file = item;
+
+	struct stat st;
+	if (stat(file->path, &st) || !S_ISREG(st.st_mode)) {
+		if (file->given) {
+			fprintf(stderr, "Cannot open input file: %s\n", file->path);
+			file->state = FILE_ERROR;
+		} else {
+			file->state = FILE_DROPPED;
+		}
+		return;
+	}
+
+	uint64_t mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000
+			+ st.st_mtim.tv_nsec;
+	if (file->old >= 0 && file->mtime == mtime
+			&& file->size == (uint64_t) st.st_size) {
+		// Unchanged: its cues (and texts) are the ones of the old library
+		const unsigned char *entry = build->old->map
+				+ build->old->files[file->old];
+		uint32_t first = get_u32(entry + 16);
+		uint32_t count = get_u32(entry + 20);
+		file->cues = new_array(sizeof(cue_t), count ? count : 1);
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t ifile;
+			cue_t *cue = array_new(file->cues);
+			if (!lib_cue(build->old, first + i, &ifile, cue)) {
+				array_pop(file->cues);
+				break;
+			}
+		}
+		file->state = FILE_KEPT;
+	} else {
+		file->mtime = mtime;
+		file->size = st.st_size;
+		if (!read_cues(build, file)) {
+			file->state = FILE_ERROR;
+			return;
+		}
+		file->state = FILE_READ;
+	}
+}
+
+static void list_trigrams(void *data, void *item, int ithread) {
+	build_t *build = data;
+	lib_file_t *file = item;
+	if (file->state != FILE_KEPT && file->state != FILE_READ)
+		return;
+
+	// The trigrams of each cue
+	const char *base = file->texts ? file->texts->string
+			: (const char *) build->old->texts;
+	cstring_t *text = new_cstring();
+	file->keys = new_array(sizeof(uint64_t), 256);
+	for (size_t i = 0; i < array_count(file->cues); i++) {
+		cue_t *cue = array_get(file->cues, i);
+		normalize(base + cue->text, cue->len, text);
+		for (size_t j = 0; j + 3 <= text->length; j++) {
+			uint64_t *key = array_new(file->keys);
+			*key = (uint64_t) trigram(text->string + j) << 32 | i;
+		}
+	}
+	free_cstring(text);
+
+	size_t count = array_count(file->keys);
+	if (count) {
+		uint64_t *keys = array_get(file->keys, 0);
+		qsort(keys, count, sizeof(uint64_t), compare_keys);
+		size_t unique = 1;
+		for (size_t i = 1; i < count; i++)
+			if (keys[i] != keys[unique - 1])
+				keys[unique++] = keys[i];
+		while (array_count(file->keys) > unique)
+			array_pop(file->keys);
+	}
+}
+
+static int read_cues(build_t *build, lib_file_t *file) {
+	NSUB_FORMAT fmt = build->from;
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		char *ext = nsub_file_ext(file->path);
+		if (ext)
+			fmt = nsub_parse_fmt(ext, 0);
+	}
+
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		fprintf(stderr, "Cannot detect input format: %s\n", file->path);
+		return 0;
+	}
+
+	FILE *in = fopen(file->path, "r");
+	if (!in) {
+		fprintf(stderr, "Cannot open input file: %s\n", file->path);
+		return 0;
+	}
+
+	FILE *raw = in;
+	in = nsub_decompress(raw);
+	if (!in) {
+		fclose(raw);
+		return 0;
+	}
+
+	song_t *song = new_song();
+	int ok = nsub_read_into(song, in, fmt)
+			&& nsub_transform(song, build->pipeline);
+	fclose(in);
+
+	if (ok) {
+		file->cues = new_array(sizeof(cue_t), 64);
+		file->texts = new_cstring();
+		array_loop(song->lyrics, lyric, lyric_t)
+		{
+			if (lyric->type != NSUB_LYRIC || !lyric->text)
+				continue;
+
+			cue_t *cue = array_new(file->cues);
+			cue->num = lyric->num;
+			cue->start = lyric->start;
+			cue->stop = lyric->stop;
+			cue->text = file->texts->length;
+			cue->len = strlen(lyric->text);
+			cstring_addn(file->texts, lyric->text, cue->len);
+		}
+	}
+
+	free_song(song);
+	return ok;
+}
+
+static int write_library(const char *path, lib_file_t *files, size_t count,
+		lib_t *old) {
+	// The numbers of the cues follow the order of the files
+	uint32_t nfiles = 0;
+	uint64_t ncues = 0;
+	size_t nkeys = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].state != FILE_KEPT && files[i].state != FILE_READ)
+			continue;
+		nfiles++;
+		ncues += array_count(files[i].cues);
+		nkeys += array_count(files[i].keys);
+	}
+
+	if (ncues > UINT32_MAX) {
+		fprintf(stderr, "Too many cues in the library\n");
+		return 0;
+	}
+
+	// All the (trigram, cue) pairs, by trigram then cue: a stable radix sort
+	// on the trigrams keeps the cues in order
+	uint64_t *keys = malloc((nkeys ? nkeys : 1) * sizeof(uint64_t));
+	uint64_t *tmp = malloc((nkeys ? nkeys : 1) * sizeof(uint64_t));
+	size_t ikey = 0;
+	uint64_t base = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (files[i].state != FILE_KEPT && files[i].state != FILE_READ)
+			continue;
+		array_loop(files[i].keys, key, uint64_t)
+			keys[ikey++] = (*key & 0xFFFFFFFF00000000ULL)
+					| (base + (*key & 0xFFFFFFFF));
+		base += array_count(files[i].cues);
+	}
+
+	for (int shift = 32; shift < 56; shift += 8) {
+		size_t counts[257] = { 0 };
+		for (size_t i = 0; i < nkeys; i++)
+			counts[((keys[i] >> shift) & 0xFF) + 1]++;
+		for (int b = 0; b < 256; b++)
+			counts[b + 1] += counts[b];
+		for (size_t i = 0; i < nkeys; i++)
+			tmp[counts[(keys[i] >> shift) & 0xFF]++] = keys[i];
+
+		uint64_t *swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+	free(tmp);
+
+	// Written next to it then renamed (the old one is still in use)
+	char *tmp_path = cstring_concat(path, ".tmp", NULL);
+	FILE *out = fopen(tmp_path, "wb");
+	int ok = out != NULL;
+
+	unsigned char buf[LIB_HEADER];
+	memset(buf, 0, LIB_HEADER);
+	if (ok)
+		ok = fwrite(buf, LIB_HEADER, 1, out) == 1;
+
+	// files
+	uint64_t offset = LIB_HEADER;
+	uint64_t sections[5];
+	sections[0] = offset;
+	uint32_t first = 0;
+	for (size_t i = 0; ok && i < count; i++) {
+		if (files[i].state != FILE_KEPT && files[i].state != FILE_READ)
+			continue;
+		uint32_t len = strlen(files[i].path);
+		put_u64(buf, files[i].mtime);
+		put_u64(buf + 8, files[i].size);
+		put_u32(buf + 16, first);
+		put_u32(buf + 20, array_count(files[i].cues));
+		put_u32(buf + 24, len);
+		ok = fwrite(buf, LIB_FILE, 1, out) == 1
+				&& fwrite(files[i].path, 1, len, out) == len;
+		offset += LIB_FILE + len;
+		first += array_count(files[i].cues);
+	}
+
+	// cues
+	sections[1] = offset;
+	uint64_t text = 0;
+	uint32_t ifile = 0;
+	for (size_t i = 0; ok && i < count; i++) {
+		if (files[i].state != FILE_KEPT && files[i].state != FILE_READ)
+			continue;
+		array_loop(files[i].cues, cue, cue_t)
+		{
+			memset(buf, 0, LIB_CUE);
+			put_u32(buf, ifile);
+			put_u32(buf + 4, cue->num);
+			put_u32(buf + 8, cue->start);
+			put_u32(buf + 12, cue->stop);
+			put_u64(buf + 16, text);
+			put_u32(buf + 24, cue->len);
+			if (fwrite(buf, LIB_CUE, 1, out) != 1)
+				ok = 0;
+			text += cue->len;
+		}
+		ifile++;
+	}
+	offset += ncues * LIB_CUE;
+
+	// texts
+	sections[2] = offset;
+	for (size_t i = 0; ok && i < count; i++) {
+		if (files[i].state != FILE_KEPT && files[i].state != FILE_READ)
+			continue;
+		const char *texts = files[i].texts ? files[i].texts->string
+				: (const char *) old->texts;
+		array_loop(files[i].cues, cue, cue_t)
+		{
+			if (fwrite(texts + cue->text, 1, cue->len, out) != cue->len)
+				ok = 0;
+		}
+	}
+	offset += text;
+
+	// postings, and the trigrams pointing to them
+	sections[3] = offset;
+	array_t *trigrams = new_array(LIB_TRIGRAM, 1024);
+	uint64_t postings = 0;
+	for (size_t i = 0; ok && i < nkeys;) {
+		uint32_t tri = keys[i] >> 32;
+		unsigned char *entry = array_new(trigrams);
+		put_u32(entry, tri);
+		put_u64(entry + 8, postings);
+
+		uint32_t n = 0;
+		uint64_t prev = 0;
+		for (; i < nkeys && (keys[i] >> 32) == tri; i++, n++) {
+			uint64_t icue = keys[i] & 0xFFFFFFFF;
+			size_t len = put_varint(buf, icue - prev);
+			if (fwrite(buf, 1, len, out) != len)
+				ok = 0;
+			postings += len;
+			prev = icue;
+		}
+		put_u32(entry + 4, n);
+	}
+	offset += postings;
+
+	// trigrams
+	sections[4] = offset;
+	for (size_t i = 0; ok && i < array_count(trigrams); i++)
+		ok = fwrite(array_get(trigrams, i), LIB_TRIGRAM, 1, out) == 1;
+
+	if (ok) {
+		memset(buf, 0, LIB_HEADER);
+		memcpy(buf, LIB_MAGIC, 8);
+		put_u32(buf + 8, nfiles);
+		put_u32(buf + 12, ncues);
+		put_u32(buf + 16, array_count(trigrams));
+		for (int i = 0; i < 5; i++)
+			put_u64(buf + 24 + i * 8, sections[i]);
+		ok = !fseeko(out, 0, SEEK_SET) && fwrite(buf, LIB_HEADER, 1, out) == 1;
+	}
+
+	if (out && fclose(out))
+		ok = 0;
+	if (ok)
+		ok = !rename(tmp_path, path);
+	else if (out)
+		remove(tmp_path);
+
+	free_array(trigrams);
+	free(keys);
+	free(tmp_path);
+	return ok;
+}
+
+static void normalize(const char *text, size_t len, cstring_t *out) {
+	cstring_clear(out);
+	int space = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char car = text[i];
+		if (car < 0x80 && !(car >= '0' && car <= '9')
+				&& !(car >= 'a' && car <= 'z')
+				&& !(car >= 'A' && car <= 'Z')) {
+			space = out->length > 0;
+			continue;
+		}
+
+		if (space) {
+			cstring_add_car(out, ' ');
+			space = 0;
+		}
+
+		if (car >= 'A' && car <= 'Z')
+			car += 'a' - 'A';
+		cstring_add_car(out, car);
+	}
+}
+
+static uint32_t trigram(const char *text) {
+	const unsigned char *ptr = (const unsigned char *) text;
+	return (uint32_t) ptr[0] << 16 | (uint32_t) ptr[1] << 8 | ptr[2];
+}
+
+static int compare_paths(const void *a, const void *b) {
+	return strcmp(((lib_file_t *) a)->path, ((lib_file_t *) b)->path);
+}
+
+static int compare_keys(const void *a, const void *b) {
+	uint64_t ka = *(uint64_t *) a;
+	uint64_t kb = *(uint64_t *) b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+static size_t put_varint(unsigned char *buf, uint64_t value) {
+	size_t len = 0;
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+	return len;
+}
+
+static int get_varint(const unsigned char **ptr, const unsigned char *end,
+		uint64_t *value) {
+	*value = 0;
+	for (int shift = 0; *ptr < end && shift < 64; shift += 7) {
+		unsigned char byte = *(*ptr)++;
+		*value |= (uint64_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void put_u32(unsigned char *buf, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static void put_u64(unsigned char *buf, uint64_t value) {
+	for (int i = 0; i < 8; i++)
+		buf[i] = (value >> (8 * i)) & 0xFF;
+}
+
+static uint32_t get_u32(const unsigned char *buf) {
+	uint32_t value = 0;
+	for (int i = 3; i >= 0; i--)
+		value = (value << 8) | buf[i];
+	return value;
+}
+
+static uint64_t get_u64(const unsigned char *buf) {
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; i--)
+		value = (value << 8) | buf[i];
+	return value;
+}
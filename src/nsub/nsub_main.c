@@ -18,14 +18,21 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "nsub.h"
+#include "cutils/cutils.h"
 
 /* Declarations */
 
-NSUB_FORMAT nsub_parse_fmt(char *type, int required);
 void help(char *program);
+// align the song on the reference file (and apply it), return the error code
+int align(song_t *song, char *path, ratio_t fps);
+// parse a "FROM-TO" window of times, FALSE if invalid
+int parse_window(char *arg, int *from, int *to);
+// free the pipelines and their list
+void free_pipelines(pipeline_t **pipelines, size_t count);
 
 int main(int argc, char **argv) {
 	int rep = 0;
@@ -36,13 +43,61 @@ int main(int argc, char **argv) {
 	char *out_file = NULL;
 	int apply_offset = 0;
 	int add_offset = 0;
-	double conv = 1;
+	ratio_t conv = { 1, 1 };
+	ratio_t fps_from = { 0, 0 };
+	ratio_t fps_to = { 0, 0 };
+	ratio_t fps = { 0, 0 };
+	int snap = 0;
+	int clamp = 0;
+	NSUB_STAGE overlaps = 0;
+	int drop_comments = 0;
+	int strip_tags = 0;
+	int renumber = 0;
+	int dedup = 0;
+	int min_duration = 0;
+	int batch_mode = 0;
+	int check_mode = 0;
+	int stats_mode = 0;
+	int json = 0;
+	int watch_mode = 0;
+	char *watch_dir = NULL;
+	int index_mode = 0;
+	char *library = NULL;
+	char *search = NULL;
+	char *align_file = NULL;
+	int build_index = 0;
+	int stream_mode = 0;
+	int live = 0;
+	int idle = 200;
+	int window = 0;
+	int window_from = 0;
+	int window_to = 0;
+	array_t *tos = new_array(sizeof(NSUB_FORMAT), 4);
+	int max_line = 42;
+	int max_cps = 25;
+	int threads = 0;
+	NSUB_IO io = NSUB_IO_AUTO;
+	array_t *files = new_array(sizeof(char *), 16);
 
 	if (argc <= 1) {
 		help(argv[0]);
 		return 5;
 	}
 
+	// Batch and check modes change the meaning of the arguments
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp("--batch", argv[i]) || !strcmp("-b", argv[i]))
+			batch_mode = 1;
+		if (!strcmp("--check", argv[i]) || !strcmp("-c", argv[i]))
+			check_mode = 1;
+		if (!strcmp("--stats", argv[i]))
+			stats_mode = 1;
+		if (!strcmp("--watch", argv[i]))
+			watch_mode = 1;
+		if (!strcmp("--index", argv[i]))
+			index_mode = 1;
+	}
+
 	for (int i = 1; i < argc; i++) {
 		char *arg = argv[i];
 		if (!strcmp("--help", arg) || !strcmp("-h", arg)) {
@@ -80,15 +135,23 @@ int main(int argc, char **argv) {
 				);
 				return 9;
 			}
+
+			// Watch mode can convert into several formats
+			if (watch_mode) {
+				NSUB_FORMAT *fmt = array_new(tos);
+				*fmt = to;
+			}
 		} else if (!strcmp("--apply-offset", arg) 
 				|| !strcmp("-a", arg)) {
 			apply_offset = 1;
 		} else if (!strcmp("--ntsc", arg) 
 				|| !strcmp("-n", arg)) {
-			conv = 25.00 / 29.97;
+			fps_from = (ratio_t ) { 30000, 1001 };
+			fps_to = (ratio_t ) { 25, 1 };
 		} else if (!strcmp("--pal", arg) 
 				|| !strcmp("-p", arg)) {
-			conv = 29.97 / 25.00;
+			fps_from = (ratio_t ) { 25, 1 };
+			fps_to = (ratio_t ) { 30000, 1001 };
 		} else if (!strcmp("--offset", arg) 
 				|| !strcmp("-o", arg)) {
 			if (i + 1 >= argc) {
@@ -116,7 +179,134 @@ int main(int argc, char **argv) {
 				return 5;
 			}
 
-			if (sscanf(argv[++i], "%lf", &conv) == EOF) {
+			if (!nsub_parse_ratio(argv[++i], &conv)) {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					arg, argv[i-1]
+				);
+				return 5;
+			}
+		} else if (!strcmp("--fps-from", arg)
+				|| !strcmp("--fps-to", arg)
+				|| !strcmp("--fps", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter %s requires "
+					"an argument\n",
+					arg
+				);
+				return 5;
+			}
+
+			ratio_t *target = &fps;
+			if (!strcmp("--fps-from", arg))
+				target = &fps_from;
+			else if (!strcmp("--fps-to", arg))
+				target = &fps_to;
+			if (!nsub_parse_ratio(argv[++i], target)) {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					arg, argv[i-1]
+				);
+				return 5;
+			}
+		} else if (!strcmp("--snap", arg)) {
+			snap = 1;
+		} else if (!strcmp("--clamp", arg)) {
+			clamp = 1;
+		} else if (!strcmp("--drop-comments", arg)) {
+			drop_comments = 1;
+		} else if (!strcmp("--strip-tags", arg)) {
+			strip_tags = 1;
+		} else if (!strcmp("--renumber", arg)) {
+			renumber = 1;
+		} else if (!strcmp("--dedup", arg)) {
+			dedup = 1;
+		} else if (!strcmp("--overlaps", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --overlaps requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+
+			arg = argv[++i];
+			if (!strcmp("truncate", arg)) {
+				overlaps = NSUB_STAGE_TRUNCATE_OVERLAPS;
+			} else if (!strcmp("merge", arg)) {
+				overlaps = NSUB_STAGE_MERGE_OVERLAPS;
+			} else if (!strcmp("stack", arg)) {
+				overlaps = NSUB_STAGE_STACK_OVERLAPS;
+			} else {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					argv[i-1], arg
+				);
+				return 5;
+			}
+		} else if (!strcmp("--stream", arg)) {
+			stream_mode = 1;
+		} else if (!strcmp("--live", arg)) {
+			stream_mode = 1;
+			live = 1;
+		} else if (!strcmp("--build-index", arg)) {
+			build_index = 1;
+		} else if (!strcmp("--index", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --index requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+			library = argv[++i];
+		} else if (!strcmp("--search", arg)) {
+			if (i + 2 >= argc) {
+				fprintf(stderr,
+					"The parameter --search requires "
+					"two arguments\n"
+				);
+				return 5;
+			}
+			library = argv[++i];
+			search = argv[++i];
+		} else if (!strcmp("--window", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --window requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+
+			if (!parse_window(argv[++i], &window_from, &window_to)) {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					arg, argv[i]
+				);
+				return 5;
+			}
+			window = 1;
+		} else if (!strcmp("--align-to", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --align-to requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+			align_file = argv[++i];
+		} else if (!strcmp("--min-duration", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --min-duration requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+
+			if (sscanf(argv[++i], "%i", &min_duration) == EOF) {
 				fprintf(stderr, 
 					"Bad parameter to %s: %s\n",
 					arg, argv[i-1]
@@ -132,30 +322,96 @@ int main(int argc, char **argv) {
 				return 5;
 			}
 			out_file = argv[++i];
-			if (to == NSUB_FMT_UNKNOWN) {
-				char *ext = strrchr(argv[i], '.');
-				if (ext) {
-					ext++;
+			if (to == NSUB_FMT_UNKNOWN && !batch_mode && !check_mode
+					&& !stats_mode && !watch_mode && !index_mode) {
+				char *ext = nsub_file_ext(argv[i]);
+				if (ext)
 					to = nsub_parse_fmt(ext, 0);
-				}
 			}
+		} else if (!strcmp("--batch", arg) || !strcmp("-b", arg)
+				|| !strcmp("--check", arg) || !strcmp("-c", arg)
+				|| !strcmp("--stats", arg)) {
+			// already handled
+		} else if (!strcmp("--json", arg)) {
+			json = 1;
+		} else if (!strcmp("--threads", arg) 
+				|| !strcmp("--max-line", arg)
+				|| !strcmp("--max-cps", arg)
+				|| !strcmp("--idle", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter %s requires "
+					"an argument\n", arg
+				);
+				return 5;
+			}
+
+			int *value = &threads;
+			if (!strcmp("--max-line", arg))
+				value = &max_line;
+			else if (!strcmp("--max-cps", arg))
+				value = &max_cps;
+			else if (!strcmp("--idle", arg))
+				value = &idle;
+
+			if (sscanf(argv[++i], "%i", value) == EOF) {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					arg, argv[i-1]
+				);
+				return 5;
+			}
+		} else if (!strcmp("--io", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --io requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+
+			arg = argv[++i];
+			if (!strcmp("posix", arg)) {
+				io = NSUB_IO_POSIX;
+			} else if (!strcmp("uring", arg)) {
+				io = NSUB_IO_URING;
+			} else if (!strcmp("auto", arg)) {
+				io = NSUB_IO_AUTO;
+			} else {
+				fprintf(stderr, 
+					"Bad parameter to %s: %s\n",
+					argv[i-1], arg
+				);
+				return 5;
+			}
+		} else if (!strcmp("--watch", arg)) {
+			if (i + 1 >= argc) {
+				fprintf(stderr,
+					"The parameter --watch requires "
+					"an argument\n"
+				);
+				return 5;
+			}
+			watch_dir = argv[++i];
+		} else if (watch_mode) {
+			fprintf(stderr, "Syntax error\n");
+			return 5;
+		} else if (batch_mode || check_mode || stats_mode || index_mode) {
+			char **file = array_new(files);
+			*file = arg;
 		} else if (!in_file) {
 			in_file = arg;
 			if (from == NSUB_FMT_UNKNOWN) {
-				char *ext = strrchr(arg, '.');
-				if (ext) {
-					ext++;
+				char *ext = nsub_file_ext(arg);
+				if (ext)
 					from = nsub_parse_fmt(ext, 0);
-				}
 			}
 		} else if (!out_file) {
 			out_file = arg;
 			if (to == NSUB_FMT_UNKNOWN) {
-				char *ext = strrchr(arg, '.');
-				if (ext) {
-					ext++;
+				char *ext = nsub_file_ext(arg);
+				if (ext)
 					to = nsub_parse_fmt(ext, 0);
-				}
 			}
 		} else {
 			fprintf(stderr, "Syntax error\n");
@@ -163,11 +419,185 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// Frame rates: both or none (but --snap only needs the target)
+	if (!fps_from.num != !fps_to.num && !(snap && fps_to.num)) {
+		fprintf(stderr, "The parameters --fps-from and --fps-to "
+				"must be used together\n");
+		return 5;
+	}
+	if (snap && !fps_to.num) {
+		fprintf(stderr, "The parameter --snap requires --fps-to "
+				"(or --ntsc/--pal)\n");
+		return 5;
+	}
+	if (fps_from.num) {
+		ratio_t ratio = nsub_fps_ratio(fps_from, fps_to);
+		// ratio * conv = ratio / (1 / conv)
+		if (ratio.den)
+			conv = nsub_fps_ratio((ratio_t ) { conv.den, conv.num }, ratio);
+		if (!ratio.den || !conv.den) {
+			fprintf(stderr, "The frame rates and the ratio cannot be "
+					"combined exactly, please simplify them\n");
+			return 5;
+		}
+	}
+
+	// The transformations, in a fixed order; one pipeline per target format
+	// in watch mode, since the offset depends on it
+	size_t npipelines = watch_mode && array_count(tos) ? array_count(tos) : 1;
+	pipeline_t **pipelines = malloc(npipelines * sizeof(pipeline_t *));
+	for (size_t i = 0; i < npipelines; i++) {
+		NSUB_FORMAT target = watch_mode && array_count(tos)
+				? *(NSUB_FORMAT *) array_get(tos, i) : to;
+
+		pipeline_t *pipeline = new_pipeline();
+		if (conv.num != conv.den)
+			pipeline_add_ratio(pipeline, NSUB_STAGE_SCALE, conv);
+		// only LRC and JSON Lines support an offset, the others must apply it
+		if (apply_offset
+				|| (target != NSUB_FMT_LRC && target != NSUB_FMT_JSONL))
+			pipeline_add(pipeline, NSUB_STAGE_APPLY_OFFSET);
+		if (add_offset)
+			pipeline_add_ms(pipeline, NSUB_STAGE_SHIFT, add_offset);
+		if (snap)
+			pipeline_add_ratio(pipeline, NSUB_STAGE_SNAP, fps_to);
+		if (min_duration)
+			pipeline_add_ms(pipeline, NSUB_STAGE_MIN_DURATION, min_duration);
+		if (clamp)
+			pipeline_add(pipeline, NSUB_STAGE_CLAMP);
+		if (overlaps)
+			pipeline_add(pipeline, overlaps);
+		if (strip_tags)
+			pipeline_add(pipeline, NSUB_STAGE_STRIP_TAGS);
+		if (drop_comments)
+			pipeline_add(pipeline, NSUB_STAGE_DROP_COMMENTS);
+		if (dedup)
+			pipeline_add(pipeline, NSUB_STAGE_DEDUP);
+		if (renumber || dedup || overlaps)
+			pipeline_add(pipeline, NSUB_STAGE_RENUMBER);
+
+		pipelines[i] = pipeline;
+	}
+	pipeline_t *pipeline = pipelines[0];
+
+	if (build_index) {
+		if (batch_mode || check_mode || stats_mode || watch_mode || !in_file
+				|| (in_file[0] == '-' && !in_file[1])) {
+			fprintf(stderr, "The parameter --build-index needs a single "
+					"input file\n");
+			return 5;
+		}
+
+		if (from == NSUB_FMT_UNKNOWN) {
+			fprintf(stderr,
+				"Cannot detect input format, "
+				"please specify it with '--from'\n"
+			);
+			return 6;
+		}
+
+		rep = nsub_build_index(in_file, from) ? 0 : 22;
+		free_array(tos);
+		free_array(files);
+		free_pipelines(pipelines, npipelines);
+		return rep;
+	}
+
+	if (search) {
+		if (batch_mode || check_mode || stats_mode || watch_mode || index_mode
+				|| in_file) {
+			fprintf(stderr, "Syntax error\n");
+			return 5;
+		}
+
+		rep = nsub_library_search(library, search, stdout);
+		free_array(tos);
+		free_array(files);
+		free_pipelines(pipelines, npipelines);
+		return rep;
+	}
+
+	if (align_file && (batch_mode || check_mode || stats_mode || watch_mode
+			|| index_mode)) {
+		fprintf(stderr, "The parameter --align-to only works on a "
+				"single file\n");
+		return 5;
+	}
+
+	if (watch_mode) {
+		if (!array_count(tos)) {
+			fprintf(stderr,
+				"The output format is required in watch mode, "
+				"please specify it with '--to'\n"
+			);
+			rep = 7;
+		} else {
+			batch_t batch = { from, to, out_file, pipeline, NSUB_IO_POSIX,
+					fps };
+			rep = nsub_watch(&batch, array_get(tos, 0), pipelines,
+				array_count(tos), watch_dir, threads);
+		}
+
+		free_array(tos);
+		free_array(files);
+		free_pipelines(pipelines, npipelines);
+		return rep;
+	}
+	free_array(tos);
+
+	if (batch_mode || check_mode || stats_mode || index_mode) {
+		// No files given: read the list from stdin
+		array_t *names = new_array(sizeof(char *), 64);
+		if (!array_count(files)) {
+			cstring_t *line = new_cstring();
+			while (cstring_readline(line, stdin)) {
+				if (!line->length)
+					continue;
+				char **name = array_new(names);
+				*name = strdup(line->string);
+				char **file = array_new(files);
+				*file = *name;
+			}
+			free_cstring(line);
+		}
+
+		if (index_mode) {
+			rep = nsub_library_index(library, from, array_get(files, 0),
+				array_count(files), threads);
+		} else if (check_mode) {
+			check_t check = { from, max_line, max_cps, fps };
+			rep = nsub_check_files(&check, array_get(files, 0), 
+				array_count(files), threads, stdout);
+		} else if (stats_mode) {
+			rep = nsub_stats_files(from, fps, array_get(files, 0),
+				array_count(files), threads, json, stdout);
+		} else if (to == NSUB_FMT_UNKNOWN) {
+			fprintf(stderr,
+				"The output format is required in batch mode, "
+				"please specify it with '--to'\n"
+			);
+			rep = 7;
+		} else {
+			batch_t batch = { from, to, out_file, pipeline, io, fps };
+			rep = nsub_batch(&batch, array_get(files, 0), 
+				array_count(files));
+		}
+
+		array_loop(names, name, char *)
+			free(*name);
+		free_array(names);
+		free_array(files);
+		free_pipelines(pipelines, npipelines);
+		return rep;
+	}
+	free_array(files);
+
 	if (from == NSUB_FMT_UNKNOWN) {
 		fprintf(stderr,
 			"Cannot detect input format, "
 			"please specify it with '--from'\n"
 		);
+		free_pipelines(pipelines, npipelines);
 		return 6;
 	}
 
@@ -176,6 +606,7 @@ int main(int argc, char **argv) {
 			"Cannot detect output format, "
 			"please specify it with '--to'\n"
 		);
+		free_pipelines(pipelines, npipelines);
 		return 7;
 	}
 
@@ -190,24 +621,89 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	// Compressed input is detected by content, not by name
+	if (!rep) {
+		FILE *raw = in;
+		in = nsub_decompress(raw);
+		if (!in) {
+			if (raw != stdin)
+				fclose(raw);
+			rep = 2;
+		}
+	}
+
 	FILE *out = stdout;
 	if (!rep && out_file && !(out_file[0] == '-' && !out_file[1])) {
 		out = fopen(out_file, "w");
-		if (!in) {
+		if (!out) {
 			fprintf(stderr, 
 				"Cannot create output file: %s\n", out_file
 			);
 			rep = 3;
 		}
+
+		// Compressed output is selected by name (.gz, .zst)
+		if (out) {
+			FILE *raw = out;
+			out = nsub_compress(raw, nsub_parse_compression(out_file));
+			if (!out) {
+				// Not even an empty file left behind
+				fclose(raw);
+				remove(out_file);
+				rep = 3;
+			}
+		}
 	}
 
-	if (!rep) {
-		song_t *song = nsub_read(in, from);
-		if (!song)
+	// SRT and WebVTT conversions of the timings only need no song at all
+	// (but wait for full buffers, not for live input)
+	int streamed = 0;
+	if (!rep && !window && !align_file && !live
+			&& nsub_can_rewrite(from, to, pipeline)) {
+		streamed = 1;
+		if (!nsub_rewrite(in, from, out, to, pipeline))
 			rep = 22;
+	}
 
-		if (!rep && !nsub_write(out, song, to, apply_offset, 
-				add_offset, conv))
+	// Only what needs the whole song cannot be streamed
+	if (!rep && !streamed && stream_mode) {
+		if (!window && !align_file && nsub_can_stream(from, to, pipeline)) {
+			streamed = 1;
+			int ok = live ? nsub_live(in, from, out, to, pipeline, fps, idle)
+					: nsub_stream(in, from, out, to, pipeline, fps);
+			if (!ok)
+				rep = 22;
+		} else {
+			fprintf(stderr, "This conversion cannot be streamed, "
+					"reading the whole input first\n");
+		}
+	}
+
+	if (!rep && !streamed) {
+		song_t *song = new_song();
+		song->fps = fps;
+		song->intern = 1;
+		song->threads = threads ? threads : nsub_cpus();
+		if (window) {
+			// The sidecar index (if any) makes it a seek
+			char *index = NULL;
+			if (in_file && !(in_file[0] == '-' && !in_file[1]))
+				index = nsub_index_path(in_file);
+			if (!nsub_read_window(song, in, from, index, window_from,
+					window_to))
+				rep = 22;
+			free(index);
+		} else if (!nsub_read_into(song, in, from)) {
+			rep = 22;
+		}
+
+		if (!rep && align_file)
+			rep = align(song, align_file, fps);
+
+		if (!rep && !nsub_transform(song, pipeline))
+			rep = 22;
+
+		if (!rep && !nsub_write(out, song, to))
 			rep = 33;
 
 		free_song(song);
@@ -219,36 +715,111 @@ int main(int argc, char **argv) {
 	if (out && out != stdout)
 		fclose(out);
 
+	free_pipelines(pipelines, npipelines);
 	return rep;
 }
 
 /* Private */
 
-NSUB_FORMAT nsub_parse_fmt(char *type, int required) {
-	if (!strcmp("lrc", type)) {
-		return NSUB_FMT_LRC;
-	} else if (!strcmp("srt", type)) {
-		return NSUB_FMT_SRT;
-	} else if (!strcmp("webvtt", type)) {
-		return NSUB_FMT_WEBVTT;
-	} else if (!strcmp("vtt", type)) {
-		return NSUB_FMT_WEBVTT;
+int align(song_t *song, char *path, ratio_t fps) {
+	NSUB_FORMAT fmt = NSUB_FMT_UNKNOWN;
+	char *ext = nsub_file_ext(path);
+	if (ext)
+		fmt = nsub_parse_fmt(ext, 0);
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		fprintf(stderr, "Cannot detect the format of the reference: %s\n",
+				path);
+		return 6;
+	}
+
+	FILE *in = fopen(path, "r");
+	if (in)
+		in = nsub_decompress(in);
+	if (!in) {
+		fprintf(stderr, "Cannot open reference file: %s\n", path);
+		return 2;
 	}
 
-	if (required)
-		return NSUB_FMT_ERROR;
+	song_t *ref = new_song();
+	ref->fps = fps;
+	int ok = nsub_read_into(ref, in, fmt);
+	fclose(in);
 
-	return NSUB_FMT_UNKNOWN;
+	ratio_t ratio;
+	int shift = 0;
+	if (ok)
+		ok = nsub_align(song, ref, &ratio, &shift);
+	free_song(ref);
+	if (!ok)
+		return 22;
+
+	fprintf(stderr, "Aligned on %s: ratio %lld/%lld, offset %+d ms\n", path,
+			ratio.num, ratio.den, shift);
+
+	pipeline_t *pipeline = new_pipeline();
+	pipeline_add_ratio(pipeline, NSUB_STAGE_SCALE, ratio);
+	pipeline_add_ms(pipeline, NSUB_STAGE_SHIFT, shift);
+	ok = nsub_transform(song, pipeline);
+	free_pipeline(pipeline);
+
+	return ok ? 0 : 22;
+}
+
+void free_pipelines(pipeline_t **pipelines, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		free_pipeline(pipelines[i]);
+	free(pipelines);
+}
+
+int parse_window(char *arg, int *from, int *to) {
+	char *dash = strchr(arg, '-');
+	if (!dash)
+		return 0;
+
+	*dash = '\0';
+	int ok = *arg && dash[1] && nsub_is_timing(arg, '.', 3)
+			&& nsub_is_timing(dash + 1, '.', 3);
+	if (ok) {
+		*from = nsub_to_ms(arg, '.');
+		*to = nsub_to_ms(dash + 1, '.');
+	}
+	*dash = '-';
+
+	return ok && *from < *to;
 }
 
 void help(char *program) {
 	printf("NSub subtitles conversion program\n");
 	printf("Syntax:\n");
 	printf("\t%s (--from FMT) (--to FMT) (--apply-offset) (--offset MSEC)\n"
-			"\t\t (--ntsc) (--pal) (--ratio RATIO)\n"
+			"\t\t (--ntsc) (--pal) (--ratio RATIO) (--fps-from FPS --fps-to FPS)\n"
+			"\t\t (--snap) (--fps FPS) (--min-duration MSEC)\n"
+			"\t\t (--clamp) (--strip-tags) (--drop-comments) (--renumber)\n"
+			"\t\t (--dedup) (--overlaps POLICY) (--align-to REF)\n"
+			"\t\t (--window FROM-TO) (--stream) (--live) (--idle MSEC)\n"
 			"\t\t (--output OUT_FILE) (IN_FILE)\n", 
 		program
 	);
+	printf("\t%s --batch --to FMT (--from FMT) (--io IO) [...]\n"
+			"\t\t (--output OUT_DIR) (IN_FILES...)\n", 
+		program
+	);
+	printf("\t%s --build-index (--from FMT) IN_FILE\n", program);
+	printf("\t%s --index LIBRARY (--from FMT) (--threads N) (IN_FILES...)\n",
+		program
+	);
+	printf("\t%s --search LIBRARY PHRASE\n", program);
+	printf("\t%s --watch DIR --to FMT (--to FMT...) (--from FMT) [...]\n"
+			"\t\t (--output OUT_DIR) (--threads N)\n", 
+		program
+	);
+	printf("\t%s --check (--from FMT) (--max-line CHARS) (--max-cps CPS)\n"
+			"\t\t (--threads N) (IN_FILES...)\n", 
+		program
+	);
+	printf("\t%s --stats (--from FMT) (--json) (--threads N) (IN_FILES...)\n",
+		program
+	);
 	
 	printf("\nOptions:\n");
 	printf("\t-h/--help         : this help message\n");
@@ -262,6 +833,75 @@ void help(char *program) {
 	printf("\t-p/--pal          : Convert timings from PAL to NTSC\n");
 	printf("\t-r/--ratio RATIO  : Convert timings with a "
 		"custom ratio\n");
+	printf("\t--fps-from FPS    : the frame rate the timings were made for\n");
+	printf("\t--fps-to FPS      : Convert timings to this frame rate\n");
+	printf("\t--fps FPS         : the frame rate of the frame-based formats "
+		"(MicroDVD),\n\t                    instead of the one of the "
+		"input file (or 23.976)\n");
+	printf("\t--snap            : move the timings to the nearest frame "
+		"of the\n\t                    target frame rate\n");
+	printf("\t--min-duration MSEC: make all the lyrics last at least "
+		"MSEC\n");
+	printf("\t--clamp           : no negative timings, "
+		"no lyric stopping before it starts\n");
+	printf("\t--strip-tags      : remove the formatting tags from "
+		"the text\n");
+	printf("\t--drop-comments   : remove the comments\n");
+	printf("\t--renumber        : number the lyrics again\n");
+	printf("\t--dedup           : merge the consecutive repeats of a lyric\n");
+	printf("\t--overlaps POLICY : resolve the overlapping lyrics: "
+		"truncate (stop at\n\t                    the next one), "
+		"merge (into one) or stack (split at\n\t                    "
+		"each change, all the texts shown)\n");
+	printf("\t--window FROM-TO  : only the lyrics displayed between the "
+		"two times\n\t                    ([[hh:]mm:]ss[.mmm]), "
+		"fast if IN_FILE has an index\n");
+	printf("\t--stream          : convert while reading (I/O, parsing and "
+		"writing\n\t                    on their own threads), when "
+		"the whole song is not\n\t                    needed\n");
+	printf("\t--live            : like --stream, but write each lyric as "
+		"soon as it is\n\t                    complete (for live "
+		"input from a pipe)\n");
+	printf("\t--idle MSEC       : with --live, write the last lyric after "
+		"MSEC without\n\t                    input (200 by default, "
+		"0 to wait for its end)\n");
+	printf("\t--build-index     : write (or update) the sidecar index "
+		"IN_FILE.nsi of a\n\t                    big SRT/WebVTT file "
+		"for --window\n");
+	printf("\t--index LIBRARY   : add the texts of the given files (or the "
+		"ones listed\n\t                    on stdin) to the library "
+		"index LIBRARY (the\n\t                    unchanged files "
+		"are not read again)\n");
+	printf("\t--search LIBRARY PHRASE: the cues of LIBRARY containing "
+		"PHRASE (whole\n\t                    words), one per line "
+		"(tab-separated: file, num, start,\n\t                    "
+		"stop, text)\n");
+	printf("\t--align-to REF    : find the offset and ratio that match the "
+		"timings of\n\t                    the reference REF "
+		"(any format) and apply them\n");
+	printf("\t-b/--batch        : convert all the given files "
+		"(or the ones listed\n\t                    on stdin) "
+		"next to them or into OUT_DIR\n");
+	printf("\t--watch DIR       : convert the files of DIR as soon as "
+		"they change (next\n\t                    to them or into "
+		"OUT_DIR), until interrupted\n");
+	printf("\t--io IO           : the I/O backend for batch mode: "
+		"auto, posix or uring\n");
+	printf("\t-c/--check        : check the given files (or the ones "
+		"listed on stdin)\n\t                    and report the "
+		"issues, one per line (tab-separated:\n\t                    "
+		"file, num, start, rule, value)\n");
+	printf("\t--max-line CHARS  : maximum characters per line "
+		"for --check (42, 0 = no check)\n");
+	printf("\t--max-cps CPS     : maximum characters per second "
+		"for --check (25, 0 = no check)\n");
+	printf("\t--stats           : statistics of the given files (or the ones "
+		"listed\n\t                    on stdin): durations, characters "
+		"per second, gaps,\n\t                    lines per lyric "
+		"and languages\n");
+	printf("\t--json            : write the statistics as a JSON object\n");
+	printf("\t--threads N       : the number of threads to use "
+		"(default: one per CPU)\n");
 	
 	printf("\nArguments:\n");
 	printf(
@@ -272,7 +912,10 @@ void help(char *program) {
 		"\tOUT_FILE : the output file or '-' for stdout "
 		"(which is the default)\n"
 	);
-	printf("\tRATIO    : the ratio to apply to timings (1 = no change)\n");
+	printf("\tRATIO    : the ratio to apply to timings (1 = no change), "
+		"as a fraction\n\t           (e.g., 1001/1000) or a number\n");
+	printf("\tFPS      : a frame rate, as a fraction (e.g., 30000/1001) "
+		"or a number\n");
 	printf(
 		"\tMSEC     : the offset to add to all timings in "
 		"milliseconds\n"
@@ -286,9 +929,23 @@ void help(char *program) {
 		"Note: to specify a file named dash (-), prefix it with a path"
 		" (e.g., './-')\n"
 	);
+	printf(
+		"Note: the timings are transformed in this order: ratio (and fps), "
+		"offsets,\n      snap, min-duration, clamp, then overlaps\n"
+	);
+	printf(
+		"Note: gzip/zstd compressed input is detected automatically, "
+		"and output\n      is compressed if OUT_FILE ends in .gz/.zst\n"
+	);
 	printf("\n");
 	printf("Supported formats:\n");
 	printf("\tlrc: lyrics files\n");
 	printf("\tsrt: SubRip subtitles files\n");
 	printf("\tvtt/webvtt: Web Video Text Tracks\n");
+	printf("\tass/ssa: (Advanced) SubStation Alpha subtitles\n");
+	printf("\tttml/dfxp: Timed Text Markup Language (written as IMSC1)\n");
+	printf("\tsub/microdvd: MicroDVD subtitles (frame-based)\n");
+	printf("\tsubviewer/sbv: SubViewer 2.0 subtitles\n");
+	printf("\tstl: EBU-STL binary subtitles (input only)\n");
+	printf("\tjsonl: JSON Lines, one object per lyric (machine-readable)\n");
 }
@@ -0,0 +1,284 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// a lyric to sort (by start, then by position)
+typedef struct {
+	int start;
+	size_t index;
+} sweep_t;
+
+// a new lyric, to insert before the lyric at the given position
+typedef struct {
+	size_t anchor;
+	size_t seq;
+	lyric_t lyric;
+} piece_t;
+
+static int cmp_sweep(const void *a, const void *b);
+static int cmp_piece(const void *a, const void *b);
+// resolve a group of overlapping lyrics (sorted by start)
+static void resolve(song_t *song, sweep_t *group, size_t count,
+		NSUB_OVERLAP policy, char *removed, array_t *pieces);
+// merge the texts of the lyrics into the first one
+static void merge(song_t *song, sweep_t *group, size_t count, char *removed);
+// split the lyrics at each start and stop
+static void stack(song_t *song, sweep_t *group, size_t count, char *removed,
+		array_t *pieces);
+// set the text of the lyric (that it now owns)
+static void set_text(lyric_t *lyric, char *text);
+
+/* Public */
+
+int nsub_fix_overlaps(song_t *song, NSUB_OVERLAP policy) {
+	size_t total = array_count(song->lyrics);
+	sweep_t *sweep = malloc((total + 1) * sizeof(sweep_t));
+	char *removed = calloc(total + 1, 1);
+	array_t *pieces = new_array(sizeof(piece_t), 16);
+	if (!sweep || !removed) {
+		free(sweep);
+		free(removed);
+		free_array(pieces);
+		return 0;
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < total; i++) {
+		lyric_t *lyric = array_get(song->lyrics, i);
+		if (lyric->type == NSUB_LYRIC) {
+			sweep[count].start = lyric->start;
+			sweep[count].index = i;
+			count++;
+		}
+	}
+
+	qsort(sweep, count, sizeof(sweep_t), cmp_sweep);
+
+	// Sweep: a group lasts while the lyrics start before its latest stop
+	int overlaps = 0;
+	size_t first = 0;
+	int end = 0;
+	for (size_t i = 0; i <= count; i++) {
+		lyric_t *lyric = i < count ? array_get(song->lyrics, sweep[i].index)
+				: NULL;
+		if (lyric && i > first && lyric->start < end) {
+			overlaps++;
+			if (lyric->stop > end)
+				end = lyric->stop;
+			continue;
+		}
+
+		if (i - first > 1)
+			resolve(song, sweep + first, i - first, policy, removed, pieces);
+
+		first = i;
+		if (lyric)
+			end = lyric->stop;
+	}
+
+	// Rebuild the lyrics, with the new ones in place of the removed ones
+	if (array_count(pieces) || memchr(removed, 1, total)) {
+		if (array_count(pieces))
+			qsort(array_get(pieces, 0), array_count(pieces),
+					sizeof(piece_t), cmp_piece);
+
+		array_t *lyrics = new_array(sizeof(lyric_t), total ? total : 1);
+		size_t ipiece = 0;
+		for (size_t i = 0; i < total; i++) {
+			for (; ipiece < array_count(pieces); ipiece++) {
+				piece_t *piece = array_get(pieces, ipiece);
+				if (piece->anchor != i)
+					break;
+				memcpy(array_new(lyrics), &piece->lyric, sizeof(lyric_t));
+			}
+
+			lyric_t *lyric = array_get(song->lyrics, i);
+			if (removed[i])
+				uninit_lyric(lyric);
+			else
+				memcpy(array_new(lyrics), lyric, sizeof(lyric_t));
+		}
+
+		free_array(song->lyrics);
+		song->lyrics = lyrics;
+	}
+
+	free(sweep);
+	free(removed);
+	free_array(pieces);
+	return overlaps;
+}
+
+/* Private */
+
+static int cmp_sweep(const void *a, const void *b) {
+	const sweep_t *sa = a;
+	const sweep_t *sb = b;
+
+	if (sa->start != sb->start)
+		return sa->start < sb->start ? -1 : 1;
+
+	return sa->index < sb->index ? -1 : (sa->index > sb->index);
+}
+
+static int cmp_piece(const void *a, const void *b) {
+	const piece_t *pa = a;
+	const piece_t *pb = b;
+
+	if (pa->anchor != pb->anchor)
+		return pa->anchor < pb->anchor ? -1 : 1;
+
+	return pa->seq < pb->seq ? -1 : (pa->seq > pb->seq);
+}
+
+static void resolve(song_t *song, sweep_t *group, size_t count,
+		NSUB_OVERLAP policy, char *removed, array_t *pieces) {
+	if (policy == NSUB_OVERLAP_MERGE) {
+		merge(song, group, count, removed);
+	} else if (policy == NSUB_OVERLAP_STACK) {
+		stack(song, group, count, removed, pieces);
+	} else {
+		// The lyrics starting together cannot be truncated, so merge them
+		size_t same = 0;
+		for (size_t i = 1; i <= count; i++) {
+			if (i < count && group[i].start == group[same].start)
+				continue;
+
+			if (i - same > 1)
+				merge(song, group + same, i - same, removed);
+			if (i < count) {
+				lyric_t *prev = array_get(song->lyrics, group[same].index);
+				if (prev->stop > group[i].start)
+					prev->stop = group[i].start;
+			}
+
+			same = i;
+		}
+	}
+}
+
+static void merge(song_t *song, sweep_t *group, size_t count, char *removed) {
+	lyric_t *first = array_get(song->lyrics, group[0].index);
+	cstring_t *text = new_cstring();
+	cstring_add(text, first->text ? first->text : "");
+
+	for (size_t i = 1; i < count; i++) {
+		lyric_t *lyric = array_get(song->lyrics, group[i].index);
+		if (lyric->stop > first->stop)
+			first->stop = lyric->stop;
+		if (lyric->text && *lyric->text) {
+			if (text->length)
+				cstring_add_car(text, '\n');
+			cstring_add(text, lyric->text);
+		}
+
+		removed[group[i].index] = 1;
+	}
+
+	// The word timings of the first lyric are still valid (same offsets)
+	set_text(first, cstring_convert(text));
+}
+
+static void stack(song_t *song, sweep_t *group, size_t count, char *removed,
+		array_t *pieces) {
+	// All the starts and stops, in order
+	int *times = malloc(2 * count * sizeof(int));
+	if (!times)
+		return;
+
+	size_t anchor = group[0].index;
+	for (size_t i = 0; i < count; i++) {
+		lyric_t *lyric = array_get(song->lyrics, group[i].index);
+		times[2 * i] = lyric->start;
+		times[2 * i + 1] = lyric->stop;
+		if (group[i].index < anchor)
+			anchor = group[i].index;
+	}
+
+	// (insertion sort: the groups are small)
+	for (size_t i = 1; i < 2 * count; i++) {
+		int tmp = times[i];
+		size_t j = i;
+		for (; j && times[j - 1] > tmp; j--)
+			times[j] = times[j - 1];
+		times[j] = tmp;
+	}
+
+	// One part per interval, with all the texts displayed then
+	size_t seq = 0;
+	for (size_t t = 0; t + 1 < 2 * count; t++) {
+		if (times[t] == times[t + 1])
+			continue;
+
+		cstring_t *text = new_cstring();
+		lyric_t *shown = NULL;
+		for (size_t i = 0; i < count; i++) {
+			lyric_t *lyric = array_get(song->lyrics, group[i].index);
+			if (lyric->start > times[t] || lyric->stop <= times[t])
+				continue;
+
+			if (!shown)
+				shown = lyric;
+			if (lyric->text && *lyric->text) {
+				if (text->length)
+					cstring_add_car(text, '\n');
+				cstring_add(text, lyric->text);
+			}
+		}
+
+		if (!shown) {
+			free_cstring(text);
+			continue;
+		}
+
+		piece_t *piece = array_new(pieces);
+		piece->anchor = anchor;
+		piece->seq = seq++;
+		memcpy(&piece->lyric, shown, sizeof(lyric_t));
+		piece->lyric.num = 0;
+		piece->lyric.id = 0;
+		piece->lyric.start = times[t];
+		piece->lyric.stop = times[t + 1];
+		piece->lyric.name = shown->name ? strdup(shown->name) : NULL;
+		piece->lyric.style = shown->style ? strdup(shown->style) : NULL;
+		piece->lyric.text = cstring_convert(text);
+		piece->lyric.shared = 0;
+		piece->lyric.word = 0;
+		piece->lyric.words = 0;
+	}
+
+	for (size_t i = 0; i < count; i++)
+		removed[group[i].index] = 1;
+
+	free(times);
+}
+
+static void set_text(lyric_t *lyric, char *text) {
+	if (!lyric->shared)
+		free(lyric->text);
+	lyric->text = text;
+	lyric->shared = 0;
+}
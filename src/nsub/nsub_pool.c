@@ -0,0 +1,182 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// sysconf(_SC_NPROCESSORS_ONLN)
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+struct pool_t {
+	pthread_mutex_t lock;
+	// signaled when an item is added or the pool stops
+	pthread_cond_t todo;
+	// signaled when the pool becomes idle
+	pthread_cond_t idle;
+	pthread_t *threads;
+	int count;
+	void (*work)(void *data, void *item, int ithread);
+	void *data;
+	// the queue (FIFO): items[head..count[
+	array_t *items;
+	size_t head;
+	int busy;
+	int stop;
+};
+
+// the code run by each thread of the pool
+static void *pool_thread(void *arg);
+
+// the argument of a thread
+typedef struct {
+	pool_t *pool;
+	int ithread;
+} pool_arg_t;
+
+/* Public */
+
+int nsub_cpus() {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? cpus : 1;
+}
+
+pool_t *new_pool(int threads, void (*work)(void *data, void *item,
+		int ithread), void *data) {
+	if (threads <= 0)
+		threads = nsub_cpus();
+
+	pool_t *pool = malloc(sizeof(pool_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->todo, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	pool->threads = malloc(threads * sizeof(pthread_t));
+	pool->count = 0;
+	pool->work = work;
+	pool->data = data;
+	pool->items = new_array(sizeof(void *), 64);
+	pool->head = 0;
+	pool->busy = 0;
+	pool->stop = 0;
+
+	for (int i = 0; i < threads; i++) {
+		pool_arg_t *arg = malloc(sizeof(pool_arg_t));
+		arg->pool = pool;
+		arg->ithread = i;
+		if (pthread_create(&pool->threads[pool->count], NULL, pool_thread,
+				arg)) {
+			free(arg);
+			break;
+		}
+		pool->count++;
+	}
+
+	if (!pool->count) {
+		fprintf(stderr, "Cannot start the worker threads\n");
+		free_pool(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+int pool_threads(pool_t *pool) {
+	return pool->count;
+}
+
+void pool_add(pool_t *pool, void *item) {
+	pthread_mutex_lock(&pool->lock);
+
+	// Reuse the space of the consumed items
+	if (pool->head && pool->head == array_count(pool->items)) {
+		while (array_count(pool->items))
+			array_pop(pool->items);
+		pool->head = 0;
+	}
+
+	void **slot = array_new(pool->items);
+	*slot = item;
+
+	pthread_cond_signal(&pool->todo);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy || pool->head < array_count(pool->items))
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void free_pool(pool_t *pool) {
+	if (!pool)
+		return;
+
+	pool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->todo);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	free_array(pool->items);
+	free(pool->threads);
+	pthread_cond_destroy(&pool->idle);
+	pthread_cond_destroy(&pool->todo);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* Private */
+
+static void *pool_thread(void *arg) {
+	pool_t *pool = ((pool_arg_t *) arg)->pool;
+	int ithread = ((pool_arg_t *) arg)->ithread;
+	free(arg);
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && pool->head >= array_count(pool->items))
+			pthread_cond_wait(&pool->todo, &pool->lock);
+		if (pool->head >= array_count(pool->items))
+			break;
+
+		void *item = *(void **) array_get(pool->items, pool->head++);
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool->work(pool->data, item, ithread);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->busy--;
+		if (!pool->busy && pool->head >= array_count(pool->items))
+			pthread_cond_broadcast(&pool->idle);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
@@ -0,0 +1,325 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+#define ASS_MAX_COLUMNS 32
+
+// the sections of an ASS file
+#define ASS_SECTION_NONE 0
+#define ASS_SECTION_INFO 1
+#define ASS_SECTION_STYLES 2
+#define ASS_SECTION_EVENTS 3
+
+// the columns of an event we care about
+#define ASS_COL_OTHER 0
+#define ASS_COL_START 1
+#define ASS_COL_END 2
+#define ASS_COL_STYLE 3
+#define ASS_COL_NAME 4
+#define ASS_COL_TEXT 5
+
+// the state of the reader (song->reader)
+typedef struct {
+	int section;
+	// the column map, from the "Format:" line of the [Events]
+	char columns[ASS_MAX_COLUMNS];
+	int count;
+	// the first style, which is the default one for the writer
+	char style[64];
+} ass_reader_t;
+
+// get (or create) the state of the reader
+static ass_reader_t *get_reader(song_t *song);
+// compute the column map from a "Format:" line
+static void read_format(ass_reader_t *reader, char *format);
+// read a "Dialogue:" (or "Comment:") line
+static int read_event(song_t *song, ass_reader_t *reader, char *event,
+		int comment);
+// count the ms in "H:MM:SS.cc", -1 if invalid
+static int ass_millisec(const char *time);
+// convert the ASS escapes (\N, \n, \h) in place
+static void unescape(char *text);
+// skip the spaces
+static char *skip_spaces(char *line);
+// check if the line starts with the given prefix, return what follows
+static char *after(char *line, const char *prefix);
+
+/* Public */
+
+int nsub_read_ass(song_t *song, char *line) {
+	ass_reader_t *reader = get_reader(song);
+	char *value;
+
+	line = skip_spaces(line);
+	if (!*line)
+		return 1;
+
+	// ASS files are often written on Windows
+	size_t len = strlen(line);
+	while (len && (line[len - 1] == '\r' || line[len - 1] == ' '))
+		line[--len] = '\0';
+
+	// [Section]
+	if (line[0] == '[') {
+		if (!strcmp(line, "[Script Info]"))
+			reader->section = ASS_SECTION_INFO;
+		else if (!strcmp(line, "[V4+ Styles]") || !strcmp(line, "[V4 Styles]")
+				|| !strcmp(line, "[V4 Styles+]"))
+			reader->section = ASS_SECTION_STYLES;
+		else if (!strcmp(line, "[Events]"))
+			reader->section = ASS_SECTION_EVENTS;
+		else // [Fonts], [Graphics]...
+			reader->section = ASS_SECTION_NONE;
+		return 1;
+	}
+
+	switch (reader->section) {
+	case ASS_SECTION_INFO:
+		// The comments are about the file (who wrote it...), not the song
+		if (line[0] == ';')
+			return 1;
+
+		value = strchr(line, ':');
+		if (!value)
+			return 1;
+
+		*value = '\0';
+		value = skip_spaces(value + 1);
+		if (!strcmp("Language", line)) {
+			free(song->lang);
+			song->lang = strdup(value);
+		} else {
+			cstring_t *key = new_cstring();
+			cstring_add(key, "ass.");
+			cstring_add(key, line);
+			song_add_meta(song, key->string, value);
+			free_cstring(key);
+		}
+		break;
+	case ASS_SECTION_STYLES:
+		if ((value = after(line, "Format:"))) {
+			song_add_meta(song, "ass.Format", value);
+		} else if ((value = after(line, "Style:"))) {
+			if (!reader->style[0]) {
+				size_t name_len = strcspn(value, ",");
+				if (name_len < sizeof(reader->style)) {
+					memcpy(reader->style, value, name_len);
+					reader->style[name_len] = '\0';
+				}
+			}
+			song_add_meta(song, "ass.Style", value);
+		}
+		break;
+	case ASS_SECTION_EVENTS:
+		if ((value = after(line, "Format:")))
+			read_format(reader, value);
+		else if ((value = after(line, "Dialogue:")))
+			return read_event(song, reader, value, 0);
+		else if ((value = after(line, "Comment:")))
+			return read_event(song, reader, value, 1);
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/* Private */
+
+static ass_reader_t *get_reader(song_t *song) {
+	if (!song->reader) {
+		ass_reader_t *reader = malloc(sizeof(ass_reader_t));
+		reader->section = ASS_SECTION_NONE;
+		reader->style[0] = '\0';
+
+		// The default (ASS) format, if the file does not give one
+		char format[] = "Layer, Start, End, Style, Name, MarginL, MarginR, "
+				"MarginV, Effect, Text";
+		read_format(reader, format);
+
+		song->reader = reader;
+	}
+
+	return song->reader;
+}
+
+static void read_format(ass_reader_t *reader, char *format) {
+	reader->count = 0;
+
+	char *ptr = format;
+	while (*ptr && reader->count < ASS_MAX_COLUMNS) {
+		ptr = skip_spaces(ptr);
+		size_t len = strcspn(ptr, ",");
+		while (len && ptr[len - 1] == ' ')
+			len--;
+
+		char col = ASS_COL_OTHER;
+		if (len == 5 && !strncmp(ptr, "Start", len))
+			col = ASS_COL_START;
+		else if (len == 3 && !strncmp(ptr, "End", len))
+			col = ASS_COL_END;
+		else if (len == 5 && !strncmp(ptr, "Style", len))
+			col = ASS_COL_STYLE;
+		else if (len == 4 && !strncmp(ptr, "Name", len))
+			col = ASS_COL_NAME;
+		else if (len == 4 && !strncmp(ptr, "Text", len))
+			col = ASS_COL_TEXT;
+		reader->columns[reader->count++] = col;
+
+		ptr = strchr(ptr, ',');
+		if (!ptr)
+			break;
+		ptr++;
+	}
+}
+
+static int read_event(song_t *song, ass_reader_t *reader, char *event,
+		int comment) {
+	int start = -1;
+	int stop = -1;
+	char *style = NULL;
+	char *name = NULL;
+	char *text = NULL;
+
+	// One pass over the fields: the map says what each column is, and the
+	// last column (the text) is the rest of the line, commas included
+	char *ptr = skip_spaces(event);
+	for (int i = 0; i < reader->count; i++) {
+		char *field = ptr;
+		if (i < reader->count - 1) {
+			ptr = strchr(ptr, ',');
+			if (!ptr)
+				break;
+			*ptr++ = '\0';
+		}
+
+		switch (reader->columns[i]) {
+		case ASS_COL_START:
+			start = ass_millisec(field);
+			break;
+		case ASS_COL_END:
+			stop = ass_millisec(field);
+			break;
+		case ASS_COL_STYLE:
+			style = skip_spaces(field);
+			break;
+		case ASS_COL_NAME:
+			name = skip_spaces(field);
+			break;
+		case ASS_COL_TEXT:
+			text = field;
+			break;
+		}
+	}
+
+	if (!text || start < 0 || stop < 0) {
+		fprintf(stderr, "Warning: bad ASS event, ignoring...\n");
+		return 1;
+	}
+
+	unescape(text);
+
+	if (comment) {
+		song_add_comment(song, text);
+		return 1;
+	}
+
+	song_add_lyric(song, start, stop, name && *name ? name : NULL, text);
+
+	// Only the non-default styles are kept
+	if (style && *style && strcmp(style, "Default")
+			&& strcmp(style, reader->style)) {
+		lyric_t *lyric = array_last(song->lyrics);
+		lyric->style = strdup(style);
+	}
+
+	return 1;
+}
+
+static int ass_millisec(const char *time) {
+	// 0:00:14.80
+	int parts[3] = { 0, 0, 0 };
+	int ipart = 0;
+	int digits = 0;
+
+	time = skip_spaces((char *) time);
+	for (; *time >= '0' && *time <= '9'; time++) {
+		parts[ipart] = parts[ipart] * 10 + (*time - '0');
+		digits++;
+		if (time[1] == ':' && ipart < 2) {
+			ipart++;
+			time++;
+		}
+	}
+
+	if (!digits || ipart != 2)
+		return -1;
+
+	int ms = ((parts[0] * 60 + parts[1]) * 60 + parts[2]) * 1000;
+	if (*time == '.' || *time == ',') {
+		int mult = 100;
+		for (time++; *time >= '0' && *time <= '9'; time++) {
+			ms += mult * (*time - '0');
+			mult /= 10;
+		}
+	}
+
+	return ms;
+}
+
+static void unescape(char *text) {
+	char *out = text;
+
+	for (char *ptr = text; *ptr; ptr++) {
+		if (ptr[0] == '\\' && (ptr[1] == 'N' || ptr[1] == 'n')) {
+			*out++ = '\n';
+			ptr++;
+		} else if (ptr[0] == '\\' && ptr[1] == 'h') {
+			// non-breaking space (which is 2 bytes in UTF-8, like "\h")
+			*out++ = '\xC2';
+			*out++ = '\xA0';
+			ptr++;
+		} else {
+			*out++ = *ptr;
+		}
+	}
+
+	*out = '\0';
+}
+
+static char *skip_spaces(char *line) {
+	while (*line == ' ' || *line == '\t')
+		line++;
+	return line;
+}
+
+static char *after(char *line, const char *prefix) {
+	size_t len = strlen(prefix);
+	if (strncmp(line, prefix, len))
+		return NULL;
+	return skip_spaces(line + len);
+}
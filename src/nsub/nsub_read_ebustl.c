@@ -0,0 +1,464 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// EBU Tech 3264: a 1024 bytes GSI block, then 128 bytes TTI blocks
+#define STL_GSI_SIZE 1024
+#define STL_TTI_SIZE 128
+#define STL_TF_SIZE 112
+
+// the character code tables (GSI CCT)
+#define STL_CCT_LATIN 0
+#define STL_CCT_CYRILLIC 1
+#define STL_CCT_ARABIC 2
+#define STL_CCT_GREEK 3
+#define STL_CCT_HEBREW 4
+
+// the (EBN) extension block number of the last block of a subtitle
+#define STL_EBN_LAST 0xFF
+// the (EBN) extension block number of the user data blocks
+#define STL_EBN_USER 0xFE
+
+// the state of the reader (song->reader)
+typedef struct {
+	// the current block (GSI, then TTI), when it spans several chunks
+	unsigned char block[STL_GSI_SIZE];
+	size_t filled;
+	int gsi_done;
+	int failed;
+	// the character code table
+	int cct;
+	// the number of TTI blocks given by the GSI (0 if unknown), and read
+	int total;
+	size_t count;
+	// the text of the current subtitle (over its extension blocks)
+	int italics;
+	cstring_t *text;
+} stl_reader_t;
+
+// get (or create) the state of the reader
+static stl_reader_t *get_reader(song_t *song);
+// read the GSI block, FALSE if not an EBU-STL file
+static int read_gsi(song_t *song, stl_reader_t *reader, const char *gsi);
+// read one TTI block
+static void read_tti(song_t *song, stl_reader_t *reader,
+		const unsigned char *tti);
+// decode a text field (TF) into UTF-8
+static void decode_text(cstring_t *out, const unsigned char *tf, int cct,
+		int *italics);
+// add a code point in UTF-8
+static void add_utf8(cstring_t *out, unsigned int code);
+// the code point of an ISO 6937 spacing character (0xA0-0xFF), 0 if none
+static unsigned int iso6937(unsigned char car);
+// the code point of a diacritic + letter (ISO 6937), 0 if none
+static unsigned int compose(unsigned char diacritic, unsigned char car);
+// the code point of an ISO 8859-5/6/7/8 character (0xA0-0xFF), 0 if none
+static unsigned int iso8859(unsigned char car, int cct);
+// the ms of an HH MM SS FF time code
+static int timecode(const unsigned char *tc, ratio_t fps);
+// read a number from a fixed-size ASCII field
+static int gsi_number(const char *field, size_t size);
+// add a meta from a fixed-size ASCII field, if not empty
+static void gsi_meta(song_t *song, char *key, const char *field, size_t size);
+
+/* Public */
+
+int nsub_read_ebustl(song_t *song, const char *data, size_t size) {
+	stl_reader_t *reader = get_reader(song);
+	if (reader->failed)
+		return 0;
+
+	while (size) {
+		size_t block = reader->gsi_done ? STL_TTI_SIZE : STL_GSI_SIZE;
+
+		// Whole blocks are read in place, the others are completed first
+		const char *ptr = data;
+		if (reader->filled || size < block) {
+			size_t len = block - reader->filled;
+			if (len > size)
+				len = size;
+			memcpy(reader->block + reader->filled, data, len);
+			reader->filled += len;
+			data += len;
+			size -= len;
+			if (reader->filled < block)
+				break;
+
+			ptr = (const char *) reader->block;
+			reader->filled = 0;
+		} else {
+			data += block;
+			size -= block;
+		}
+
+		if (reader->gsi_done) {
+			read_tti(song, reader, (const unsigned char *) ptr);
+		} else if (read_gsi(song, reader, ptr)) {
+			reader->gsi_done = 1;
+		} else {
+			reader->failed = 1;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+int nsub_read_ebustl_end(song_t *song, int ok) {
+	stl_reader_t *reader = get_reader(song);
+	if (ok && !reader->failed && !reader->gsi_done) {
+		fprintf(stderr, "Not an EBU-STL file\n");
+		ok = 0;
+	}
+
+	// A partial last TTI block is ignored
+	free_cstring(reader->text);
+	reader->text = NULL;
+	return ok && !reader->failed;
+}
+
+/* Private */
+
+static stl_reader_t *get_reader(song_t *song) {
+	if (!song->reader) {
+		stl_reader_t *reader = malloc(sizeof(stl_reader_t));
+		reader->filled = 0;
+		reader->gsi_done = 0;
+		reader->failed = 0;
+		reader->cct = STL_CCT_LATIN;
+		reader->total = 0;
+		reader->count = 0;
+		reader->italics = 0;
+		reader->text = new_cstring();
+
+		song->reader = reader;
+	}
+
+	return song->reader;
+}
+
+static int read_gsi(song_t *song, stl_reader_t *reader, const char *gsi) {
+	/* GSI (General Subtitle Information) */
+	if (strncmp(gsi + 3, "STL", 3)) {
+		fprintf(stderr, "Not an EBU-STL file\n");
+		return 0;
+	}
+
+	// Frame rate: STL25.01 or STL30.01 (an explicit one wins)
+	if (!song->fps.num) {
+		song->fps.num = gsi_number(gsi + 6, 2) == 30 ? 30 : 25;
+		song->fps.den = 1;
+	}
+
+	reader->cct = gsi_number(gsi + 12, 2);
+
+	static const char *langs[] = { NULL, "sq", "br", "ca", "hr", "cy", "cs",
+			"da", "de", "en", "es", "eo", "et", "eu", "fo", "fr", "fy", "ga",
+			"gd", "gl", "is", "it", "se", "la", "lv", "lb", "lt", "hu", "mt",
+			"nl", "no", "oc", "pl", "pt", "ro", "rm", "sr", "sk", "sl", "fi",
+			"sv", "tr", "nl", "wa" };
+	char lc[3] = { gsi[14], gsi[15], '\0' };
+	long lang = strtol(lc, NULL, 16);
+	if (lang > 0 && lang < (long) (sizeof(langs) / sizeof(langs[0]))) {
+		free(song->lang);
+		song->lang = strdup(langs[lang]);
+	}
+
+	gsi_meta(song, "ti", gsi + 16, 32);
+	gsi_meta(song, "ebu.episode", gsi + 48, 32);
+	gsi_meta(song, "by", gsi + 144, 32);
+
+	// The timings are relative to the start of the programme (TCP)
+	{
+		const char *tcp = gsi + 256;
+		unsigned char tc[4];
+		for (int i = 0; i < 4; i++)
+			tc[i] = gsi_number(tcp + 2 * i, 2);
+		song->offset = -timecode(tc, song->fps);
+	}
+
+	// The number of TTI blocks, if the file has that many
+	reader->total = gsi_number(gsi + 238, 5);
+
+	return 1;
+}
+
+static void read_tti(song_t *song, stl_reader_t *reader,
+		const unsigned char *tti) {
+	/* TTI (Text and Timing Information) blocks */
+	if (reader->total > 0 && reader->count >= (size_t) reader->total)
+		return;
+	reader->count++;
+
+	int ebn = tti[3];
+	if (ebn == STL_EBN_USER)
+		return;
+
+	// The text of the extension blocks is joined
+	cstring_t *text = reader->text;
+	decode_text(text, tti + 16, reader->cct, &reader->italics);
+	if (ebn != STL_EBN_LAST)
+		return;
+
+	// Teletext padding: no spaces around the lines
+	char *line = text->string;
+	size_t len = text->length;
+	while (len && (line[len - 1] == ' ' || line[len - 1] == '\n'))
+		line[--len] = '\0';
+	while (*line == ' ' || *line == '\n')
+		line++;
+
+	int comment = tti[15];
+	if (comment) {
+		song_add_comment(song, line);
+	} else {
+		int start = timecode(tti + 5, song->fps);
+		int stop = timecode(tti + 9, song->fps);
+		song_add_lyric(song, start, stop, NULL, line);
+	}
+
+	cstring_clear(text);
+	reader->italics = 0;
+}
+
+static void decode_text(cstring_t *out, const unsigned char *tf, int cct,
+		int *italics) {
+	for (int i = 0; i < STL_TF_SIZE; i++) {
+		unsigned char car = tf[i];
+
+		// Unused space: end of the text
+		if (car == 0x8F)
+			break;
+
+		if (car == 0x8A) {
+			// CR/LF (twice for double height rows)
+			size_t len = out->length;
+			while (len && out->string[len - 1] == ' ')
+				out->string[--len] = '\0';
+			out->length = len;
+			if (len && out->string[len - 1] != '\n')
+				cstring_add_car(out, '\n');
+		} else if (car == 0x80 || car == 0x81) {
+			// Italics on/off
+			if (*italics != (car == 0x80))
+				cstring_add(out, car == 0x80 ? "<i>" : "</i>");
+			*italics = (car == 0x80);
+		} else if (car < 0x20 || (car >= 0x80 && car < 0xA0)) {
+			// Teletext controls (colours, boxing...): a space in Teletext
+			if (car < 0x20 && out->length
+					&& out->string[out->length - 1] != ' '
+					&& out->string[out->length - 1] != '\n')
+				cstring_add_car(out, ' ');
+		} else if (car == ' ') {
+			// Teletext alignment: no spaces at the start of a row, nor twice
+			if (out->length && out->string[out->length - 1] != ' '
+					&& out->string[out->length - 1] != '\n')
+				cstring_add_car(out, ' ');
+		} else if (car < 0x7F) {
+			if (cct == STL_CCT_LATIN && car == 0x24)
+				add_utf8(out, 0xA4); // ¤
+			else
+				cstring_add_car(out, car);
+		} else if (cct != STL_CCT_LATIN) {
+			unsigned int code = iso8859(car, cct);
+			if (code)
+				add_utf8(out, code);
+		} else if (car >= 0xC1 && car <= 0xCF) {
+			// Non-spacing diacritic, before its letter
+			unsigned char letter = (i + 1 < STL_TF_SIZE) ? tf[i + 1] : ' ';
+			unsigned int code = compose(car, letter);
+			if (code) {
+				add_utf8(out, code);
+				i++;
+			} else if (letter >= 0x20 && letter < 0x7F) {
+				// Letter + combining diacritic
+				static const unsigned short marks[] = { 0x300, 0x301, 0x302,
+						0x303, 0x304, 0x306, 0x307, 0x308, 0, 0x30A, 0x327, 0,
+						0x30B, 0x328, 0x30C };
+				cstring_add_car(out, letter);
+				if (marks[car - 0xC1])
+					add_utf8(out, marks[car - 0xC1]);
+				i++;
+			}
+		} else {
+			unsigned int code = iso6937(car);
+			if (code)
+				add_utf8(out, code);
+		}
+	}
+}
+
+static void add_utf8(cstring_t *out, unsigned int code) {
+	if (code < 0x80) {
+		cstring_add_car(out, code);
+	} else if (code < 0x800) {
+		cstring_add_car(out, 0xC0 | (code >> 6));
+		cstring_add_car(out, 0x80 | (code & 0x3F));
+	} else {
+		cstring_add_car(out, 0xE0 | (code >> 12));
+		cstring_add_car(out, 0x80 | ((code >> 6) & 0x3F));
+		cstring_add_car(out, 0x80 | (code & 0x3F));
+	}
+}
+
+static unsigned int iso6937(unsigned char car) {
+	static const unsigned short table[] = {
+			// 0xA0
+			0xA0, 0xA1, 0xA2, 0xA3, '$', 0xA5, '#', 0xA7,
+			0xA4, 0x2018, 0x201C, 0xAB, 0x2190, 0x2191, 0x2192, 0x2193,
+			// 0xB0
+			0xB0, 0xB1, 0xB2, 0xB3, 0xD7, 0xB5, 0xB6, 0xB7,
+			0xF7, 0x2019, 0x201D, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF,
+			// 0xC0 (diacritics)
+			0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+			// 0xD0
+			0x2015, 0xB9, 0xAE, 0xA9, 0x2122, 0x266A, 0xAC, 0xA6,
+			0, 0, 0, 0, 0x215B, 0x215C, 0x215D, 0x215E,
+			// 0xE0
+			0x2126, 0xC6, 0x110, 0xAA, 0x126, 0, 0x132, 0x13F,
+			0x141, 0xD8, 0x152, 0xBA, 0xDE, 0x166, 0x14A, 0x149,
+			// 0xF0
+			0x138, 0xE6, 0x111, 0xF0, 0x127, 0x131, 0x133, 0x140,
+			0x142, 0xF8, 0x153, 0xDF, 0xFE, 0x167, 0x14B, 0xAD };
+
+	if (car < 0xA0)
+		return 0;
+	return table[car - 0xA0];
+}
+
+static unsigned int compose(unsigned char diacritic, unsigned char car) {
+	// The Latin-1 letters, then the most common others (Central Europe)
+	static const char *letters[] = { "AEIOUaeiou",
+			"AEIOUYaeiouyCcNnSsZzLlRr", "AEIOUaeiou", "ANOano", "", "AaGgUu",
+			"ZzI", "AEIOUaeiouy", "", "AaUu", "CcSsTt", "", "OoUu", "AaEe",
+			"CcDdEeNnRrSsTtZz" };
+	static const unsigned short codes[][24] = {
+			// 0xC1: grave
+			{ 0xC0, 0xC8, 0xCC, 0xD2, 0xD9, 0xE0, 0xE8, 0xEC, 0xF2, 0xF9 },
+			// 0xC2: acute
+			{ 0xC1, 0xC9, 0xCD, 0xD3, 0xDA, 0xDD, 0xE1, 0xE9, 0xED, 0xF3,
+					0xFA, 0xFD, 0x106, 0x107, 0x143, 0x144, 0x15A, 0x15B,
+					0x179, 0x17A, 0x139, 0x13A, 0x154, 0x155 },
+			// 0xC3: circumflex
+			{ 0xC2, 0xCA, 0xCE, 0xD4, 0xDB, 0xE2, 0xEA, 0xEE, 0xF4, 0xFB },
+			// 0xC4: tilde
+			{ 0xC3, 0xD1, 0xD5, 0xE3, 0xF1, 0xF5 },
+			// 0xC5: macron
+			{ 0 },
+			// 0xC6: breve
+			{ 0x102, 0x103, 0x11E, 0x11F, 0x16C, 0x16D },
+			// 0xC7: dot
+			{ 0x17B, 0x17C, 0x130 },
+			// 0xC8: umlaut
+			{ 0xC4, 0xCB, 0xCF, 0xD6, 0xDC, 0xE4, 0xEB, 0xEF, 0xF6, 0xFC, 0xFF },
+			// 0xC9: (unused)
+			{ 0 },
+			// 0xCA: ring
+			{ 0xC5, 0xE5, 0x16E, 0x16F },
+			// 0xCB: cedilla
+			{ 0xC7, 0xE7, 0x15E, 0x15F, 0x162, 0x163 },
+			// 0xCC: (unused)
+			{ 0 },
+			// 0xCD: double acute
+			{ 0x150, 0x151, 0x170, 0x171 },
+			// 0xCE: ogonek
+			{ 0x104, 0x105, 0x118, 0x119 },
+			// 0xCF: caron
+			{ 0x10C, 0x10D, 0x10E, 0x10F, 0x11A, 0x11B, 0x147, 0x148, 0x158,
+					0x159, 0x160, 0x161, 0x164, 0x165, 0x17D, 0x17E } };
+
+	if (diacritic < 0xC1 || diacritic > 0xCF || !car)
+		return 0;
+
+	const char *list = letters[diacritic - 0xC1];
+	const char *letter = strchr(list, car);
+	return letter ? codes[diacritic - 0xC1][letter - list] : 0;
+}
+static unsigned int iso8859(unsigned char car, int cct) {
+	if (car == 0xA0)
+		return 0xA0;
+
+	switch (cct) {
+	case STL_CCT_CYRILLIC: // ISO 8859-5
+		if (car == 0xAD)
+			return 0xAD;
+		if (car == 0xF0)
+			return 0x2116;
+		if (car == 0xFD)
+			return 0xA7;
+		return 0x400 + (car - 0xA0);
+	case STL_CCT_ARABIC: // ISO 8859-6
+		if (car >= 0xC1 && car <= 0xF2)
+			return 0x600 + (car - 0xA0);
+		return car == 0xAC ? 0x60C : car == 0xBB ? 0x61B : car == 0xBF ? 0x61F
+				: 0;
+	case STL_CCT_GREEK: // ISO 8859-7
+		if (car >= 0xB4 && car != 0xB7 && car != 0xBB && car != 0xBD
+				&& car != 0xD2 && car != 0xFF)
+			return 0x384 + (car - 0xB4);
+		return car == 0xA1 ? 0x2018 : car == 0xA2 ? 0x2019 : car;
+	case STL_CCT_HEBREW: // ISO 8859-8
+		if (car >= 0xE0 && car <= 0xFA)
+			return 0x5D0 + (car - 0xE0);
+		return (car < 0xBF) ? (car == 0xAA ? 0xD7 : car == 0xBA ? 0xF7 : car)
+				: 0;
+	default:
+		return 0;
+	}
+}
+
+static int timecode(const unsigned char *tc, ratio_t fps) {
+	ratio_t to_ms = { fps.den * 1000, fps.num };
+	return ((tc[0] * 60 + tc[1]) * 60 + tc[2]) * 1000
+			+ apply_ratio(tc[3], to_ms);
+}
+
+static int gsi_number(const char *field, size_t size) {
+	int value = 0;
+	for (size_t i = 0; i < size; i++) {
+		if (field[i] >= '0' && field[i] <= '9')
+			value = value * 10 + (field[i] - '0');
+	}
+
+	return value;
+}
+
+static void gsi_meta(song_t *song, char *key, const char *field, size_t size) {
+	// The GSI uses a code page: keep the ASCII part only
+	char value[64];
+	size_t len = 0;
+	for (size_t i = 0; i < size && len < sizeof(value) - 1; i++) {
+		unsigned char car = field[i];
+		value[len++] = (car >= 0x20 && car < 0x7F) ? car : '?';
+	}
+
+	while (len && (value[len - 1] == ' ' || value[len - 1] == '?'))
+		len--;
+	value[len] = '\0';
+
+	if (len)
+		song_add_meta(song, key, value);
+}
@@ -0,0 +1,479 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the fields of a JSON Lines object (the strings point into the copy of
+// the line)
+typedef struct {
+	char *type;
+	char *name;
+	char *text;
+	char *lang;
+	int has_lang;
+	int id;
+	int start;
+	int stop;
+	int offset;
+	// key, value, key, value... (char *)
+	array_t *metas;
+	// word_t
+	array_t *words;
+} object_t;
+
+// read the fields of a line, FALSE if it is not a valid object
+static int read_object(char *ptr, object_t *object);
+// add the object to the song, FALSE if it is not a valid one
+static int add_object(song_t *song, object_t *object);
+// skip the JSON white spaces
+static void skip_spaces(char **ptr);
+// expect this character (after spaces) and move after it
+static int expect(char **ptr, char car);
+// read a string and decode it in place (NUL-terminated), NULL if invalid
+static char *read_string(char **ptr);
+// read a string or null (*value is then NULL), FALSE if invalid
+static int read_string_or_null(char **ptr, char **value);
+// read an integer, FALSE if invalid (or not an int)
+static int read_int(char **ptr, int *value);
+// skip any value, FALSE if invalid
+static int skip_value(char **ptr, int depth);
+// read the metas object: {"key":"value",...}
+static int read_metas(char **ptr, array_t *metas);
+// read the words array: [[offset,start],...]
+static int read_words(char **ptr, array_t *words);
+// read 4 hexadecimal digits, FALSE if there are not
+static int read_hex4(const char *ptr, unsigned long *code);
+// encode a code point in UTF-8, return the number of bytes
+static int put_utf8(char *buf, unsigned long code);
+
+/* Public */
+
+int nsub_read_jsonl(song_t *song, char *line) {
+	// {"type":"header","lang":"en","offset":0,"metas":{"ti":"Title"}}
+	// {"type":"lyric","num":1,"start":1000,"stop":2500,"text":"Hello"}
+
+	char *ptr = line;
+	skip_spaces(&ptr);
+	if (!*ptr)
+		return 1;
+
+	// The strings are decoded in place, in a copy (the line is shown as it
+	// is in case of error)
+	char buf[4096];
+	size_t len = strlen(ptr);
+	char *copy = len < sizeof(buf) ? buf : malloc(len + 1);
+	memcpy(copy, ptr, len + 1);
+
+	object_t object;
+	memset(&object, 0, sizeof(object));
+	object.metas = new_array(sizeof(char *), 8);
+	object.words = new_array(sizeof(word_t), 8);
+
+	int ok = read_object(copy, &object) && add_object(song, &object);
+
+	free_array(object.metas);
+	free_array(object.words);
+	if (copy != buf)
+		free(copy);
+	return ok;
+}
+
+/* Private */
+
+static int read_object(char *ptr, object_t *object) {
+	if (!expect(&ptr, '{'))
+		return 0;
+
+	skip_spaces(&ptr);
+	int more = *ptr != '}';
+	if (!more)
+		ptr++;
+
+	while (more) {
+		char *key = read_string(&ptr);
+		if (!key || !expect(&ptr, ':'))
+			return 0;
+
+		skip_spaces(&ptr);
+		int ok;
+		if (!strcmp("type", key)) {
+			object->type = read_string(&ptr);
+			ok = object->type != NULL;
+		} else if (!strcmp("name", key)) {
+			ok = read_string_or_null(&ptr, &object->name);
+		} else if (!strcmp("text", key)) {
+			ok = read_string_or_null(&ptr, &object->text);
+		} else if (!strcmp("lang", key)) {
+			ok = read_string_or_null(&ptr, &object->lang);
+			object->has_lang = 1;
+		} else if (!strcmp("id", key)) {
+			ok = read_int(&ptr, &object->id);
+		} else if (!strcmp("start", key)) {
+			ok = read_int(&ptr, &object->start);
+		} else if (!strcmp("stop", key)) {
+			ok = read_int(&ptr, &object->stop);
+		} else if (!strcmp("offset", key)) {
+			ok = read_int(&ptr, &object->offset);
+		} else if (!strcmp("metas", key)) {
+			ok = read_metas(&ptr, object->metas);
+		} else if (!strcmp("words", key)) {
+			ok = read_words(&ptr, object->words);
+		} else {
+			// "num" (the lyrics are numbered again) and the unknown keys
+			ok = skip_value(&ptr, 0);
+		}
+
+		skip_spaces(&ptr);
+		if (!ok || (*ptr != ',' && *ptr != '}'))
+			return 0;
+		more = *ptr++ == ',';
+	}
+
+	// Nothing after the object
+	skip_spaces(&ptr);
+	return !*ptr && object->type;
+}
+
+static int add_object(song_t *song, object_t *object) {
+	if (!strcmp("header", object->type)) {
+		if (object->has_lang) {
+			free(song->lang);
+			song->lang = object->lang ? strdup(object->lang) : NULL;
+		}
+		song->offset = object->offset;
+		for (size_t i = 0; i + 1 < array_count(object->metas); i += 2)
+			song_add_meta(song, *(char **) array_get(object->metas, i),
+					*(char **) array_get(object->metas, i + 1));
+		return 1;
+	}
+
+	if (!strcmp("lyric", object->type)) {
+		// The words must be in the text, in order
+		size_t len = object->text ? strlen(object->text) : 0;
+		int prev = 0;
+		array_loop(object->words, word, word_t)
+		{
+			if (word->offset < prev || (size_t) word->offset > len)
+				return 0;
+			prev = word->offset;
+		}
+
+		song_add_lyric(song, object->start, object->stop, object->name,
+				object->text);
+		lyric_t *lyric = array_last(song->lyrics);
+		lyric->id = object->id;
+		lyric->word = array_count(song->words);
+		lyric->words = array_count(object->words);
+		array_loop(object->words, word, word_t)
+		{
+			word_t *dst = array_new(song->words);
+			*dst = *word;
+		}
+
+		return 1;
+	}
+
+	if (!strcmp("comment", object->type))
+		song_add_comment(song, object->text ? object->text : "");
+	else if (!strcmp("empty", object->type))
+		song_add_empty(song);
+	else if (!strcmp("unknown", object->type))
+		song_add_unknown(song, object->text ? object->text : "");
+	else
+		return 0;
+
+	if (object->name) {
+		lyric_t *lyric = array_last(song->lyrics);
+		lyric->name = strdup(object->name);
+	}
+
+	return 1;
+}
+
+static void skip_spaces(char **ptr) {
+	while (**ptr == ' ' || **ptr == '\t' || **ptr == '\r' || **ptr == '\n')
+		(*ptr)++;
+}
+
+static int expect(char **ptr, char car) {
+	skip_spaces(ptr);
+	if (**ptr != car)
+		return 0;
+
+	(*ptr)++;
+	return 1;
+}
+
+static char *read_string(char **ptr) {
+	skip_spaces(ptr);
+	if (**ptr != '"')
+		return NULL;
+
+	// The decoded text is never longer than the escaped one
+	char *start = *ptr + 1;
+	char *dst = start;
+	char *src = start;
+	while (*src != '"') {
+		if ((unsigned char) *src < 0x20)
+			return NULL;
+
+		if (*src != '\\') {
+			*dst++ = *src++;
+			continue;
+		}
+
+		src++;
+		switch (*src++) {
+		case '"':
+			*dst++ = '"';
+			break;
+		case '\\':
+			*dst++ = '\\';
+			break;
+		case '/':
+			*dst++ = '/';
+			break;
+		case 'b':
+			*dst++ = '\b';
+			break;
+		case 'f':
+			*dst++ = '\f';
+			break;
+		case 'n':
+			*dst++ = '\n';
+			break;
+		case 'r':
+			*dst++ = '\r';
+			break;
+		case 't':
+			*dst++ = '\t';
+			break;
+		case 'u': {
+			unsigned long code;
+			if (!read_hex4(src, &code) || !code)
+				return NULL;
+			src += 4;
+
+			// Outside of the BMP: a surrogate pair
+			unsigned long low;
+			if (code >= 0xD800 && code <= 0xDBFF && src[0] == '\\'
+					&& src[1] == 'u' && read_hex4(src + 2, &low)
+					&& low >= 0xDC00 && low <= 0xDFFF) {
+				code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				src += 6;
+			} else if (code >= 0xD800 && code <= 0xDFFF) {
+				code = 0xFFFD;
+			}
+
+			dst += put_utf8(dst, code);
+			break;
+		}
+		default:
+			return NULL;
+		}
+	}
+
+	*dst = '\0';
+	*ptr = src + 1;
+	return start;
+}
+
+static int read_string_or_null(char **ptr, char **value) {
+	skip_spaces(ptr);
+	if (!strncmp(*ptr, "null", 4)) {
+		*ptr += 4;
+		*value = NULL;
+		return 1;
+	}
+
+	*value = read_string(ptr);
+	return *value != NULL;
+}
+
+static int read_int(char **ptr, int *value) {
+	skip_spaces(ptr);
+	char *end;
+	long long number = strtoll(*ptr, &end, 10);
+	if (end == *ptr || *end == '.' || *end == 'e' || *end == 'E'
+			|| number < INT_MIN || number > INT_MAX)
+		return 0;
+
+	*value = number;
+	*ptr = end;
+	return 1;
+}
+
+static int skip_value(char **ptr, int depth) {
+	// Not too deep: the line is not trusted
+	if (depth > 32)
+		return 0;
+
+	skip_spaces(ptr);
+	char car = **ptr;
+	if (car == '"')
+		return read_string(ptr) != NULL;
+
+	if (car == '{' || car == '[') {
+		char close = car == '{' ? '}' : ']';
+		(*ptr)++;
+		skip_spaces(ptr);
+		if (**ptr == close) {
+			(*ptr)++;
+			return 1;
+		}
+
+		while (1) {
+			if (car == '{' && (!read_string(ptr) || !expect(ptr, ':')))
+				return 0;
+			if (!skip_value(ptr, depth + 1))
+				return 0;
+
+			skip_spaces(ptr);
+			if (**ptr == close) {
+				(*ptr)++;
+				return 1;
+			}
+			if (**ptr != ',')
+				return 0;
+			(*ptr)++;
+		}
+	}
+
+	// A number, true, false or null
+	char *start = *ptr;
+	while ((**ptr >= '0' && **ptr <= '9') || (**ptr >= 'a' && **ptr <= 'z')
+			|| **ptr == '-' || **ptr == '+' || **ptr == '.' || **ptr == 'E')
+		(*ptr)++;
+
+	return *ptr != start;
+}
+
+static int read_metas(char **ptr, array_t *metas) {
+	if (!expect(ptr, '{'))
+		return 0;
+
+	skip_spaces(ptr);
+	if (**ptr == '}') {
+		(*ptr)++;
+		return 1;
+	}
+
+	while (1) {
+		char *key = read_string(ptr);
+		if (!key || !expect(ptr, ':'))
+			return 0;
+		char *value = read_string(ptr);
+		if (!value)
+			return 0;
+
+		char **item = array_new(metas);
+		*item = key;
+		item = array_new(metas);
+		*item = value;
+
+		skip_spaces(ptr);
+		if (**ptr == '}') {
+			(*ptr)++;
+			return 1;
+		}
+		if (**ptr != ',')
+			return 0;
+		(*ptr)++;
+	}
+}
+
+static int read_words(char **ptr, array_t *words) {
+	if (!expect(ptr, '['))
+		return 0;
+
+	skip_spaces(ptr);
+	if (**ptr == ']') {
+		(*ptr)++;
+		return 1;
+	}
+
+	while (1) {
+		word_t *word = array_new(words);
+		if (!expect(ptr, '[') || !read_int(ptr, &word->offset)
+				|| !expect(ptr, ',') || !read_int(ptr, &word->start)
+				|| !expect(ptr, ']'))
+			return 0;
+
+		skip_spaces(ptr);
+		if (**ptr == ']') {
+			(*ptr)++;
+			return 1;
+		}
+		if (**ptr != ',')
+			return 0;
+		(*ptr)++;
+	}
+}
+
+static int read_hex4(const char *ptr, unsigned long *code) {
+	*code = 0;
+	for (int i = 0; i < 4; i++) {
+		char car = ptr[i];
+		*code <<= 4;
+		if (car >= '0' && car <= '9')
+			*code |= car - '0';
+		else if (car >= 'a' && car <= 'f')
+			*code |= car - 'a' + 10;
+		else if (car >= 'A' && car <= 'F')
+			*code |= car - 'A' + 10;
+		else
+			return 0;
+	}
+
+	return 1;
+}
+
+static int put_utf8(char *buf, unsigned long code) {
+	if (code < 0x80) {
+		buf[0] = code;
+		return 1;
+	}
+
+	if (code < 0x800) {
+		buf[0] = 0xC0 | (code >> 6);
+		buf[1] = 0x80 | (code & 0x3F);
+		return 2;
+	}
+
+	if (code < 0x10000) {
+		buf[0] = 0xE0 | (code >> 12);
+		buf[1] = 0x80 | ((code >> 6) & 0x3F);
+		buf[2] = 0x80 | (code & 0x3F);
+		return 3;
+	}
+
+	buf[0] = 0xF0 | (code >> 18);
+	buf[1] = 0x80 | ((code >> 12) & 0x3F);
+	buf[2] = 0x80 | ((code >> 6) & 0x3F);
+	buf[3] = 0x80 | (code & 0x3F);
+	return 4;
+}
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "nsub.h"
@@ -24,33 +25,54 @@
 
 /* Declarations */
 
-// test if this is an offset line
-static int is_lrc_offset(char *line);
-// test if it is a timed lyric
-static int is_lrc_lyric(char *line, int*end);
-// test if this is a meta line
-static int is_lrc_meta(char *line, int *colon, int *end);
-// count the ms in the line "[(00:0)0:14.80]" or "[offset: +0:12]"
-static int lrc_millisec(char *line);
+// the maximum number of timestamps on one line
+#define MAX_STAMPS 64
+
+// the kind of an LRC line
+typedef enum {
+	LRC_EMPTY, LRC_OFFSET, LRC_LYRIC, LRC_META, LRC_COMMENT
+} LRC_LINE;
+
+// an LRC line, classified in one pass (positions are offsets in the line)
+typedef struct {
+	LRC_LINE type;
+	// LRC_OFFSET: the offset in ms
+	int offset;
+	// LRC_LYRIC: the timestamps in ms (only the first MAX_STAMPS)
+	int starts[MAX_STAMPS];
+	int nstarts;
+	// LRC_LYRIC: the text, after the spaces; LRC_COMMENT: the comment
+	int text;
+	// LRC_META: "[key:  value]", the ':', the value and the ']'
+	int colon;
+	int value;
+	int end;
+} lrc_line_t;
+
+// classify a line and find its parts, without allocating anything
+static void scan_line(const char *line, lrc_line_t *scan);
+// read a "(00:0)0:14.80]" timestamp up to its ']', FALSE if it is not one
+static int read_stamp(const char *ptr, int *ms, const char **end);
+// move the <00:14.80> word timings of the text to the side table (count)
+static int read_words(song_t *song, char *text);
 
 /* Public */
 
 int nsub_read_lrc(song_t *song, char *line) {
-	int colon;
-	int end;
-
-	int empty = 1;
-	for (int i = 0; empty && line[i]; i++) {
-		if (line[i] != ' ')
-			empty = 0;
-	}
+	lrc_line_t scan;
+	scan_line(line, &scan);
 
-	if (empty) {
+	if (scan.type == LRC_EMPTY) {
 		song_add_empty(song);
-	} else if (is_lrc_offset(line)) {
-		song->offset = lrc_millisec(line);
-	} else if (is_lrc_lyric(line, &end)) {
-		int start = lrc_millisec(line);
+	} else if (scan.type == LRC_OFFSET) {
+		song->offset = scan.offset;
+	} else if (scan.type == LRC_LYRIC) {
+		// [00:12.00][01:05.00][02:10.00]Chorus
+		int *starts = scan.starts;
+		int nstarts = scan.nstarts;
+		int text_offset = scan.text;
+
+		int start = starts[0];
 		char *name = NULL;
 
 		{
@@ -65,189 +87,270 @@ int nsub_read_lrc(song_t *song, char *line) {
 				name = NULL;
 		}
 
-		int text_offset = end + 2;
-		while (line[text_offset] == ' ')
-			text_offset++;
-
 		if (line[text_offset]) {
+			// The comment becomes the name of the lyric
 			if (name) {
+				name = strdup(name);
 				lyric_t *tmp = array_pop(song->lyrics);
 				uninit_lyric(tmp);
-				song->current_num--;
 			}
-			song_add_lyric(song, start, start + 5000, name, line + text_offset);
+
+			int word = array_count(song->words);
+			int words = read_words(song, line + text_offset);
+
+			// One cue per timestamp, all sharing the same text; LRC has no
+			// stops: stop = start until the next lyric (or the end) sets it
+			char *text = line + text_offset;
+			for (int i = 0; i < nstarts; i++) {
+				if (nstarts == 1) {
+					song_add_lyric(song, start, start, name, text);
+				} else {
+					if (!i)
+						text = song_intern(song, text);
+					song_add_shared(song, starts[i], starts[i], name, text);
+				}
+
+				lyric_t *lyric = array_last(song->lyrics);
+				lyric->word = word;
+				lyric->words = words;
+				if (!i)
+					continue;
+
+				// The word timings follow their cue
+				lyric->word = array_count(song->words);
+				for (int j = 0; j < words; j++) {
+					// A copy: array_new can move the words
+					word_t src = *(word_t *) array_get(song->words, word + j);
+					word_t *dst = array_new(song->words);
+					dst->offset = src.offset;
+					dst->start = src.start + (starts[i] - start);
+				}
+			}
+
+			free(name);
 		} else {
 			song_add_empty(song);
 		}
-	} else if (is_lrc_meta(line, &colon, &end)) {
-		int text_offset = colon + 1;
-		while (line[text_offset] == ' ')
-			text_offset++;
-
-		line[colon] = '\0';
-		line[end] = '\0';
+	} else if (scan.type == LRC_META) {
+		// The key and the value are cut in place, then restored
+		line[scan.colon] = '\0';
+		line[scan.end] = '\0';
 		if (!strcmp("language", line + 1)) {
-			song->lang = strdup(line + text_offset);
+			free(song->lang);
+			song->lang = strdup(line + scan.value);
 		} else if (!strcmp("created_by", line + 1)) {
 			// skip (we KNOW what program we are)
 		} else {
-			song_add_meta(song, line + 1, line + text_offset);
+			song_add_meta(song, line + 1, line + scan.value);
 		}
-		line[colon] = ':';
-		line[end] = ']';
+		line[scan.colon] = ':';
+		line[scan.end] = ']';
 	} else {
-		if (line[0] == '-' && line[1] == '-' && line[2] == ' ')
-			line += 3;
-		song_add_comment(song, line);
+		song_add_comment(song, line + scan.text);
 	}
 
 	return 1;
 }
 
-/* Private */
-
-static int is_lrc_offset(char *line) {
-	// [offset: +0:12]
-
-	// skip spaces
-	while (*line == ' ')
-		line++;
-
-	// skip [offset
-	char *offset = { "[offset" };
-	while (*line && *offset && *offset == *line) {
-		line++;
-		offset++;
+int nsub_read_lrc_end(song_t *song) {
+	// Lines with several timestamps are not in time order
+	if (!song_sorted(song))
+		song_sort(song);
+
+	// A lyric stops when the next one starts (at the latest)
+	lyric_t *prev = NULL;
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type != NSUB_LYRIC)
+			continue;
+		if (prev && (prev->stop <= prev->start || prev->stop > lyric->start))
+			prev->stop = lyric->start;
+		prev = lyric;
 	}
-	if (*offset)
-		return 0;
 
-	// skip spaces then ':', then spaces
-	while (*line == ' ')
-		line++;
-	if (*line && *line != ':')
-		return 0;
-	line++;
-	while (*line == ' ')
-		line++;
-
-	// allow sign
-	if (*line == '-' || *line == '+')
-		line++;
-	while (*line == ' ')
-		line++;
-
-	// find end
-	int i = 0;
-	while (line[i] && line[i] != ']')
-		i++;
-	if (line[i] != ']')
-		return 0;
+	if (prev && prev->stop <= prev->start)
+		prev->stop = prev->start + 5000;
 
-	// validate timing
-	cstring_t*tmp = cstring_substring(line, 0, i);
-	int ok = nsub_is_timing(tmp->string, '.', 2);
-	free_cstring(tmp);
-	return ok;
+	return 1;
 }
 
-static int is_lrc_lyric(char *line, int *end) {
-	// "[(00:0)0:14.80] bla bla bla"
-
-	*end = 0;
+/* Private */
 
-	// skip spaces
-	while (*line == ' ')
-		line++;
+static void scan_line(const char *line, lrc_line_t *scan) {
+	const char *ptr = line;
+	while (*ptr == ' ')
+		ptr++;
 
-	// skip [
-	if (*line != '[')
-		return 0;
-	line++;
+	if (!*ptr) {
+		scan->type = LRC_EMPTY;
+		return;
+	}
 
-	// find end
-	int i = 0;
-	while (line[i] && line[i] != ']')
-		i++;
-	if (line[i] != ']')
-		return 0;
-	*end = i;
+	const char *end;
+	int ms;
 
-	// validate timing
-	cstring_t*tmp = cstring_substring(line, 0, i);
-	int ok = nsub_is_timing(tmp->string, '.', 2);
-	free_cstring(tmp);
-	return ok;
-}
+	// [offset: +0:12]
+	if (!strncmp(ptr, "[offset", 7)) {
+		const char *tmp = ptr + 7;
+		while (*tmp == ' ')
+			tmp++;
+
+		if (*tmp == ':') {
+			tmp++;
+			while (*tmp == ' ')
+				tmp++;
+
+			int sign = 1;
+			if (*tmp == '+' || *tmp == '-')
+				sign = *tmp++ == '-' ? -1 : 1;
+			while (*tmp == ' ')
+				tmp++;
+
+			if (read_stamp(tmp, &ms, &end)) {
+				scan->type = LRC_OFFSET;
+				scan->offset = sign * ms;
+				return;
+			}
+		}
+	}
 
-static int is_lrc_meta(char *line, int *colon, int *end) {
-	if (line[0] != '[')
-		return 0;
+	// [00:12.00][01:05.00]Some text
+	if (*ptr == '[' && read_stamp(ptr + 1, &ms, &end)) {
+		scan->type = LRC_LYRIC;
+		scan->nstarts = 0;
+		do {
+			if (scan->nstarts < MAX_STAMPS)
+				scan->starts[scan->nstarts++] = ms;
+			ptr = end + 1;
+		} while (*ptr == '[' && read_stamp(ptr + 1, &ms, &end));
+
+		while (*ptr == ' ')
+			ptr++;
+		scan->text = ptr - line;
+		return;
+	}
 
-	*colon = 0;
-	*end = 0;
+	// [key: value], the ']' only followed by spaces
+	if (line[0] == '[') {
+		scan->colon = 0;
+		scan->end = 0;
+		for (int i = 1; line[i]; i++) {
+			char car = line[i];
 
-	for (int i = 1; line[i]; i++) {
-		char car = line[i];
+			if (car == ']')
+				scan->end = i;
+			else if (car != ' ')
+				scan->end = 0;
 
-		if (car == ']')
-			*end = i;
-		else if (car != ' ')
-			*end = 0;
+			if (!scan->colon && car == ':')
+				scan->colon = i;
+		}
 
-		if (!(*colon) && car == ':')
-			*colon = i;
+		if (scan->colon && scan->end) {
+			scan->type = LRC_META;
+			scan->value = scan->colon + 1;
+			while (line[scan->value] == ' ')
+				scan->value++;
+			return;
+		}
 	}
 
-	return (*colon) && (*end);
+	scan->type = LRC_COMMENT;
+	scan->text = 0;
+	if (line[0] == '-' && line[1] == '-' && line[2] == ' ')
+		scan->text = 3;
 }
 
-static int lrc_millisec(char *line) {
-	// count the ms in the line "[(00:0)0:14.80]" or "[offset: +0:12]"
-
-	int sign = 1;
-	int dummy = 0;
-
-	// skip spaces
-	while (*line == ' ')
-		line++;
-
-	if (is_lrc_lyric(line, &dummy)) {
-		// skip [
-		line++;
-	} else if (is_lrc_offset(line)) {
-		// skip [offset:
-		while (*line != ':')
-			line++;
-		line++;
-		while (*line == ' ')
-			line++;
-
-		// allow sign
-		if (*line == '+') {
-			line++;
-		} else if (*line == '-') {
-			line++;
-			sign = -1;
+static int read_stamp(const char *ptr, int *ms, const char **end) {
+	// (00:0)0:14.80 (like nsub_is_timing with 2 decimals, then nsub_to_ms)
+	int digits = 0;
+	int cols = 0;
+	int dots = 0;
+
+	const char *tmp = ptr;
+	for (; *tmp != ']'; tmp++) {
+		if (*tmp >= '0' && *tmp <= '9') {
+			digits++;
+		} else if (*tmp == ':') {
+			digits = 0;
+			cols++;
+		} else if (*tmp == '.') {
+			digits = 0;
+			dots++;
+		} else {
+			return 0;
 		}
-		while (*line == ' ')
-			line++;
-	} else {
-		/* should not happen! */
-		fprintf(stderr,
-			"Warning: called lrc_millisec with bad input"
-			" [%s], ignoring...\n",
-		line);
+
+		if (digits > 2 || cols > 3 || dots > 1)
+			return 0;
+	}
+
+	// "[]" is not a timestamp
+	if (tmp == ptr)
 		return 0;
+	*end = tmp;
+
+	// The groups of digits, from the right
+	static const int mults[] = { 1, 1000, 60000, 3600000 };
+	int group[5] = { 0, 0, 0, 0, 0 };
+	int igroup = -1;
+	int itmp = 0;
+	int has_milli = 0;
+	for (; tmp > ptr; tmp--) {
+		char car = tmp[-1];
+		if (car >= '0' && car <= '9') {
+			if (!itmp)
+				igroup++;
+			group[igroup] += (itmp ? 10 : 1) * (car - '0');
+			itmp++;
+		} else {
+			// ".8" is 800 ms, ".80" too
+			if (car == '.') {
+				has_milli = 1;
+				if (igroup >= 0)
+					for (int i = itmp; i < 3; i++)
+						group[igroup] *= 10;
+			}
+			itmp = 0;
+		}
 	}
 
-	// find end
-	int i = 0;
-	while (line[i] != ']')
-		i++;
+	*ms = 0;
+	int mult_offset = has_milli ? 0 : 1;
+	for (int i = 0; i <= igroup && i + mult_offset < 4; i++)
+		*ms += mults[i + mult_offset] * group[i];
+
+	return 1;
+}
+
+static int read_words(song_t *song, char *text) {
+	// "<00:12.00>Some <00:12.50>words <00:13.20>here"
+
+	char *out = text;
+	int words = 0;
+
+	for (char *ptr = text; *ptr; ptr++) {
+		if (*ptr == '<') {
+			char *end = strchr(ptr, '>');
+			char time[16];
+			size_t len = end ? (size_t) (end - ptr - 1) : 0;
+			if (len && len < sizeof(time)) {
+				memcpy(time, ptr + 1, len);
+				time[len] = '\0';
+				if (strchr(time, ':') && nsub_is_timing(time, '.', 3)) {
+					word_t *word = array_new(song->words);
+					word->offset = out - text;
+					word->start = nsub_to_ms(time, '.');
+					words++;
+					ptr = end;
+					continue;
+				}
+			}
+		}
+
+		*out++ = *ptr;
+	}
 
-	cstring_t*tmp = cstring_substring(line, 0, i);
-	int ms = nsub_to_ms(tmp->string, '.');
-	free_cstring(tmp);
-	return sign * ms;
+	*out = '\0';
+	return words;
 }
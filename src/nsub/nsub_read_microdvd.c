@@ -0,0 +1,116 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// read a "{123}" frame number, -1 if empty ("{}"), -2 if invalid
+static long long read_frame(char **line);
+// the frame rate really meant by a rounded one (23.976 is 24000/1001)
+static ratio_t exact_fps(ratio_t fps);
+
+/* Public */
+
+int nsub_read_microdvd(song_t *song, char *line) {
+	// {1025}{1100}Text|Second line
+
+	while (*line == ' ')
+		line++;
+	if (!*line)
+		return 1;
+
+	char *ptr = line;
+	long long start = read_frame(&ptr);
+	long long stop = read_frame(&ptr);
+	if (start < 0 || stop == -2) {
+		song_add_unknown(song, line);
+		return 1;
+	}
+
+	size_t len = strlen(ptr);
+	while (len && ptr[len - 1] == '\r')
+		ptr[--len] = '\0';
+
+	// {1}{1}23.976 is the frame rate, not a lyric
+	ratio_t fps;
+	if (!song->current_num && start == 1 && stop == 1
+			&& nsub_parse_ratio(ptr, &fps)) {
+		// An explicit frame rate wins over the header
+		if (!song->fps.num)
+			song->fps = exact_fps(fps);
+		return 1;
+	}
+
+	if (!song->fps.num) {
+		song->fps.num = 24000;
+		song->fps.den = 1001;
+	}
+
+	ratio_t to_ms = { song->fps.den * 1000, song->fps.num };
+	int start_ms = apply_ratio(start, to_ms);
+	int stop_ms = stop < 0 ? start_ms + 5000 : apply_ratio(stop, to_ms);
+
+	for (char *car = ptr; *car; car++) {
+		if (*car == '|')
+			*car = '\n';
+	}
+
+	song_add_lyric(song, start_ms, stop_ms, NULL, ptr);
+	return 1;
+}
+
+/* Private */
+
+static long long read_frame(char **line) {
+	char *ptr = *line;
+	if (*ptr != '{')
+		return -2;
+
+	long long frame = -1;
+	for (ptr++; *ptr >= '0' && *ptr <= '9'; ptr++) {
+		if (frame > 99999999)
+			return -2;
+		frame = (frame < 0 ? 0 : frame * 10) + (*ptr - '0');
+	}
+
+	if (*ptr != '}')
+		return -2;
+
+	*line = ptr + 1;
+	return frame;
+}
+
+static ratio_t exact_fps(ratio_t fps) {
+	// n = round(fps * 1.001)
+	long long n = (fps.num * 1001 + fps.den * 500) / (fps.den * 1000);
+
+	// |fps - n * 1000 / 1001| < 0.0005 (i.e., the same with 3 decimals)
+	long long diff = fps.num * 1001 - n * 1000 * fps.den;
+	if (diff < 0)
+		diff = -diff;
+	if (n && fps.den > 1 && diff * 2000 < fps.den * 1001)
+		return (ratio_t ) { n * 1000, 1001 };
+
+	return fps;
+}
@@ -40,19 +40,21 @@ int nsub_read_srt(song_t *song, char *line) {
 	if (empty)
 		return 1;
 
-	size_t count = array_count(song->lyrics);
 	lyric_t *lyric = array_last(song->lyrics);
 	if (is_srt_id(line)) {
-		int new_count = atoi(line);
-		if (new_count != count + 1) {
+		int id = atoi(line);
+		int prev_id = lyric ? lyric->id : song->current_num;
+		if (id != prev_id + 1) {
 			fprintf(stderr,
-				"Warning: line %zu is out of order "
+				"Warning: lyric %d is out of order "
 				"(it is numbered %i), ignoring order...\n",
-				count, new_count
+				song->current_num + 1, id
 			);
 		}
 
 		song_add_lyric(song, 0, 0, NULL, NULL);
+		lyric = array_last(song->lyrics);
+		lyric->id = id;
 	} else if (is_srt_timing(line)) {
 		// no headers in srt
 		if (!lyric) {
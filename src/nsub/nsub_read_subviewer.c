@@ -0,0 +1,130 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// read a "00:00:01.00" time and move after it, -1 if invalid
+static int read_time(char **line);
+
+/* Public */
+
+int nsub_read_subviewer(song_t *song, char *line) {
+	// [TITLE]xxx
+	// 00:00:01.00,00:00:03.00
+	// Text[br]Second line
+
+	size_t len = strlen(line);
+	while (len && (line[len - 1] == '\r' || line[len - 1] == ' '))
+		line[--len] = '\0';
+
+	while (*line == ' ')
+		line++;
+	if (!*line)
+		return 1;
+
+	char *ptr = line;
+	int start = read_time(&ptr);
+	int stop = -1;
+	if (start >= 0 && *ptr == ',') {
+		ptr++;
+		stop = read_time(&ptr);
+	}
+
+	if (stop >= 0 && !*ptr) {
+		song_add_lyric(song, start, stop, NULL, NULL);
+		return 1;
+	}
+
+	lyric_t *lyric = array_last(song->lyrics);
+
+	// The header: [INFORMATION], [TITLE]xxx... [SUBTITLE]
+	if (!lyric && line[0] == '[') {
+		char *end = strchr(line, ']');
+		if (end && end[1]) {
+			*end = '\0';
+			if (!strcmp("[TITLE", line))
+				song_add_meta(song, "ti", end + 1);
+			else if (!strcmp("[AUTHOR", line))
+				song_add_meta(song, "au", end + 1);
+			*end = ']';
+		}
+
+		return 1;
+	}
+
+	if (!lyric || lyric->type != NSUB_LYRIC) {
+		song_add_comment(song, line);
+		return 1;
+	}
+
+	cstring_t *text = cstring_clone(line);
+	cstring_replace(text, "[br]", "\n");
+
+	char *all = lyric->text;
+	if (all)
+		all = cstring_concat(all, "\n", text->string, NULL);
+	else
+		all = strdup(text->string);
+
+	free(lyric->text);
+	lyric->text = all;
+
+	free_cstring(text);
+	return 1;
+}
+
+/* Private */
+
+static int read_time(char **line) {
+	// 00:00:01.00 (or 0:00:01.000)
+	int parts[3] = { 0, 0, 0 };
+	int ipart = 0;
+	int digits = 0;
+
+	char *ptr = *line;
+	for (; (*ptr >= '0' && *ptr <= '9') || *ptr == ':'; ptr++) {
+		if (*ptr == ':') {
+			if (!digits || ++ipart > 2)
+				return -1;
+			digits = 0;
+		} else {
+			parts[ipart] = parts[ipart] * 10 + (*ptr - '0');
+			digits++;
+		}
+	}
+
+	if (ipart != 2 || !digits || *ptr != '.')
+		return -1;
+
+	int ms = ((parts[0] * 60 + parts[1]) * 60 + parts[2]) * 1000;
+	int mult = 100;
+	for (ptr++; *ptr >= '0' && *ptr <= '9'; ptr++) {
+		ms += mult * (*ptr - '0');
+		mult /= 10;
+	}
+
+	*line = ptr;
+	return ms;
+}
@@ -0,0 +1,480 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// longer tags are truncated (we only need the first attributes)
+#define TTML_MAX_TAG 4096
+
+// the states of the tokenizer
+#define TTML_TEXT 0
+#define TTML_TAG 1
+#define TTML_ENTITY 2
+#define TTML_COMMENT 3
+
+// the state of the reader (song->reader), of constant size: no DOM, only
+// the current tag (or entity) and where we are
+typedef struct {
+	int state;
+	// the quote we are in, in a tag
+	char quote;
+	char tag[TTML_MAX_TAG];
+	size_t tag_len;
+	char entity[12];
+	size_t entity_len;
+	// "-->" detection
+	int dashes;
+	// inside a <p>
+	int in_p;
+	// the lyric of the <p> waits for its first text (none for an empty <p>)
+	int pending;
+	int start;
+	int stop;
+	// a space is pending (XML white space handling)
+	int space;
+	// the timing parameters of the document (<tt>)
+	ratio_t fps;
+	long long tick_rate;
+} ttml_reader_t;
+
+// get (or create) the state of the reader
+static ttml_reader_t *get_reader(song_t *song);
+// process a complete tag (without the < and >)
+static void read_tag(song_t *song, ttml_reader_t *reader);
+// add some (decoded) text to the current <p>
+static void add_text(song_t *song, ttml_reader_t *reader, cstring_t *text,
+		char car);
+// flush the pending text to the current lyric
+static void flush_text(song_t *song, ttml_reader_t *reader, cstring_t *text);
+// the lyric of the current <p>, added with its first text
+static lyric_t *p_lyric(song_t *song, ttml_reader_t *reader);
+// decode an entity (without the & and ;) into text
+static void read_entity(song_t *song, ttml_reader_t *reader,
+		cstring_t *text);
+// get the value of an attribute (by its local name), FALSE if not found
+static int get_attr(const char *tag, const char *name, char *value,
+		size_t size);
+// count the ms in a TTML time expression, -1 if invalid
+static int ttml_millisec(ttml_reader_t *reader, const char *time);
+
+/* Public */
+
+int nsub_read_ttml(song_t *song, char *line) {
+	ttml_reader_t *reader = get_reader(song);
+	cstring_t *text = new_cstring();
+
+	for (char *ptr = line; *ptr; ptr++) {
+		char car = *ptr;
+
+		switch (reader->state) {
+		case TTML_TEXT:
+			if (car == '<') {
+				flush_text(song, reader, text);
+				reader->state = TTML_TAG;
+				reader->tag_len = 0;
+				reader->quote = '\0';
+			} else if (car == '&') {
+				reader->state = TTML_ENTITY;
+				reader->entity_len = 0;
+			} else if (reader->in_p) {
+				add_text(song, reader, text, car);
+			}
+			break;
+		case TTML_ENTITY:
+			if (car == ';') {
+				reader->entity[reader->entity_len] = '\0';
+				read_entity(song, reader, text);
+				reader->state = TTML_TEXT;
+			} else if (reader->entity_len < sizeof(reader->entity) - 1) {
+				reader->entity[reader->entity_len++] = car;
+			}
+			break;
+		case TTML_COMMENT:
+			if (car == '>' && reader->dashes >= 2)
+				reader->state = TTML_TEXT;
+			reader->dashes = (car == '-') ? reader->dashes + 1 : 0;
+			break;
+		case TTML_TAG:
+			if (reader->quote) {
+				if (car == reader->quote)
+					reader->quote = '\0';
+			} else if (car == '"' || car == '\'') {
+				reader->quote = car;
+			} else if (car == '>') {
+				reader->tag[reader->tag_len] = '\0';
+				reader->state = TTML_TEXT;
+				read_tag(song, reader);
+				break;
+			}
+
+			if (reader->tag_len < TTML_MAX_TAG - 1)
+				reader->tag[reader->tag_len++] = car;
+
+			if (reader->tag_len == 3 && !strncmp(reader->tag, "!--", 3)) {
+				reader->state = TTML_COMMENT;
+				reader->dashes = 0;
+			}
+			break;
+		}
+	}
+
+	// The end of line is a white space like any other
+	if (reader->state == TTML_TAG && reader->tag_len < TTML_MAX_TAG - 1)
+		reader->tag[reader->tag_len++] = ' ';
+	else if (reader->state == TTML_TEXT && reader->in_p)
+		add_text(song, reader, text, ' ');
+
+	flush_text(song, reader, text);
+	free_cstring(text);
+
+	return 1;
+}
+
+/* Private */
+
+static ttml_reader_t *get_reader(song_t *song) {
+	if (!song->reader) {
+		ttml_reader_t *reader = malloc(sizeof(ttml_reader_t));
+		reader->state = TTML_TEXT;
+		reader->quote = '\0';
+		reader->tag_len = 0;
+		reader->entity_len = 0;
+		reader->dashes = 0;
+		reader->in_p = 0;
+		reader->pending = 0;
+		reader->start = 0;
+		reader->stop = 0;
+		reader->space = 0;
+		reader->fps.num = 30;
+		reader->fps.den = 1;
+		reader->tick_rate = 1;
+		song->reader = reader;
+	}
+
+	return song->reader;
+}
+
+static void read_tag(song_t *song, ttml_reader_t *reader) {
+	char *tag = reader->tag;
+	char value[64];
+
+	// <?xml ...?>, <!DOCTYPE ...>
+	if (tag[0] == '?' || tag[0] == '!')
+		return;
+
+	int closing = (tag[0] == '/');
+	if (closing)
+		tag++;
+	int self_closing = (reader->tag_len && tag[strlen(tag) - 1] == '/');
+
+	// Local name: <tt:p> is <p>
+	size_t len = strcspn(tag, " \t/");
+	char *name = tag;
+	char *colon = memchr(tag, ':', len);
+	if (colon) {
+		len -= (colon + 1 - name);
+		name = colon + 1;
+	}
+
+	if (len == 2 && !strncmp(name, "tt", 2) && !closing) {
+		if (get_attr(tag, "lang", value, sizeof(value)) && value[0]) {
+			free(song->lang);
+			song->lang = strdup(value);
+		}
+
+		if (get_attr(tag, "frameRate", value, sizeof(value)))
+			nsub_parse_ratio(value, &reader->fps);
+		if (get_attr(tag, "frameRateMultiplier", value, sizeof(value))) {
+			// "1000 1001"
+			ratio_t mult;
+			char *space = strchr(value, ' ');
+			if (space) {
+				*space = '/';
+				ratio_t fps = { 0, 0 };
+				if (nsub_parse_ratio(value, &mult))
+					fps = nsub_fps_ratio((ratio_t ) { mult.den, mult.num },
+							reader->fps);
+				if (fps.den)
+					reader->fps = fps;
+			}
+		}
+		if (get_attr(tag, "tickRate", value, sizeof(value)))
+			reader->tick_rate = atoll(value) > 0 ? atoll(value) : 1;
+	} else if (len == 1 && name[0] == 'p') {
+		if (closing) {
+			reader->in_p = 0;
+			reader->pending = 0;
+			return;
+		}
+
+		// Only the timings of the <p> itself are supported (not the ones
+		// inherited from a <div> or a <body>)
+		int start = 0;
+		int stop = 0;
+		if (get_attr(tag, "begin", value, sizeof(value)))
+			start = ttml_millisec(reader, value);
+		if (get_attr(tag, "end", value, sizeof(value))) {
+			stop = ttml_millisec(reader, value);
+		} else if (get_attr(tag, "dur", value, sizeof(value))) {
+			stop = ttml_millisec(reader, value);
+			if (stop >= 0)
+				stop += start;
+		}
+
+		if (start < 0 || stop < 0) {
+			fprintf(stderr, "Warning: bad TTML timing <%s>, ignoring...\n",
+					reader->tag);
+			start = start < 0 ? 0 : start;
+			stop = stop < 0 ? start : stop;
+		}
+
+		// No text, no lyric (an empty <p>, or a self-closing one)
+		reader->start = start;
+		reader->stop = stop;
+		reader->in_p = !self_closing;
+		reader->pending = !self_closing;
+		reader->space = 0;
+	} else if (len == 2 && !strncmp(name, "br", 2) && reader->in_p) {
+		lyric_t *lyric = p_lyric(song, reader);
+		char *text = lyric->text;
+		if (text)
+			text = cstring_concat(text, "\n", NULL);
+		else
+			text = strdup("\n");
+
+		free(lyric->text);
+		lyric->text = text;
+		reader->space = 0;
+	}
+}
+
+static void add_text(song_t *song, ttml_reader_t *reader, cstring_t *text,
+		char car) {
+	if (car == ' ' || car == '\t' || car == '\r' || car == '\n') {
+		reader->space = 1;
+		return;
+	}
+
+	// One space between words, but none at the start of a line
+	if (reader->space) {
+		lyric_t *lyric = reader->pending ? NULL : array_last(song->lyrics);
+		char *prev = lyric ? lyric->text : NULL;
+		char last = text->length ? text->string[text->length - 1]
+				: (prev && *prev ? prev[strlen(prev) - 1] : '\n');
+		if (last != '\n')
+			cstring_add_car(text, ' ');
+		reader->space = 0;
+	}
+
+	cstring_add_car(text, car);
+}
+
+static void flush_text(song_t *song, ttml_reader_t *reader, cstring_t *text) {
+	if (!text->length)
+		return;
+
+	lyric_t *lyric = p_lyric(song, reader);
+	char *all = lyric->text;
+	if (all)
+		all = cstring_concat(all, text->string, NULL);
+	else
+		all = strdup(text->string);
+
+	free(lyric->text);
+	lyric->text = all;
+
+	cstring_clear(text);
+}
+
+static lyric_t *p_lyric(song_t *song, ttml_reader_t *reader) {
+	if (reader->pending) {
+		song_add_lyric(song, reader->start, reader->stop, NULL, NULL);
+		reader->pending = 0;
+	}
+
+	return array_last(song->lyrics);
+}
+
+static void read_entity(song_t *song, ttml_reader_t *reader,
+		cstring_t *text) {
+	if (!reader->in_p)
+		return;
+
+	char *entity = reader->entity;
+	long code = -1;
+	if (entity[0] == '#' && (entity[1] == 'x' || entity[1] == 'X'))
+		code = strtol(entity + 2, NULL, 16);
+	else if (entity[0] == '#')
+		code = strtol(entity + 1, NULL, 10);
+	else if (!strcmp(entity, "amp"))
+		code = '&';
+	else if (!strcmp(entity, "lt"))
+		code = '<';
+	else if (!strcmp(entity, "gt"))
+		code = '>';
+	else if (!strcmp(entity, "quot"))
+		code = '"';
+	else if (!strcmp(entity, "apos"))
+		code = '\'';
+
+	if (code <= 0 || code > 0x10FFFF)
+		return;
+
+	// Encode the code point in UTF-8
+	if (code < 0x80) {
+		add_text(song, reader, text, (char) code);
+	} else {
+		char utf8[4];
+		int n;
+		if (code < 0x800) {
+			utf8[0] = 0xC0 | (code >> 6);
+			n = 2;
+		} else if (code < 0x10000) {
+			utf8[0] = 0xE0 | (code >> 12);
+			n = 3;
+		} else {
+			utf8[0] = 0xF0 | (code >> 18);
+			n = 4;
+		}
+		for (int i = 1; i < n; i++)
+			utf8[i] = 0x80 | ((code >> (6 * (n - 1 - i))) & 0x3F);
+
+		for (int i = 0; i < n; i++)
+			add_text(song, reader, text, utf8[i]);
+	}
+}
+
+static int get_attr(const char *tag, const char *name, char *value,
+		size_t size) {
+	size_t len = strlen(name);
+
+	for (const char *ptr = strchr(tag, ' '); ptr && *ptr; ptr++) {
+		// Skip the attribute values
+		if (*ptr == '"' || *ptr == '\'') {
+			ptr = strchr(ptr + 1, *ptr);
+			if (!ptr)
+				return 0;
+			continue;
+		}
+
+		// An attribute name starts after a space, and may have a prefix
+		if (ptr[-1] != ' ' && ptr[-1] != '\t' && ptr[-1] != ':')
+			continue;
+		if (strncmp(ptr, name, len) || (ptr[len] != '=' && ptr[len] != ' '))
+			continue;
+
+		const char *val = ptr + len;
+		while (*val == ' ')
+			val++;
+		if (*val++ != '=')
+			continue;
+		while (*val == ' ')
+			val++;
+
+		char quote = *val++;
+		if (quote != '"' && quote != '\'')
+			return 0;
+
+		size_t i = 0;
+		while (*val && *val != quote && i < size - 1)
+			value[i++] = *val++;
+		value[i] = '\0';
+		return 1;
+	}
+
+	return 0;
+}
+
+static int ttml_millisec(ttml_reader_t *reader, const char *time) {
+	long long parts[4] = { 0, 0, 0, 0 };
+	int ipart = 0;
+	long long frac = 0;
+	long long frac_div = 1;
+
+	while (*time == ' ')
+		time++;
+
+	const char *ptr = time;
+	for (; *ptr; ptr++) {
+		if (*ptr >= '0' && *ptr <= '9') {
+			if (frac_div > 1 || (ptr > time && ptr[-1] == '.')) {
+				if (frac_div < 1000000) {
+					frac = frac * 10 + (*ptr - '0');
+					frac_div *= 10;
+				}
+			} else {
+				parts[ipart] = parts[ipart] * 10 + (*ptr - '0');
+			}
+		} else if (*ptr == ':' && ipart < 3 && frac_div == 1) {
+			ipart++;
+		} else if (*ptr != '.') {
+			break;
+		}
+	}
+
+	// Clock time: hh:mm:ss(.fraction) or hh:mm:ss:frames
+	if (ipart == 2 || ipart == 3) {
+		if (*ptr)
+			return -1;
+
+		long long ms = ((parts[0] * 60 + parts[1]) * 60 + parts[2]) * 1000;
+		if (ipart == 3) {
+			ratio_t to_ms = { reader->fps.den * 1000, reader->fps.num };
+			ms += apply_ratio(parts[3], to_ms);
+		} else {
+			ms += (frac * 1000 + frac_div / 2) / frac_div;
+		}
+
+		return ms;
+	}
+
+	// Offset time: number(.fraction) and a metric
+	if (ipart)
+		return -1;
+
+	long long mult = 0;
+	long long div = 1;
+	if (!strcmp(ptr, "h")) {
+		mult = 3600000;
+	} else if (!strcmp(ptr, "m")) {
+		mult = 60000;
+	} else if (!strcmp(ptr, "s")) {
+		mult = 1000;
+	} else if (!strcmp(ptr, "ms")) {
+		mult = 1;
+	} else if (!strcmp(ptr, "f")) {
+		mult = reader->fps.den * 1000;
+		div = reader->fps.num;
+	} else if (!strcmp(ptr, "t")) {
+		mult = 1000;
+		div = reader->tick_rate;
+	} else {
+		return -1;
+	}
+
+	long long num = parts[0] * frac_div + frac;
+	div *= frac_div;
+	return (num * mult + div / 2) / div;
+}
@@ -40,14 +40,14 @@ int nsub_read_webvtt(song_t *song, char *line) {
 	if (empty)
 		return 1;
 
-	size_t count = array_count(song->lyrics);
 	lyric_t *lyric = array_last(song->lyrics);
 	if (is_srt_id(line)) {
+		// current_num: a window read does not start at the first lyric
 		int new_count = atoi(line);
-		if (new_count != count + 1) {
+		if (new_count != song->current_num + 1) {
 			fprintf(stderr,
-					"Warning: line %zu is out of order (it is numbered %i), ignoring order...\n",
-					count, new_count);
+					"Warning: line %d is out of order (it is numbered %i), ignoring order...\n",
+					song->current_num, new_count);
 		}
 	} else if (is_srt_timing(line)) {
 		song_add_lyric(song, 0, 0, NULL, NULL);
@@ -0,0 +1,241 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// fileno(), mmap()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the size of the chunks read from a stream
+#define READER_CHUNK (64 * 1024)
+
+struct reader_t {
+	song_t *song;
+	// the line formats: the chunks are cut in lines
+	int (*read_a_line)(song_t *song, char *line);
+	int (*read_lines_end)(song_t *song);
+	cstring_t *line;
+	size_t iline;
+	// the chunk formats: the chunks are given as they are
+	int (*read_chunk)(song_t *song, const char *data, size_t size);
+	int (*read_chunk_end)(song_t *song, int ok);
+	int ok;
+	int ended;
+	// the lyrics may come in any order: sort them at the end
+	int sort;
+};
+
+// give the current line to the line reader
+static int read_line(reader_t *reader);
+
+/* Public */
+
+reader_t *new_reader(song_t *song, NSUB_FORMAT fmt) {
+	reader_t *reader = malloc(sizeof(reader_t));
+	reader->song = song;
+	reader->read_a_line = NULL;
+	reader->read_lines_end = NULL;
+	reader->line = NULL;
+	reader->iline = 0;
+	reader->read_chunk = NULL;
+	reader->read_chunk_end = NULL;
+	reader->ok = 1;
+	reader->ended = 0;
+	reader->sort = 0;
+
+	switch (fmt) {
+	case NSUB_FMT_LRC:
+		reader->read_a_line = nsub_read_lrc;
+		reader->read_lines_end = nsub_read_lrc_end;
+		break;
+	case NSUB_FMT_SRT:
+		reader->read_a_line = nsub_read_srt;
+		break;
+	case NSUB_FMT_WEBVTT:
+		reader->read_a_line = nsub_read_webvtt;
+		break;
+	case NSUB_FMT_ASS:
+		// The events need not be in time order
+		reader->read_a_line = nsub_read_ass;
+		reader->sort = 1;
+		break;
+	case NSUB_FMT_TTML:
+		reader->read_a_line = nsub_read_ttml;
+		break;
+	case NSUB_FMT_MICRODVD:
+		reader->read_a_line = nsub_read_microdvd;
+		break;
+	case NSUB_FMT_SUBVIEWER:
+		reader->read_a_line = nsub_read_subviewer;
+		break;
+	case NSUB_FMT_JSONL:
+		reader->read_a_line = nsub_read_jsonl;
+		break;
+	case NSUB_FMT_EBUSTL:
+		reader->read_chunk = nsub_read_ebustl;
+		reader->read_chunk_end = nsub_read_ebustl_end;
+		break;
+	default:
+		fprintf(stderr, "Unsupported read format %d\n", fmt);
+		free(reader);
+		return NULL;
+	}
+
+	if (reader->read_a_line)
+		reader->line = new_cstring();
+
+	return reader;
+}
+
+int reader_feed(reader_t *reader, const char *data, size_t size) {
+	if (!reader->ok || reader->ended)
+		return 0;
+
+	if (reader->read_chunk) {
+		reader->ok = reader->read_chunk(reader->song, data, size);
+		return reader->ok;
+	}
+
+	// A line can span several chunks
+	while (size) {
+		const char *eol = memchr(data, '\n', size);
+		size_t len = eol ? (size_t) (eol - data) : size;
+		cstring_addn(reader->line, data, len);
+		if (!eol)
+			break;
+
+		if (!read_line(reader))
+			return 0;
+
+		data += len + 1;
+		size -= len + 1;
+	}
+
+	return 1;
+}
+
+int reader_pending(reader_t *reader) {
+	return reader->line && reader->line->length;
+}
+
+void reader_keep_order(reader_t *reader) {
+	reader->sort = 0;
+}
+
+int reader_read(reader_t *reader, FILE *in) {
+	// A real file is mapped (no copy), anything else is read by chunks
+	struct stat st;
+	int fd = fileno(in);
+	long pos = (fd >= 0) ? ftell(in) : -1;
+	if (fd >= 0 && pos >= 0 && !fstat(fd, &st) && S_ISREG(st.st_mode)
+			&& st.st_size > pos) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			int ok = reader_feed(reader, (char *) map + pos, st.st_size - pos);
+			munmap(map, st.st_size);
+			return ok;
+		}
+	}
+
+	char *data = malloc(READER_CHUNK);
+	size_t size;
+	while (data && reader->ok && (size = fread(data, 1, READER_CHUNK, in)))
+		reader_feed(reader, data, size);
+
+	if (!data || ferror(in)) {
+		fprintf(stderr, "Cannot read the input\n");
+		reader->ok = 0;
+	}
+
+	free(data);
+	return reader->ok;
+}
+
+int reader_end(reader_t *reader) {
+	if (reader->ended)
+		return 0;
+	reader->ended = 1;
+
+	if (reader->read_chunk)
+		return reader->ok = reader->read_chunk_end(reader->song, reader->ok);
+
+	// The last line may not end with a new line
+	if (reader->ok && reader->line->length)
+		read_line(reader);
+
+	if (reader->ok && reader->read_lines_end)
+		reader->ok = reader->read_lines_end(reader->song);
+
+	if (reader->ok && reader->sort && !song_sorted(reader->song))
+		song_sort(reader->song);
+
+	return reader->ok;
+}
+
+void free_reader(reader_t *reader) {
+	if (!reader)
+		return;
+
+	// The chunk readers release their state at the end
+	if (!reader->ended && reader->read_chunk)
+		reader->read_chunk_end(reader->song, 0);
+
+	// The reader state is only needed while reading
+	free(reader->song->reader);
+	reader->song->reader = NULL;
+
+	if (reader->line)
+		free_cstring(reader->line);
+	free(reader);
+}
+
+/* Private */
+
+static int read_line(reader_t *reader) {
+	cstring_t *line = reader->line;
+
+	// Like cstring_readline(): no end of line
+	if (line->length && line->string[line->length - 1] == '\r')
+		line->string[--line->length] = '\0';
+
+	// UTF-8 BOM detection if any
+	char *text = line->string;
+	if (!reader->iline && cstring_starts_with(text, "\xEF\xBB\xBF", 0))
+		text += 3;
+
+	reader->iline++;
+
+	if (!reader->read_a_line(reader->song, text)) {
+		fprintf(stderr, "Read error on line %zu: <%s>\n", reader->iline, text);
+		reader->ok = 0;
+	}
+
+	cstring_clear(line);
+	return reader->ok;
+}
@@ -0,0 +1,375 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the size of the blocks read from the input (it grows for longer lines)
+#define REWRITE_CHUNK (1024 * 1024)
+// the size of the output kept before writing it
+#define REWRITE_FLUSH (64 * 1024)
+
+// the state of a rewrite
+typedef struct {
+	NSUB_FORMAT from;
+	NSUB_FORMAT to;
+	FILE *out;
+	pipeline_t *pipeline;
+	// an empty song, for the offset used by the pipeline
+	song_t *song;
+	// the number of lines read
+	size_t iline;
+	// the number of cues (the number of the current one)
+	int count;
+	// the current cue, if any (its text is only known at its end)
+	int cue;
+	int id;
+	int start;
+	int stop;
+	int has_text;
+	cstring_t *text;
+	// the output not yet written
+	cstring_t *buf;
+	int header;
+} rewrite_t;
+
+// the same as the readers: handle one line, FALSE in case of error
+static int rewrite_line(rewrite_t *rw, char *line, size_t len);
+// write the current cue (like the writers) if any
+static void end_cue(rewrite_t *rw);
+// write the header of the output if not done yet
+static void add_header(rewrite_t *rw);
+// write the output kept so far
+static void flush(rewrite_t *rw);
+// a line of digits and spaces
+static int is_id(const char *line);
+// the timings of an SRT/WebVTT timing line, FALSE if it is not one
+static int parse_timing(const char *line, char deci, int *start, int *stop);
+// one time of a timing line, FALSE if it is not one
+static int parse_time(const char *ptr, size_t len, char deci, int *time);
+// add a time the way the writers do
+static void add_time(cstring_t *buf, int time, NSUB_FORMAT fmt);
+// write a number with at least the given number of digits, return the end
+static char *put_int(char *ptr, int value, int digits);
+
+/* Public */
+
+int nsub_can_rewrite(NSUB_FORMAT from, NSUB_FORMAT to, pipeline_t *pipeline) {
+	int from_ok = (from == NSUB_FMT_SRT || from == NSUB_FMT_WEBVTT);
+	int to_ok = (to == NSUB_FMT_SRT || to == NSUB_FMT_WEBVTT);
+	return from_ok && to_ok && nsub_pipeline_timings_only(pipeline);
+}
+
+int nsub_rewrite(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline) {
+	if (!nsub_can_rewrite(from, to, pipeline)) {
+		fprintf(stderr, "This conversion cannot be rewritten\n");
+		return 0;
+	}
+
+	rewrite_t rw;
+	memset(&rw, 0, sizeof(rewrite_t));
+	rw.from = from;
+	rw.to = to;
+	rw.out = out;
+	rw.pipeline = pipeline;
+	rw.song = new_song();
+	rw.text = new_cstring();
+	rw.buf = new_cstring();
+
+	// Whole lines only: the rest waits for the next block
+	size_t max = REWRITE_CHUNK;
+	char *data = malloc(max + 1);
+	size_t len = 0;
+	int ok = 1;
+	while (ok && data) {
+		size_t read = fread(data + len, 1, max - len, in);
+		if (!read)
+			break;
+		len += read;
+
+		size_t done = 0;
+		char *eol;
+		while (ok && (eol = memchr(data + done, '\n', len - done))) {
+			*eol = '\0';
+			ok = rewrite_line(&rw, data + done, eol - (data + done));
+			done = eol + 1 - data;
+		}
+
+		len -= done;
+		memmove(data, data + done, len);
+		if (len == max) {
+			max *= 2;
+			char *tmp = realloc(data, max + 1);
+			if (!tmp)
+				free(data);
+			data = tmp;
+		}
+	}
+
+	if (!data) {
+		fprintf(stderr, "Cannot read the input\n");
+		ok = 0;
+	} else if (ferror(in)) {
+		fprintf(stderr, "Cannot read the input\n");
+		ok = 0;
+	}
+
+	// The last line may not end with a new line
+	if (ok && len) {
+		data[len] = '\0';
+		ok = rewrite_line(&rw, data, len);
+	}
+
+	if (ok) {
+		end_cue(&rw);
+		add_header(&rw);
+		flush(&rw);
+	}
+
+	free(data);
+	free_cstring(rw.buf);
+	free_cstring(rw.text);
+	free_song(rw.song);
+	return ok;
+}
+
+/* Private */
+
+static int rewrite_line(rewrite_t *rw, char *line, size_t len) {
+	// Like cstring_readline(): no end of line
+	if (len && line[len - 1] == '\r')
+		line[--len] = '\0';
+
+	// UTF-8 BOM detection if any
+	if (!rw->iline++ && len >= 3 && !memcmp(line, "\xEF\xBB\xBF", 3)) {
+		line += 3;
+		len -= 3;
+	}
+
+	size_t blank = 0;
+	while (blank < len && line[blank] == ' ')
+		blank++;
+	if (blank == len)
+		return 1;
+
+	char deci = (rw->from == NSUB_FMT_SRT) ? ',' : '.';
+	int start = 0;
+	int stop = 0;
+	if (is_id(line)) {
+		int id = atoi(line);
+		if (rw->from == NSUB_FMT_SRT) {
+			int prev_id = rw->cue ? rw->id : rw->count;
+			if (id != prev_id + 1) {
+				fprintf(stderr,
+					"Warning: lyric %d is out of order "
+					"(it is numbered %i), ignoring order...\n",
+					rw->count + 1, id
+				);
+			}
+
+			// In SRT, the number starts the cue
+			end_cue(rw);
+			rw->cue = 1;
+			rw->id = id;
+			rw->start = 0;
+			rw->stop = 0;
+			rw->count++;
+		} else if (id != rw->count + 1) {
+			fprintf(stderr,
+					"Warning: line %d is out of order (it is numbered %i), ignoring order...\n",
+					rw->count, id);
+		}
+	} else if (parse_timing(line, deci, &start, &stop)) {
+		if (rw->from == NSUB_FMT_WEBVTT) {
+			// In WebVTT, the timings start the cue
+			end_cue(rw);
+			rw->cue = 1;
+			rw->count++;
+		} else if (!rw->cue) {
+			// no headers in srt
+			fprintf(stderr, "Read error on line %zu: <%s>\n", rw->iline,
+					line);
+			return 0;
+		}
+
+		rw->start = start;
+		rw->stop = stop;
+	} else if (rw->cue) {
+		if (rw->has_text)
+			cstring_add_car(rw->text, '\n');
+		cstring_addn(rw->text, line, len);
+		rw->has_text = 1;
+	} else if (rw->from == NSUB_FMT_SRT) {
+		fprintf(stderr, "Read error on line %zu: <%s>\n", rw->iline, line);
+		return 0;
+	}
+	// else: the WebVTT header
+
+	return 1;
+}
+
+static void end_cue(rewrite_t *rw) {
+	if (!rw->cue)
+		return;
+
+	add_header(rw);
+
+	int start = rw->start;
+	int stop = rw->stop;
+	nsub_transform_timings(rw->song, rw->pipeline, &start, &stop);
+
+	// num, timings, text, empty line
+	char num[16];
+	char *end = put_int(num, rw->count, 1);
+	*end++ = '\n';
+	cstring_addn(rw->buf, num, end - num);
+	add_time(rw->buf, start, rw->to);
+	cstring_addn(rw->buf, " --> ", 5);
+	add_time(rw->buf, stop, rw->to);
+	cstring_add_car(rw->buf, '\n');
+	cstring_addn(rw->buf, rw->text->string, rw->text->length);
+	cstring_addn(rw->buf, "\n\n", 2);
+
+	rw->cue = 0;
+	rw->has_text = 0;
+	cstring_clear(rw->text);
+
+	if (rw->buf->length >= REWRITE_FLUSH)
+		flush(rw);
+}
+
+static void add_header(rewrite_t *rw) {
+	if (rw->header)
+		return;
+
+	// No language in SRT nor WebVTT input, nothing else to keep
+	if (rw->to == NSUB_FMT_WEBVTT)
+		cstring_add(rw->buf, "WEBVTT\nKind: captions\n\n");
+
+	rw->header = 1;
+}
+
+static void flush(rewrite_t *rw) {
+	fwrite(rw->buf->string, 1, rw->buf->length, rw->out);
+	cstring_clear(rw->buf);
+}
+
+static int is_id(const char *line) {
+	for (const char *ptr = line; *ptr; ptr++) {
+		if ((*ptr < '0' || *ptr > '9') && *ptr != ' ')
+			return 0;
+	}
+
+	return 1;
+}
+
+static int parse_timing(const char *line, char deci, int *start, int *stop) {
+	// 00:00:14,800 --> 00:00:17,400 align: center
+	// (exactly what the SRT and WebVTT readers accept)
+
+	while (*line == ' ')
+		line++;
+
+	size_t i = 0;
+	while (line[i] && line[i] != ' ' && line[i] != '-')
+		i++;
+	if (!i || !line[i] || !parse_time(line, i, deci, start))
+		return 0;
+
+	line += i;
+	while (*line == ' ')
+		line++;
+	if (strncmp(line, "-->", 3))
+		return 0;
+	line += 3;
+	while (*line == ' ')
+		line++;
+
+	i = 0;
+	while (line[i] && line[i] != ' ')
+		i++;
+
+	return parse_time(line, i, deci, stop);
+}
+
+static int parse_time(const char *ptr, size_t len, char deci, int *time) {
+	// A valid time is short (see nsub_is_timing())
+	char tmp[32];
+	if (len >= sizeof(tmp))
+		return 0;
+
+	memcpy(tmp, ptr, len);
+	tmp[len] = '\0';
+	if (!nsub_is_timing(tmp, deci, 3))
+		return 0;
+
+	*time = nsub_to_ms(tmp, deci);
+	return 1;
+}
+
+static void add_time(cstring_t *buf, int time, NSUB_FORMAT fmt) {
+	// SRT: 00:00:14,800, WebVTT: 00:14.800 (or 1:00:14.800)
+	char tmp[32];
+	char *ptr = tmp;
+
+	if (time < 0) {
+		*ptr++ = '-';
+		time = -time;
+	}
+
+	int h = (time / 1000) / 3600;
+	int m = ((time / 1000) / 60) % 60;
+	int s = ((time / 1000)) % 60;
+	int c = (time) % 1000;
+
+	if (fmt == NSUB_FMT_SRT || h) {
+		ptr = put_int(ptr, h, fmt == NSUB_FMT_SRT ? 2 : 1);
+		*ptr++ = ':';
+	}
+	ptr = put_int(ptr, m, 2);
+	*ptr++ = ':';
+	ptr = put_int(ptr, s, 2);
+	*ptr++ = (fmt == NSUB_FMT_SRT) ? ',' : '.';
+	ptr = put_int(ptr, c, 3);
+
+	cstring_addn(buf, tmp, ptr - tmp);
+}
+
+static char *put_int(char *ptr, int value, int digits) {
+	char rev[12];
+	int n = 0;
+	do {
+		rev[n++] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+
+	while (n < digits--)
+		*ptr++ = '0';
+	while (n)
+		*ptr++ = rev[--n];
+
+	return ptr;
+}
@@ -0,0 +1,423 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the shared state of a parallel run: one set of statistics per thread, so
+// the workers never wait for each other
+typedef struct {
+	NSUB_FORMAT from;
+	ratio_t fps;
+	stats_t **stats;
+} stats_run_t;
+
+static void init_histogram(histogram_t *histo, int min, int width);
+static void histogram_add(histogram_t *histo, int value);
+static void histogram_merge(histogram_t *histo, histogram_t *other);
+// the value (to the bucket) under which the given part of the values are
+static int histogram_percentile(histogram_t *histo, int permille);
+static void write_histogram(histogram_t *histo, const char *name,
+		const char *unit, int json, FILE *out);
+// the statistics of this language (created if needed)
+static lang_t *get_lang(stats_t *stats, const char *lang);
+// more files first
+static int cmp_lang(const void *a, const void *b);
+static void put_json_string(FILE *out, const char *str);
+// read one file into the statistics of its thread (pool worker)
+static void stats_file(void *data, void *item, int ithread);
+
+/* Public */
+
+stats_t *new_stats() {
+	stats_t *stats = malloc(sizeof(stats_t));
+	if (!stats)
+		return NULL;
+
+	stats->files = 0;
+	stats->unreadable = 0;
+	stats->lyrics = 0;
+	init_histogram(&stats->duration, 0, 100);
+	init_histogram(&stats->cps, 0, 1);
+	init_histogram(&stats->gap, 0, 100);
+	init_histogram(&stats->lines, 0, 1);
+	stats->langs = new_array(sizeof(lang_t), 8);
+
+	return stats;
+}
+
+void free_stats(stats_t *stats) {
+	if (!stats)
+		return;
+
+	array_loop(stats->langs, lang, lang_t)
+	{
+		free(lang->lang);
+	}
+	free_array(stats->langs);
+	free(stats);
+}
+
+void nsub_stats(stats_t *stats, song_t *song) {
+	size_t lyrics = 0;
+	lyric_t *prev = NULL;
+
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		if (lyric->type != NSUB_LYRIC)
+			continue;
+
+		int duration = lyric->stop - lyric->start;
+		histogram_add(&stats->duration, duration);
+
+		// Count the characters (not the bytes) and the lines
+		long long chars = 0;
+		int lines = (lyric->text && *lyric->text) ? 1 : 0;
+		for (char *ptr = lyric->text; ptr && *ptr; ptr++) {
+			if (*ptr == '\n')
+				lines++;
+			else if ((*ptr & 0xC0) != 0x80)
+				chars++;
+		}
+
+		histogram_add(&stats->lines, lines);
+		if (duration > 0) {
+			long long cps = chars * 1000 / duration;
+			histogram_add(&stats->cps, cps > INT_MAX ? INT_MAX : cps);
+		}
+		if (prev)
+			histogram_add(&stats->gap, lyric->start - prev->stop);
+
+		prev = lyric;
+		lyrics++;
+	}
+
+	lang_t *lang = get_lang(stats, song->lang);
+	lang->files++;
+	lang->lyrics += lyrics;
+
+	stats->files++;
+	stats->lyrics += lyrics;
+}
+
+void stats_merge(stats_t *stats, stats_t *other) {
+	stats->files += other->files;
+	stats->unreadable += other->unreadable;
+	stats->lyrics += other->lyrics;
+	histogram_merge(&stats->duration, &other->duration);
+	histogram_merge(&stats->cps, &other->cps);
+	histogram_merge(&stats->gap, &other->gap);
+	histogram_merge(&stats->lines, &other->lines);
+
+	array_loop(other->langs, lang, lang_t)
+	{
+		lang_t *mine = get_lang(stats, lang->lang);
+		mine->files += lang->files;
+		mine->lyrics += lang->lyrics;
+	}
+}
+
+void stats_write(stats_t *stats, int json, FILE *out) {
+	size_t nlangs = array_count(stats->langs);
+	if (nlangs)
+		qsort(array_get(stats->langs, 0), nlangs, sizeof(lang_t), cmp_lang);
+
+	if (json) {
+		fprintf(out, "{\"files\":%zu,\"unreadable\":%zu,\"lyrics\":%zu,"
+				"\"langs\":[",
+			stats->files, stats->unreadable, stats->lyrics
+		);
+		for (size_t i = 0; i < nlangs; i++) {
+			lang_t *lang = array_get(stats->langs, i);
+			fputs(i ? ",{\"lang\":" : "{\"lang\":", out);
+			put_json_string(out, lang->lang);
+			fprintf(out, ",\"files\":%zu,\"lyrics\":%zu}", lang->files,
+					lang->lyrics);
+		}
+		fputs("]", out);
+	} else {
+		fprintf(out, "files: %zu (%zu unreadable)\n", stats->files,
+				stats->unreadable);
+		fprintf(out, "lyrics: %zu\n", stats->lyrics);
+		fputs("languages:", out);
+		for (size_t i = 0; i < nlangs; i++) {
+			lang_t *lang = array_get(stats->langs, i);
+			fprintf(out, "%s %s %zu files (%zu lyrics)", i ? "," : "",
+					lang->lang ? lang->lang : "unknown", lang->files,
+					lang->lyrics);
+		}
+		fputs("\n", out);
+	}
+
+	write_histogram(&stats->duration, "duration", " (ms)", json, out);
+	write_histogram(&stats->cps, "cps", "", json, out);
+	write_histogram(&stats->gap, "gap", " (ms)", json, out);
+	write_histogram(&stats->lines, "lines", "", json, out);
+
+	if (json)
+		fputs("}\n", out);
+}
+
+int nsub_stats_files(NSUB_FORMAT from, ratio_t fps, char **files,
+		size_t count, int threads, int json, FILE *out) {
+	stats_run_t run;
+	run.from = from;
+	run.fps = fps;
+	run.stats = NULL;
+
+	pool_t *pool = new_pool(threads, stats_file, &run);
+	if (!pool)
+		return 22;
+
+	// No item yet, so no worker looks at them before they exist
+	int nthreads = pool_threads(pool);
+	run.stats = malloc(nthreads * sizeof(stats_t *));
+	for (int i = 0; i < nthreads; i++)
+		run.stats[i] = new_stats();
+
+	for (size_t i = 0; i < count; i++)
+		pool_add(pool, files[i]);
+	free_pool(pool);
+
+	// The reduction, once all the workers are done
+	stats_t *stats = run.stats[0];
+	for (int i = 1; i < nthreads; i++) {
+		stats_merge(stats, run.stats[i]);
+		free_stats(run.stats[i]);
+	}
+	free(run.stats);
+
+	stats_write(stats, json, out);
+	fflush(out);
+
+	int rep = stats->unreadable ? 22 : 0;
+	free_stats(stats);
+	return rep;
+}
+
+/* Private */
+
+static void init_histogram(histogram_t *histo, int min, int width) {
+	memset(histo, 0, sizeof(histogram_t));
+	histo->min = min;
+	histo->width = width;
+}
+
+static void histogram_add(histogram_t *histo, int value) {
+	if (value < histo->min) {
+		histo->below++;
+	} else {
+		long long bucket = ((long long) value - histo->min) / histo->width;
+		if (bucket < NSUB_BUCKETS)
+			histo->buckets[bucket]++;
+		else
+			histo->above++;
+	}
+
+	if (!histo->count || value < histo->lowest)
+		histo->lowest = value;
+	if (!histo->count || value > histo->highest)
+		histo->highest = value;
+	histo->count++;
+	histo->sum += value;
+}
+
+static void histogram_merge(histogram_t *histo, histogram_t *other) {
+	if (!other->count)
+		return;
+
+	histo->below += other->below;
+	for (int i = 0; i < NSUB_BUCKETS; i++)
+		histo->buckets[i] += other->buckets[i];
+	histo->above += other->above;
+
+	if (!histo->count || other->lowest < histo->lowest)
+		histo->lowest = other->lowest;
+	if (!histo->count || other->highest > histo->highest)
+		histo->highest = other->highest;
+	histo->count += other->count;
+	histo->sum += other->sum;
+}
+
+static int histogram_percentile(histogram_t *histo, int permille) {
+	// The rank of the value, from 1
+	size_t rank = (histo->count * permille + 999) / 1000;
+	if (!rank)
+		rank = 1;
+
+	size_t seen = histo->below;
+	if (rank <= seen)
+		return histo->lowest;
+
+	for (int i = 0; i < NSUB_BUCKETS; i++) {
+		seen += histo->buckets[i];
+		if (rank <= seen)
+			return histo->min + i * histo->width;
+	}
+
+	return histo->min + NSUB_BUCKETS * histo->width;
+}
+
+static void write_histogram(histogram_t *histo, const char *name,
+		const char *unit, int json, FILE *out) {
+	double mean = histo->count ? (double) histo->sum / histo->count : 0;
+	int p50 = histo->count ? histogram_percentile(histo, 500) : 0;
+	int p90 = histo->count ? histogram_percentile(histo, 900) : 0;
+	int p99 = histo->count ? histogram_percentile(histo, 990) : 0;
+	int lowest = histo->count ? histo->lowest : 0;
+	int highest = histo->count ? histo->highest : 0;
+	int end = histo->min + NSUB_BUCKETS * histo->width;
+
+	if (json) {
+		fprintf(out, ",\"%s\":{\"count\":%zu,\"mean\":%.1f,\"min\":%d,"
+				"\"p50\":%d,\"p90\":%d,\"p99\":%d,\"max\":%d,"
+				"\"from\":%d,\"width\":%d,\"below\":%zu,\"buckets\":[",
+			name, histo->count, mean, lowest, p50, p90, p99, highest,
+			histo->min, histo->width, histo->below
+		);
+		for (int i = 0; i < NSUB_BUCKETS; i++)
+			fprintf(out, i ? ",%zu" : "%zu", histo->buckets[i]);
+		fprintf(out, "],\"above\":%zu}", histo->above);
+		return;
+	}
+
+	fprintf(out, "%s%s: mean %.1f, min %d, p50 %d, p90 %d, p99 %d, max %d\n",
+			name, unit, mean, lowest, p50, p90, p99, highest);
+
+	// Only the buckets with some values, with their share
+	double total = histo->count ? histo->count : 1;
+	if (histo->below) {
+		fprintf(out, "\t<%d\t%zu\t%.1f%%\n", histo->min, histo->below,
+				histo->below * 100 / total);
+	}
+	for (int i = 0; i < NSUB_BUCKETS; i++) {
+		if (!histo->buckets[i])
+			continue;
+
+		int from = histo->min + i * histo->width;
+		if (histo->width > 1)
+			fprintf(out, "\t%d-%d", from, from + histo->width - 1);
+		else
+			fprintf(out, "\t%d", from);
+		fprintf(out, "\t%zu\t%.1f%%\n", histo->buckets[i],
+				histo->buckets[i] * 100 / total);
+	}
+	if (histo->above) {
+		fprintf(out, "\t>=%d\t%zu\t%.1f%%\n", end, histo->above,
+				histo->above * 100 / total);
+	}
+}
+
+static lang_t *get_lang(stats_t *stats, const char *lang) {
+	// A handful of languages: no need for more than a list
+	array_loop(stats->langs, known, lang_t)
+	{
+		if (known->lang == lang
+				|| (known->lang && lang && !strcmp(known->lang, lang)))
+			return known;
+	}
+
+	lang_t *known = array_new(stats->langs);
+	known->lang = lang ? strdup(lang) : NULL;
+	known->files = 0;
+	known->lyrics = 0;
+	return known;
+}
+
+static int cmp_lang(const void *a, const void *b) {
+	const lang_t *lang_a = a;
+	const lang_t *lang_b = b;
+	if (lang_a->files != lang_b->files)
+		return lang_a->files < lang_b->files ? 1 : -1;
+	if (!lang_a->lang || !lang_b->lang)
+		return !lang_a->lang - !lang_b->lang;
+	return strcmp(lang_a->lang, lang_b->lang);
+}
+
+static void put_json_string(FILE *out, const char *str) {
+	if (!str) {
+		fputs("null", out);
+		return;
+	}
+
+	fputc('"', out);
+	for (const char *ptr = str; *ptr; ptr++) {
+		if (*ptr == '"' || *ptr == '\\')
+			fprintf(out, "\\%c", *ptr);
+		else if ((unsigned char) *ptr < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *ptr);
+		else
+			fputc(*ptr, out);
+	}
+	fputc('"', out);
+}
+
+static void stats_file(void *data, void *item, int ithread) {
+	stats_run_t *run = data;
+	stats_t *stats = run->stats[ithread];
+	char *path = item;
+	song_t *song = NULL;
+
+	NSUB_FORMAT fmt = run->from;
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		char *ext = nsub_file_ext(path);
+		if (ext)
+			fmt = nsub_parse_fmt(ext, 0);
+	}
+
+	FILE *in = NULL;
+	if (fmt == NSUB_FMT_UNKNOWN) {
+		fprintf(stderr, "Cannot detect input format: %s\n", path);
+	} else {
+		in = fopen(path, "r");
+		if (!in)
+			fprintf(stderr, "Cannot open input file: %s\n", path);
+	}
+
+	if (in) {
+		FILE *raw = in;
+		in = nsub_decompress(raw);
+		if (in) {
+			song = new_song();
+			song->fps = run->fps;
+			if (!nsub_read_into(song, in, fmt)) {
+				free_song(song);
+				song = NULL;
+			}
+			fclose(in);
+		} else {
+			fclose(raw);
+		}
+	}
+
+	if (!song) {
+		stats->unreadable++;
+		return;
+	}
+
+	nsub_stats(stats, song);
+	free_song(song);
+}
@@ -0,0 +1,552 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// sem_init(), fileno()...
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the size of a chunk read from the input
+#define STREAM_CHUNK (64 * 1024)
+// the number of lyrics in a batch
+#define STREAM_BATCH 256
+// the number of items in each ring
+#define STREAM_RING 16
+
+// the lyrics to send: all but the last one (it can still get some text), all
+// of them (live), or all of them at the end of the input
+#define BATCH_DONE 0
+#define BATCH_ALL 1
+#define BATCH_END 2
+
+// A single-producer single-consumer ring: each side owns its index, and the
+// semaphores (atomics, no lock unless one side must sleep) count the items
+typedef struct {
+	void *slots[STREAM_RING];
+	size_t head;
+	size_t tail;
+	sem_t items;
+	sem_t spaces;
+} ring_t;
+
+// some bytes of the input (none: the live input has been idle)
+typedef struct {
+	size_t size;
+	char data[];
+} chunk_t;
+
+// some complete lyrics (lyric_t) with their words (word_t), and the header
+// of the song with the first batch (its metas, lang...)
+typedef struct {
+	array_t *lyrics;
+	array_t *words;
+	song_t *head;
+} cues_t;
+
+// the shared state of the threads
+typedef struct {
+	FILE *in;
+	NSUB_FORMAT fmt;
+	ratio_t fps;
+	// live: send each lyric as soon as it is complete
+	int live;
+	// live: the time (ms) after which the last lyric is sent anyway (0: never)
+	int idle;
+	// live: the newlines that end a lyric (0: only the idle time does)
+	int ends;
+	// live: the first lyric of the parser was already written (only its
+	// timings are kept, for the reader)
+	int written;
+	// I/O thread -> parser thread (chunk_t, NULL at the end)
+	ring_t chunks;
+	// parser thread -> writer (cues_t, NULL at the end)
+	ring_t batches;
+	int io_error;
+	int read_error;
+} stream_t;
+
+static void init_ring(ring_t *ring);
+static void uninit_ring(ring_t *ring);
+static void ring_push(ring_t *ring, void *item);
+static void *ring_pop(ring_t *ring);
+// the format only ever completes its last lyric
+static int streamable(NSUB_FORMAT fmt);
+// the newlines that end a lyric of the format (0 if they do not)
+static int live_ends(NSUB_FORMAT fmt);
+// the conversion itself, live or not
+static int run(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps, int live, int idle);
+// read the input by chunks
+static void *io_thread(void *arg);
+// read the input as soon as it comes, with an empty chunk when it is idle
+static void *live_thread(void *arg);
+// parse the chunks into batches of lyrics
+static void *parser_thread(void *arg);
+// the newlines at the end of the chunk (and of the previous ones if it only
+// has spaces)
+static int trailing_newlines(chunk_t *chunk, int newlines);
+// send the lyrics (see BATCH_DONE) as a batch, if any (or if at the end)
+static void push_batch(stream_t *stream, song_t *song, int *first, int which);
+// free a batch and the lyrics it still holds
+static void free_batch(cues_t *batch);
+
+/* Public */
+
+int nsub_can_stream(NSUB_FORMAT from, NSUB_FORMAT to, pipeline_t *pipeline) {
+	writer_t writer;
+	return streamable(from) && nsub_writer(to, &writer)
+			&& nsub_pipeline_streamable(pipeline);
+}
+
+int nsub_stream(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps) {
+	return run(in, from, out, to, pipeline, fps, 0, 0);
+}
+
+int nsub_live(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps, int idle) {
+	return run(in, from, out, to, pipeline, fps, 1, idle);
+}
+
+/* Private */
+
+static int run(FILE *in, NSUB_FORMAT from, FILE *out, NSUB_FORMAT to,
+		pipeline_t *pipeline, ratio_t fps, int live, int idle) {
+	writer_t writer;
+	if (!nsub_can_stream(from, to, pipeline) || !nsub_writer(to, &writer)) {
+		fprintf(stderr, "This conversion cannot be streamed\n");
+		return 0;
+	}
+
+	stream_t stream;
+	stream.in = in;
+	stream.fmt = from;
+	stream.fps = fps;
+	stream.live = live;
+	stream.idle = idle;
+	stream.ends = live_ends(from);
+	stream.written = 0;
+	stream.io_error = 0;
+	stream.read_error = 0;
+	init_ring(&stream.chunks);
+	init_ring(&stream.batches);
+
+	pthread_t io;
+	pthread_t parser;
+	if (pthread_create(&io, NULL, live ? live_thread : io_thread, &stream)) {
+		fprintf(stderr, "Cannot start the I/O thread\n");
+		uninit_ring(&stream.chunks);
+		uninit_ring(&stream.batches);
+		return 0;
+	}
+	if (pthread_create(&parser, NULL, parser_thread, &stream)) {
+		fprintf(stderr, "Cannot start the parser thread\n");
+		// Nobody will consume the chunks: do it here
+		while ((ring_pop(&stream.chunks)))
+			;
+		pthread_join(io, NULL);
+		uninit_ring(&stream.chunks);
+		uninit_ring(&stream.batches);
+		return 0;
+	}
+
+	// This thread transforms and writes the batches as they come
+	song_t *song = NULL;
+	void *state = NULL;
+	int num = 0;
+	cues_t *batch;
+	while ((batch = ring_pop(&stream.batches))) {
+		if (batch->head) {
+			song = batch->head;
+			batch->head = NULL;
+
+			// The batches still need the offset, but the output timings
+			// will include it (see nsub_transform)
+			int offset = song->offset;
+			if (nsub_pipeline_has(pipeline, NSUB_STAGE_APPLY_OFFSET))
+				song->offset = 0;
+			writer.write_header(out, song);
+			song->offset = offset;
+			if (writer.state_size) {
+				state = calloc(1, writer.state_size);
+				if (writer.init_state)
+					writer.init_state(song, 0, state);
+			}
+		}
+
+		if (song) {
+			array_t *lyrics = song->lyrics;
+			array_t *words = song->words;
+			song->lyrics = batch->lyrics;
+			song->words = batch->words;
+			batch->lyrics = lyrics;
+			batch->words = words;
+
+			nsub_transform_batch(song, pipeline, &num);
+			array_loop(song->lyrics, lyric, lyric_t)
+			{
+				writer.write_lyric(out, song, lyric, state);
+			}
+
+			lyrics = song->lyrics;
+			words = song->words;
+			song->lyrics = batch->lyrics;
+			song->words = batch->words;
+			batch->lyrics = lyrics;
+			batch->words = words;
+		}
+
+		// Live: nothing waits in the buffers
+		if (live)
+			fflush(out);
+
+		free_batch(batch);
+	}
+
+	pthread_join(parser, NULL);
+	pthread_join(io, NULL);
+	uninit_ring(&stream.chunks);
+	uninit_ring(&stream.batches);
+
+	free(state);
+	free_song(song);
+
+	if (stream.io_error)
+		fprintf(stderr, "Cannot read the input\n");
+
+	return !stream.io_error && !stream.read_error;
+}
+
+static void init_ring(ring_t *ring) {
+	ring->head = 0;
+	ring->tail = 0;
+	sem_init(&ring->items, 0, 0);
+	sem_init(&ring->spaces, 0, STREAM_RING);
+}
+
+static void uninit_ring(ring_t *ring) {
+	sem_destroy(&ring->items);
+	sem_destroy(&ring->spaces);
+}
+
+static void ring_push(ring_t *ring, void *item) {
+	while (sem_wait(&ring->spaces))
+		;
+	ring->slots[ring->tail++ % STREAM_RING] = item;
+	sem_post(&ring->items);
+}
+
+static void *ring_pop(ring_t *ring) {
+	while (sem_wait(&ring->items))
+		;
+	void *item = ring->slots[ring->head++ % STREAM_RING];
+	sem_post(&ring->spaces);
+	return item;
+}
+
+static int streamable(NSUB_FORMAT fmt) {
+	// Not LRC: its lyrics are only complete at the end (see read_end)
+	switch (fmt) {
+	case NSUB_FMT_SRT:
+	case NSUB_FMT_WEBVTT:
+	case NSUB_FMT_ASS:
+	case NSUB_FMT_TTML:
+	case NSUB_FMT_MICRODVD:
+	case NSUB_FMT_SUBVIEWER:
+	case NSUB_FMT_JSONL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int live_ends(NSUB_FORMAT fmt) {
+	switch (fmt) {
+	// One line per lyric
+	case NSUB_FMT_ASS:
+	case NSUB_FMT_MICRODVD:
+	case NSUB_FMT_JSONL:
+		return 1;
+	// Blocks separated by an empty line
+	case NSUB_FMT_SRT:
+	case NSUB_FMT_WEBVTT:
+	case NSUB_FMT_SUBVIEWER:
+		return 2;
+	// TTML: a <p> can have empty lines
+	default:
+		return 0;
+	}
+}
+
+static void *io_thread(void *arg) {
+	stream_t *stream = arg;
+
+	while (1) {
+		chunk_t *chunk = malloc(sizeof(chunk_t) + STREAM_CHUNK);
+		chunk->size = fread(chunk->data, 1, STREAM_CHUNK, stream->in);
+		if (!chunk->size) {
+			free(chunk);
+			break;
+		}
+
+		ring_push(&stream->chunks, chunk);
+	}
+
+	stream->io_error = ferror(stream->in);
+	ring_push(&stream->chunks, NULL);
+	return NULL;
+}
+
+static void *live_thread(void *arg) {
+	stream_t *stream = arg;
+	FILE *in = stream->in;
+
+	// A non-blocking descriptor lets fread() return what is there; without
+	// one (compressed input), the input is read by lines
+	int fd = fileno(in);
+	int flags = fd < 0 ? -1 : fcntl(fd, F_GETFL);
+	int nonblock = flags >= 0
+			&& ((flags & O_NONBLOCK)
+				|| !fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+
+	// Some input came since the input was last idle
+	int fresh = 0;
+	while (1) {
+		chunk_t *chunk = malloc(sizeof(chunk_t) + STREAM_CHUNK);
+		if (nonblock) {
+			clearerr(in);
+			chunk->size = fread(chunk->data, 1, STREAM_CHUNK, in);
+		} else {
+			chunk->size = fgets(chunk->data, STREAM_CHUNK, in) ?
+					strlen(chunk->data) : 0;
+		}
+
+		if (chunk->size) {
+			ring_push(&stream->chunks, chunk);
+			fresh = 1;
+			continue;
+		}
+
+		free(chunk);
+		if (!nonblock || !ferror(in)
+				|| (errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+
+		// Nothing to read for now: wait for it, at most the idle time when
+		// a lyric may be waiting
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int wait = fresh && stream->idle > 0 ? stream->idle : -1;
+		int ready = poll(&pfd, 1, wait);
+		if (ready < 0 && errno != EINTR) {
+			stream->io_error = 1;
+			break;
+		}
+
+		if (!ready) {
+			chunk = malloc(sizeof(chunk_t));
+			chunk->size = 0;
+			ring_push(&stream->chunks, chunk);
+			fresh = 0;
+		}
+	}
+
+	if (nonblock && !(flags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, flags);
+
+	stream->io_error = stream->io_error || ferror(in);
+	ring_push(&stream->chunks, NULL);
+	return NULL;
+}
+
+static void *parser_thread(void *arg) {
+	stream_t *stream = arg;
+	song_t *song = new_song();
+	song->fps = stream->fps;
+	reader_t *reader = new_reader(song, stream->fmt);
+	int first = 1;
+	int ok = !!reader;
+	// The batches are written as they come
+	if (reader)
+		reader_keep_order(reader);
+	int newlines = 0;
+
+	chunk_t *chunk;
+	while ((chunk = ring_pop(&stream->chunks))) {
+		// After an error, the chunks are only consumed
+		if (ok && chunk->size) {
+			ok = reader_feed(reader, chunk->data, chunk->size);
+			newlines = trailing_newlines(chunk, newlines);
+		}
+
+		if (ok && stream->live) {
+			// The last lyric is complete after its block or some idle time
+			// (but not in the middle of a line: its text is still coming)
+			int all = (!chunk->size && !reader_pending(reader))
+					|| (stream->ends && newlines >= stream->ends);
+			push_batch(stream, song, &first, all ? BATCH_ALL : BATCH_DONE);
+		} else if (ok && array_count(song->lyrics) > STREAM_BATCH) {
+			push_batch(stream, song, &first, BATCH_DONE);
+		}
+
+		free(chunk);
+	}
+
+	if (ok)
+		ok = reader_end(reader);
+
+	stream->read_error = !ok;
+	push_batch(stream, song, &first, BATCH_END);
+	ring_push(&stream->batches, NULL);
+
+	free_reader(reader);
+	free_song(song);
+	return NULL;
+}
+
+static int trailing_newlines(chunk_t *chunk, int newlines) {
+	int count = 0;
+	for (size_t i = chunk->size; i > 0; i--) {
+		char car = chunk->data[i - 1];
+		if (car == '\n')
+			count++;
+		else if (car != '\r' && car != ' ' && car != '\t')
+			return count;
+	}
+
+	return newlines + count;
+}
+
+static void push_batch(stream_t *stream, song_t *song, int *first, int which) {
+	cues_t *batch = malloc(sizeof(cues_t));
+	batch->lyrics = new_array(sizeof(lyric_t), STREAM_BATCH);
+	batch->words = new_array(sizeof(word_t), 64);
+	batch->head = NULL;
+
+	// The lyric already written stays until the reader moves on
+	size_t count = array_count(song->lyrics);
+	size_t from = 0;
+	if (stream->written && count > 1) {
+		lyric_t *old = array_get(song->lyrics, 0);
+		if (old->text || old->name) {
+			fprintf(stderr, "Warning: late text for a lyric already "
+					"written (%s), ignoring...\n",
+				old->text ? old->text : old->name
+			);
+		}
+		uninit_lyric(old);
+		stream->written = 0;
+		from = 1;
+	} else if (stream->written) {
+		from = count;
+	}
+
+	// The last lyric can still get some text, unless it is complete
+	size_t done = (which != BATCH_DONE || count <= from) ? count : count - 1;
+	for (size_t i = from; i < done; i++) {
+		lyric_t *lyric = array_new(batch->lyrics);
+		memcpy(lyric, array_get(song->lyrics, i), sizeof(lyric_t));
+
+		// The words go with their lyric
+		int word = lyric->word;
+		lyric->word = array_count(batch->words);
+		for (int j = 0; j < lyric->words; j++) {
+			word_t *dst = array_new(batch->words);
+			*dst = *(word_t *) array_get(song->words, word + j);
+		}
+	}
+
+	// What the reader can still see goes first: the last lyric, or only the
+	// timings of the one just written (its texts now belong to the batch)
+	lyric_t *keep = NULL;
+	if (done < count) {
+		keep = array_get(song->lyrics, 0);
+		if (done)
+			memcpy(keep, array_get(song->lyrics, done), sizeof(lyric_t));
+	} else if (which == BATCH_ALL && done > from) {
+		keep = array_get(song->lyrics, 0);
+		if (done > 1)
+			memcpy(keep, array_get(song->lyrics, done - 1), sizeof(lyric_t));
+		keep->name = NULL;
+		keep->style = NULL;
+		keep->text = NULL;
+		keep->shared = 0;
+		keep->words = 0;
+		stream->written = 1;
+	} else if (stream->written) {
+		keep = array_get(song->lyrics, 0);
+	}
+
+	// Only the words of that lyric are kept, so the memory stays bounded
+	size_t words = keep ? keep->words : 0;
+	if (words && keep->word)
+		memmove(array_get(song->words, 0), array_get(song->words, keep->word),
+				words * sizeof(word_t));
+	if (keep)
+		keep->word = 0;
+	while (array_count(song->words) > words)
+		array_pop(song->words);
+	while (array_count(song->lyrics) > (keep ? 1 : 0))
+		array_pop(song->lyrics);
+
+	// Live: only send what is new
+	if (which != BATCH_END && !array_count(batch->lyrics)) {
+		free_batch(batch);
+		return;
+	}
+
+	// The header is known when the lyrics start
+	if (*first) {
+		song_t *head = new_song();
+		array_loop(song->metas, meta, meta_t)
+		{
+			song_add_meta(head, meta->key, meta->value);
+		}
+		head->lang = song->lang ? strdup(song->lang) : NULL;
+		head->offset = song->offset;
+		head->fps = song->fps;
+
+		batch->head = head;
+		*first = 0;
+	}
+
+	ring_push(&stream->batches, batch);
+}
+
+static void free_batch(cues_t *batch) {
+	array_loop(batch->lyrics, lyric, lyric_t)
+	{
+		uninit_lyric(lyric);
+	}
+	free_array(batch->lyrics);
+	free_array(batch->words);
+	free_song(batch->head);
+	free(batch);
+}
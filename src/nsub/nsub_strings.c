@@ -0,0 +1,131 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the FNV-1a hash of a text
+static size_t hash_text(const char *text);
+// the slot of this text: the one it is in, or the free one it should go in
+static char **find_slot(strings_t *strings, const char *text, size_t hash);
+// double the number of slots
+static int grow(strings_t *strings);
+
+/* Public */
+
+strings_t *new_strings() {
+	strings_t *strings = malloc(sizeof(strings_t));
+	if (!strings)
+		return NULL;
+
+	strings->size = 64;
+	strings->count = 0;
+	strings->slots = calloc(strings->size, sizeof(char *));
+	if (!strings->slots) {
+		free(strings);
+		return NULL;
+	}
+
+	return strings;
+}
+
+void free_strings(strings_t *strings) {
+	if (!strings)
+		return;
+
+	for (size_t i = 0; i < strings->size; i++)
+		free(strings->slots[i]);
+	free(strings->slots);
+	free(strings);
+}
+
+char *song_intern(song_t *song, const char *text) {
+	if (!text)
+		text = "";
+
+	if (!song->strings)
+		song->strings = new_strings();
+	strings_t *strings = song->strings;
+	if (!strings)
+		return NULL;
+
+	size_t hash = hash_text(text);
+	char **slot = find_slot(strings, text, hash);
+	if (*slot)
+		return *slot;
+
+	// Keep it under 3/4 full
+	if ((strings->count + 1) * 4 > strings->size * 3) {
+		if (!grow(strings))
+			return NULL;
+		slot = find_slot(strings, text, hash);
+	}
+
+	*slot = strdup(text);
+	if (*slot)
+		strings->count++;
+
+	return *slot;
+}
+
+/* Private */
+
+static size_t hash_text(const char *text) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const unsigned char *ptr = (const unsigned char *) text; *ptr; ptr++) {
+		hash ^= *ptr;
+		hash *= 1099511628211ULL;
+	}
+
+	return (size_t) hash;
+}
+
+static char **find_slot(strings_t *strings, const char *text, size_t hash) {
+	size_t mask = strings->size - 1;
+	size_t i = hash & mask;
+	while (strings->slots[i] && strcmp(strings->slots[i], text))
+		i = (i + 1) & mask;
+
+	return strings->slots + i;
+}
+
+static int grow(strings_t *strings) {
+	size_t size = strings->size * 2;
+	char **slots = calloc(size, sizeof(char *));
+	if (!slots)
+		return 0;
+
+	char **old = strings->slots;
+	size_t old_size = strings->size;
+	strings->slots = slots;
+	strings->size = size;
+
+	for (size_t i = 0; i < old_size; i++) {
+		if (old[i])
+			*find_slot(strings, old[i], hash_text(old[i])) = old[i];
+	}
+
+	free(old);
+	return 1;
+}
@@ -0,0 +1,423 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// apply the stages [from, to[ to all the lyrics in one pass (num is the last
+// number given by NSUB_STAGE_RENUMBER)
+static void transform_pass(song_t *song, pipeline_t *pipeline, size_t from,
+		size_t to, int *num);
+// the overlap policy of a stage, 0 if it is not an overlap stage
+static NSUB_OVERLAP overlap_policy(stage_t *stage);
+// apply one stage to one lyric (prev is the last kept one, if any),
+// return FALSE to drop the lyric
+static int apply_stage(stage_t *stage, song_t *song, lyric_t *lyric,
+		lyric_t *prev, int *num);
+// apply a timing stage to one time
+static int apply_time(stage_t *stage, song_t *song, int time);
+// remove the <html>, {ass} and {microdvd} tags from the text, in place
+// (the word timings follow)
+static void strip_tags(song_t *song, lyric_t *lyric);
+// the length of the tag starting here, 0 if this is only text
+static size_t tag_length(const char *ptr);
+
+/* Public */
+
+pipeline_t *new_pipeline() {
+	pipeline_t *pipeline = malloc(sizeof(pipeline_t));
+	pipeline->stages = new_array(sizeof(stage_t), 8);
+	return pipeline;
+}
+
+void free_pipeline(pipeline_t *pipeline) {
+	if (!pipeline)
+		return;
+
+	free_array(pipeline->stages);
+	free(pipeline);
+}
+
+void pipeline_add(pipeline_t *pipeline, NSUB_STAGE type) {
+	stage_t *stage = array_new(pipeline->stages);
+	stage->type = type;
+	stage->ms = 0;
+	stage->ratio.num = 1;
+	stage->ratio.den = 1;
+}
+
+void pipeline_add_ms(pipeline_t *pipeline, NSUB_STAGE type, int ms) {
+	stage_t *stage = array_new(pipeline->stages);
+	stage->type = type;
+	stage->ms = ms;
+	stage->ratio.num = 1;
+	stage->ratio.den = 1;
+}
+
+void pipeline_add_ratio(pipeline_t *pipeline, NSUB_STAGE type, ratio_t ratio) {
+	stage_t *stage = array_new(pipeline->stages);
+	stage->type = type;
+	stage->ms = 0;
+	stage->ratio = ratio;
+}
+
+int nsub_transform(song_t *song, pipeline_t *pipeline) {
+	if (!pipeline || !array_count(pipeline->stages))
+		return 1;
+
+	size_t count = array_count(pipeline->stages);
+	int apply_offset = nsub_pipeline_has(pipeline, NSUB_STAGE_APPLY_OFFSET);
+
+	// The stages that need the whole song split the others in passes
+	size_t first = 0;
+	for (size_t i = 0; i <= count; i++) {
+		stage_t *stage = i < count ? array_get(pipeline->stages, i) : NULL;
+		NSUB_OVERLAP policy = stage ? overlap_policy(stage) : 0;
+		if (stage && !policy)
+			continue;
+
+		if (i > first) {
+			int num = 0;
+			transform_pass(song, pipeline, first, i, &num);
+		}
+		if (policy)
+			nsub_fix_overlaps(song, policy);
+
+		first = i + 1;
+	}
+
+	// The offset is now part of the timings
+	if (apply_offset)
+		song->offset = 0;
+
+	return 1;
+}
+
+int nsub_pipeline_has(pipeline_t *pipeline, NSUB_STAGE type) {
+	if (!pipeline)
+		return 0;
+
+	array_loop(pipeline->stages, stage, stage_t)
+	{
+		if (stage->type == type)
+			return 1;
+	}
+
+	return 0;
+}
+
+int nsub_pipeline_streamable(pipeline_t *pipeline) {
+	if (!pipeline)
+		return 1;
+
+	// Those need the whole song, or to change the previous lyric
+	array_loop(pipeline->stages, stage, stage_t)
+	{
+		if (overlap_policy(stage) || stage->type == NSUB_STAGE_DEDUP)
+			return 0;
+	}
+
+	return 1;
+}
+
+int nsub_transform_batch(song_t *song, pipeline_t *pipeline, int *num) {
+	if (!nsub_pipeline_streamable(pipeline)) {
+		fprintf(stderr, "This pipeline cannot be applied by batches\n");
+		return 0;
+	}
+
+	if (pipeline)
+		transform_pass(song, pipeline, 0, array_count(pipeline->stages), num);
+
+	return 1;
+}
+
+int nsub_pipeline_timings_only(pipeline_t *pipeline) {
+	if (!pipeline)
+		return 1;
+
+	array_loop(pipeline->stages, stage, stage_t)
+	{
+		switch (stage->type) {
+		case NSUB_STAGE_SHIFT:
+		case NSUB_STAGE_SCALE:
+		case NSUB_STAGE_SNAP:
+		case NSUB_STAGE_APPLY_OFFSET:
+		case NSUB_STAGE_CLAMP:
+		case NSUB_STAGE_MIN_DURATION:
+		// Nothing to do when there are only lyrics, numbered in order
+		case NSUB_STAGE_DROP_COMMENTS:
+		case NSUB_STAGE_RENUMBER:
+			break;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void nsub_transform_timings(song_t *song, pipeline_t *pipeline, int *start,
+		int *stop) {
+	if (!pipeline)
+		return;
+
+	lyric_t lyric;
+	memset(&lyric, 0, sizeof(lyric_t));
+	lyric.type = NSUB_LYRIC;
+	lyric.start = *start;
+	lyric.stop = *stop;
+
+	int num = 0;
+	array_loop(pipeline->stages, stage, stage_t)
+	{
+		apply_stage(stage, song, &lyric, NULL, &num);
+	}
+
+	*start = lyric.start;
+	*stop = lyric.stop;
+}
+
+/* Private */
+
+static void transform_pass(song_t *song, pipeline_t *pipeline, size_t from,
+		size_t to, int *num) {
+	size_t count = array_count(song->lyrics);
+	size_t kept = 0;
+
+	// One pass: all the stages on a lyric, then the next lyric
+	for (size_t i = 0; i < count; i++) {
+		lyric_t *lyric = array_get(song->lyrics, i);
+		lyric_t *prev = kept ? array_get(song->lyrics, kept - 1) : NULL;
+
+		int keep = 1;
+		for (size_t j = from; keep && j < to; j++)
+			keep = apply_stage(array_get(pipeline->stages, j), song, lyric,
+					prev, num);
+
+		if (!keep) {
+			uninit_lyric(lyric);
+			continue;
+		}
+
+		// Compact in place over the dropped lyrics
+		if (kept != i)
+			memcpy(array_get(song->lyrics, kept), lyric, sizeof(lyric_t));
+		kept++;
+	}
+
+	while (array_count(song->lyrics) > kept)
+		array_pop(song->lyrics);
+}
+
+static NSUB_OVERLAP overlap_policy(stage_t *stage) {
+	switch (stage->type) {
+	case NSUB_STAGE_TRUNCATE_OVERLAPS:
+		return NSUB_OVERLAP_TRUNCATE;
+	case NSUB_STAGE_MERGE_OVERLAPS:
+		return NSUB_OVERLAP_MERGE;
+	case NSUB_STAGE_STACK_OVERLAPS:
+		return NSUB_OVERLAP_STACK;
+	default:
+		return 0;
+	}
+}
+
+static int apply_stage(stage_t *stage, song_t *song, lyric_t *lyric,
+		lyric_t *prev, int *num) {
+	int timed = (lyric->type == NSUB_LYRIC);
+
+	switch (stage->type) {
+	case NSUB_STAGE_SHIFT:
+	case NSUB_STAGE_SCALE:
+	case NSUB_STAGE_SNAP:
+	case NSUB_STAGE_APPLY_OFFSET:
+		if (timed) {
+			lyric->start = apply_time(stage, song, lyric->start);
+			lyric->stop = apply_time(stage, song, lyric->stop);
+			for (int i = 0; i < lyric->words; i++) {
+				word_t *word = array_get(song->words, lyric->word + i);
+				word->start = apply_time(stage, song, word->start);
+			}
+		}
+		break;
+	case NSUB_STAGE_CLAMP:
+		if (timed) {
+			if (lyric->start < 0)
+				lyric->start = 0;
+			if (lyric->stop < lyric->start)
+				lyric->stop = lyric->start;
+			for (int i = 0; i < lyric->words; i++) {
+				word_t *word = array_get(song->words, lyric->word + i);
+				if (word->start < 0)
+					word->start = 0;
+			}
+		}
+		break;
+	case NSUB_STAGE_MIN_DURATION:
+		if (timed && lyric->stop - lyric->start < stage->ms)
+			lyric->stop = lyric->start + stage->ms;
+		break;
+	case NSUB_STAGE_DROP_COMMENTS:
+		if (lyric->type == NSUB_COMMENT || lyric->type == NSUB_UNKNOWN)
+			return 0;
+		break;
+	case NSUB_STAGE_STRIP_TAGS:
+		if (lyric->text)
+			strip_tags(song, lyric);
+		break;
+	case NSUB_STAGE_RENUMBER:
+		if (timed)
+			lyric->num = ++(*num);
+		break;
+	case NSUB_STAGE_DEDUP:
+		// Word timings are not merged, so keep those lyrics
+		if (timed && prev && prev->type == NSUB_LYRIC && !lyric->words
+				&& !prev->words && lyric->start >= prev->start
+				&& lyric->start - prev->stop <= stage->ms
+				&& lyric_same_text(prev, lyric)) {
+			if (lyric->stop > prev->stop)
+				prev->stop = lyric->stop;
+			return 0;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+static int apply_time(stage_t *stage, song_t *song, int time) {
+	switch (stage->type) {
+	case NSUB_STAGE_SHIFT:
+		return time + stage->ms;
+	case NSUB_STAGE_SCALE:
+		return apply_ratio(time, stage->ratio);
+	case NSUB_STAGE_SNAP:
+		return snap_to_frame(time, stage->ratio);
+	case NSUB_STAGE_APPLY_OFFSET:
+		return time + song->offset;
+	default:
+		return time;
+	}
+}
+
+static void strip_tags(song_t *song, lyric_t *lyric) {
+	// A shared text is not ours to modify
+	if (lyric->shared) {
+		lyric->text = strdup(lyric->text);
+		lyric->shared = 0;
+	}
+
+	char *text = lyric->text;
+	char *out = text;
+	size_t skip = 0;
+	int iword = 0;
+
+	for (char *ptr = text; *ptr; ptr++) {
+		// The words now start where their first character goes
+		while (iword < lyric->words) {
+			word_t *word = array_get(song->words, lyric->word + iword);
+			if (word->offset > ptr - text)
+				break;
+			word->offset = out - text;
+			iword++;
+		}
+
+		if (skip) {
+			skip--;
+		} else if ((skip = tag_length(ptr))) {
+			skip--;
+		} else {
+			*out++ = *ptr;
+		}
+	}
+
+	*out = '\0';
+
+	while (iword < lyric->words) {
+		word_t *word = array_get(song->words, lyric->word + iword++);
+		word->offset = out - text;
+	}
+}
+
+static size_t tag_length(const char *ptr) {
+	// The known HTML-like tags: <i>, </i>, <c.yellow>, <v Bob>, <lang en>,
+	// <font color="red">...
+	static const char *names[] = { "b", "i", "u", "s", "c", "v", "lang",
+			"ruby", "rt", "font", NULL };
+
+	if (*ptr == '{') {
+		// {\i1}, {\an8}... and MicroDVD: {y:i}, {c:$0000FF}...
+		int ass = ptr[1] == '\\';
+		int microdvd = ((ptr[1] >= 'a' && ptr[1] <= 'z')
+				|| (ptr[1] >= 'A' && ptr[1] <= 'Z')) && ptr[2] == ':';
+		if (!ass && !microdvd)
+			return 0;
+
+		const char *end = strpbrk(ptr + 1, "{}\n");
+		return (end && *end == '}') ? (size_t) (end - ptr + 1) : 0;
+	}
+
+	if (*ptr != '<')
+		return 0;
+
+	// Never past the end of the line or another tag
+	const char *end = strpbrk(ptr + 1, "<>\n");
+	if (!end || *end != '>')
+		return 0;
+	size_t len = end - ptr + 1;
+
+	// A karaoke timestamp: <00:00:01.000>
+	const char *content = ptr + 1;
+	size_t clen = len - 2;
+	if (clen && clen < 16 && content[0] >= '0' && content[0] <= '9') {
+		char stamp[16];
+		memcpy(stamp, content, clen);
+		stamp[clen] = '\0';
+		return nsub_is_timing(stamp, '.', 3) ? len : 0;
+	}
+
+	if (*content == '/') {
+		content++;
+		clen--;
+	}
+
+	for (int i = 0; names[i]; i++) {
+		size_t nlen = strlen(names[i]);
+		size_t j = 0;
+		// (in any case: <I>, <FONT>...)
+		while (j < nlen && j < clen && (content[j] | 0x20) == names[i][j])
+			j++;
+		if (j < nlen)
+			continue;
+
+		// Only the name, with a class or with an annotation (not when closing)
+		char next = content[nlen];
+		if (next == '>' || ((next == '.' || next == ' ') && content[-1] != '/'))
+			return len;
+	}
+
+	return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// sigaction(), realpath(), clock_gettime()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+#ifdef __linux__
+
+// milliseconds without changes before a file is converted
+#define WATCH_DEBOUNCE 300
+// milliseconds between two checks of a file that is still being converted
+#define WATCH_RETRY 50
+
+// a file that changed
+typedef struct {
+	char *path;
+	// when to convert it (monotonic ms), 0 if not pending
+	long long due;
+	// TRUE while a worker converts it
+	int busy;
+} watched_t;
+
+// the state of the watch, shared with the workers
+typedef struct {
+	batch_t *batch;
+	NSUB_FORMAT *to;
+	// the pipeline of each target format
+	pipeline_t **pipelines;
+	size_t nto;
+	const char *dir;
+	// the outputs are written in the watched directory
+	int in_place;
+	pthread_mutex_t lock;
+	// the files seen so far (watched_t *)
+	array_t *files;
+} watch_t;
+
+// set by SIGINT and SIGTERM
+static volatile sig_atomic_t watch_stop;
+
+static void on_signal(int sig);
+// the monotonic time in milliseconds
+static long long now_ms();
+// check if a file of the watched directory should be converted
+static int is_input(watch_t *watch, const char *name);
+// (re)schedule the conversion of a file
+static void touch(watch_t *watch, const char *name, long long due);
+// queue the files that are due, return the ms to wait for the next one
+static int dispatch(watch_t *watch, pool_t *pool);
+// convert one file into all the target formats (from a worker)
+static void work(void *data, void *item, int ithread);
+
+#endif
+
+/* Public */
+
+#ifdef __linux__
+
+int nsub_watch(batch_t *batch, NSUB_FORMAT *to, pipeline_t **pipelines,
+		size_t nto, const char *dir, int threads) {
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot watch the directory: %s\n", strerror(errno));
+		return 2;
+	}
+
+	// Written-then-closed, renamed into (atomic saves) and modified files
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY)
+			< 0) {
+		fprintf(stderr, "Cannot watch the directory: %s: %s\n", dir,
+				strerror(errno));
+		close(fd);
+		return 2;
+	}
+
+	watch_t watch;
+	watch.batch = batch;
+	watch.to = to;
+	watch.pipelines = pipelines;
+	watch.nto = nto;
+	watch.dir = dir;
+	watch.in_place = 1;
+	pthread_mutex_init(&watch.lock, NULL);
+	watch.files = new_array(sizeof(watched_t *), 16);
+
+	if (batch->outdir) {
+		char *a = realpath(dir, NULL);
+		char *b = realpath(batch->outdir, NULL);
+		watch.in_place = (a && b && !strcmp(a, b));
+		free(a);
+		free(b);
+	}
+
+	pool_t *pool = new_pool(threads, work, &watch);
+	if (!pool) {
+		free_array(watch.files);
+		close(fd);
+		return 2;
+	}
+
+	// Stop cleanly on Ctrl+C (the conversions in progress are finished)
+	struct sigaction action, old_int, old_term;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = on_signal;
+	sigemptyset(&action.sa_mask);
+	watch_stop = 0;
+	sigaction(SIGINT, &action, &old_int);
+	sigaction(SIGTERM, &action, &old_term);
+
+	fprintf(stderr, "Watching %s (Ctrl+C to stop)\n", dir);
+
+	int rep = 0;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int timeout = -1;
+	while (!watch_stop) {
+		int ready = poll(&pfd, 1, timeout);
+		if (ready < 0 && errno != EINTR) {
+			fprintf(stderr, "Cannot watch the directory: %s\n",
+					strerror(errno));
+			rep = 2;
+			break;
+		}
+
+		// Each event pushes the conversion of its file a bit later
+		if (ready > 0) {
+			long long due = now_ms() + WATCH_DEBOUNCE;
+			ssize_t len;
+			while ((len = read(fd, buf, sizeof(buf))) > 0) {
+				for (char *ptr = buf; ptr < buf + len;) {
+					struct inotify_event *event = (void *) ptr;
+					if (event->mask & IN_Q_OVERFLOW)
+						fprintf(stderr, "Warning: too many changes at once, "
+								"some files may be missed\n");
+					if (event->len && is_input(&watch, event->name))
+						touch(&watch, event->name, due);
+					ptr += sizeof(struct inotify_event) + event->len;
+				}
+			}
+		}
+
+		timeout = dispatch(&watch, pool);
+	}
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+
+	free_pool(pool);
+	close(fd);
+
+	array_loop(watch.files, file, watched_t *)
+	{
+		free((*file)->path);
+		free(*file);
+	}
+	free_array(watch.files);
+	pthread_mutex_destroy(&watch.lock);
+
+	return rep;
+}
+
+#else
+
+int nsub_watch(batch_t *batch, NSUB_FORMAT *to, pipeline_t **pipelines,
+		size_t nto, const char *dir, int threads) {
+	fprintf(stderr, "Watching a directory is only supported on Linux\n");
+	return 2;
+}
+
+#endif
+
+/* Private */
+
+#ifdef __linux__
+
+static void on_signal(int sig) {
+	watch_stop = 1;
+}
+
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int is_input(watch_t *watch, const char *name) {
+	// Hidden files: editor swap files and the like
+	if (name[0] == '.')
+		return 0;
+
+	char *ext = nsub_file_ext((char *) name);
+	NSUB_FORMAT fmt = ext ? nsub_parse_fmt(ext, 0) : NSUB_FMT_UNKNOWN;
+	if (fmt == NSUB_FMT_UNKNOWN)
+		return 0;
+	if (watch->batch->from != NSUB_FMT_UNKNOWN && fmt != watch->batch->from)
+		return 0;
+
+	// Do not convert our own outputs again
+	if (watch->in_place) {
+		for (size_t i = 0; i < watch->nto; i++) {
+			if (fmt == watch->to[i])
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void touch(watch_t *watch, const char *name, long long due) {
+	cstring_t *path = new_cstring();
+	cstring_add(path, watch->dir);
+	if (path->length && path->string[path->length - 1] != '/')
+		cstring_add_car(path, '/');
+	cstring_add(path, name);
+
+	pthread_mutex_lock(&watch->lock);
+
+	watched_t *found = NULL;
+	array_loop(watch->files, file, watched_t *)
+	{
+		if (!strcmp((*file)->path, path->string)) {
+			found = *file;
+			break;
+		}
+	}
+
+	if (!found) {
+		found = malloc(sizeof(watched_t));
+		found->path = cstring_convert(path);
+		found->busy = 0;
+		path = NULL;
+
+		watched_t **slot = array_new(watch->files);
+		*slot = found;
+	}
+
+	found->due = due;
+
+	pthread_mutex_unlock(&watch->lock);
+	free_cstring(path);
+}
+
+static int dispatch(watch_t *watch, pool_t *pool) {
+	long long now = now_ms();
+	long long next = -1;
+
+	pthread_mutex_lock(&watch->lock);
+	array_loop(watch->files, file, watched_t *)
+	{
+		watched_t *watched = *file;
+		if (!watched->due)
+			continue;
+
+		// One conversion at a time per file
+		long long due = watched->due;
+		if (watched->busy && due < now + WATCH_RETRY)
+			due = now + WATCH_RETRY;
+
+		if (due <= now) {
+			watched->due = 0;
+			watched->busy = 1;
+			pool_add(pool, watched);
+		} else if (next < 0 || due < next) {
+			next = due;
+		}
+	}
+	pthread_mutex_unlock(&watch->lock);
+
+	return next < 0 ? -1 : (int) (next - now);
+}
+
+static void work(void *data, void *item, int ithread) {
+	watch_t *watch = data;
+	watched_t *watched = item;
+
+	// The path does not change once the file is known
+	char *path = watched->path;
+	for (size_t i = 0; i < watch->nto; i++) {
+		batch_t batch = *watch->batch;
+		batch.to = watch->to[i];
+		batch.pipeline = watch->pipelines[i];
+		batch.io = NSUB_IO_POSIX;
+		if (!nsub_batch(&batch, &path, 1))
+			fprintf(stderr, "Converted: %s (%s)\n", path,
+					nsub_fmt_ext(batch.to));
+	}
+
+	pthread_mutex_lock(&watch->lock);
+	watched->busy = 0;
+	pthread_mutex_unlock(&watch->lock);
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+char *nsub_ass_time_str(int time);
+void nsub_write_ass_lyric(FILE *out, lyric_t *lyric, const char *style,
+		int ssa);
+
+// the meta value for this ASS key, or NULL
+static char *get_meta(song_t *song, const char *key);
+
+/* Public */
+
+int nsub_write_ass(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	char *type = get_meta(song, "ass.ScriptType");
+	int ssa = type && !strcmp(type, "v4.00");
+
+	// header
+	{
+		fprintf(out, "[Script Info]\n");
+		fprintf(out, "; created by: nsub (https://github.com/nikiroo/nsub)\n");
+		fprintf(out, "ScriptType: %s\n", type ? type : "v4.00+");
+		if (song->lang)
+			fprintf(out, "Language: %s\n", song->lang);
+	}
+
+	// metas (only ours, the other formats' metas mean nothing here)
+	array_loop(song->metas, meta, meta_t)
+	{
+		if (strncmp(meta->key, "ass.", 4) || !strcmp(meta->key, "ass.Format")
+				|| !strcmp(meta->key, "ass.Style")
+				|| !strcmp(meta->key, "ass.ScriptType"))
+			continue;
+
+		fprintf(out, "%s: %s\n", meta->key + 4, meta->value);
+	}
+
+	// offset is not supported in ASS (see NSUB_STAGE_APPLY_OFFSET)
+
+	// styles
+	cstring_t *style = new_cstring();
+	{
+		fprintf(out, "\n[%s]\n", ssa ? "V4 Styles" : "V4+ Styles");
+
+		char *format = get_meta(song, "ass.Format");
+		if (format) {
+			fprintf(out, "Format: %s\n", format);
+		} else {
+			fprintf(out, "Format: Name, Fontname, Fontsize, PrimaryColour, "
+					"SecondaryColour, OutlineColour, BackColour, Bold, Italic, "
+					"Underline, StrikeOut, ScaleX, ScaleY, Spacing, Angle, "
+					"BorderStyle, Outline, Shadow, Alignment, MarginL, MarginR, "
+					"MarginV, Encoding\n");
+		}
+
+		array_loop(song->metas, meta, meta_t)
+		{
+			if (strcmp(meta->key, "ass.Style"))
+				continue;
+
+			// The first style is the default one
+			if (!style->length)
+				cstring_addn(style, meta->value, strcspn(meta->value, ","));
+
+			fprintf(out, "Style: %s\n", meta->value);
+		}
+
+		if (!style->length) {
+			cstring_add(style, "Default");
+			fprintf(out, "Style: Default,Arial,20,&H00FFFFFF,&H000000FF,"
+					"&H00000000,&H00000000,0,0,0,0,100,100,0,0,1,2,2,2,"
+					"10,10,10,1\n");
+		}
+	}
+
+	// lyrics
+	{
+		fprintf(out, "\n[Events]\n");
+		fprintf(out, "Format: %s, Start, End, Style, Name, MarginL, MarginR, "
+				"MarginV, Effect, Text\n", ssa ? "Marked" : "Layer");
+
+		array_loop(song->lyrics, lyric, lyric_t)
+		{
+			nsub_write_ass_lyric(out, lyric, style->string, ssa);
+		}
+	}
+
+	free_cstring(style);
+	return 1;
+}
+
+/* Private */
+
+void nsub_write_ass_lyric(FILE *out, lyric_t *lyric, const char *style,
+		int ssa) {
+	if (lyric->type == NSUB_EMPTY || !lyric->text)
+		return;
+
+	int comment = (lyric->type == NSUB_COMMENT
+			|| lyric->type == NSUB_UNKNOWN);
+
+	cstring_t *text = cstring_clone(lyric->text);
+	cstring_replace(text, "\n", "\\N");
+
+	// The name is a column, so it cannot hold commas
+	cstring_t *name = cstring_clone(lyric->name ? lyric->name : "");
+	cstring_replace(name, ",", ";");
+
+	char *start = nsub_ass_time_str(comment ? 0 : lyric->start);
+	char *stop = nsub_ass_time_str(comment ? 0 : lyric->stop);
+	fprintf(out, "%s: %s,%s,%s,%s,%s,0,0,0,,%s\n",
+			comment ? "Comment" : "Dialogue", ssa ? "Marked=0" : "0", start,
+			stop, lyric->style ? lyric->style : style, name->string,
+			text->string);
+	free(start);
+	free(stop);
+
+	free_cstring(name);
+	free_cstring(text);
+}
+
+char *nsub_ass_time_str(int time) {
+	// no negative timings in ASS
+	if (time < 0)
+		time = 0;
+
+	int h = (time / 1000) / 3600;
+	int m = ((time / 1000) / 60) % 60;
+	int s = ((time / 1000)) % 60;
+	int c = (time / 10) % 100;
+
+	char *time_str = malloc(16 * sizeof(char));
+	sprintf(time_str, "%d:%02d:%02d.%02d", h, m, s, c);
+
+	return time_str;
+}
+
+static char *get_meta(song_t *song, const char *key) {
+	array_loop(song->metas, meta, meta_t)
+	{
+		if (!strcmp(meta->key, key))
+			return meta->value;
+	}
+
+	return NULL;
+}
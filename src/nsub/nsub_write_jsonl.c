@@ -0,0 +1,202 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+void nsub_write_jsonl_header(FILE *out, song_t *song);
+void nsub_write_jsonl_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state);
+// write ,"key": (or "key": for the first key of an object)
+static void put_key(FILE *out, const char *key, int first);
+// write a JSON string, the characters that need no escaping in one go
+static void put_string(FILE *out, const char *text);
+// write an integer without going through printf
+static void put_int(FILE *out, int value);
+
+/* Public */
+
+int nsub_write_jsonl(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	writer_t writer;
+	nsub_writer_jsonl(&writer);
+
+	writer.write_header(out, song);
+	return nsub_write_lyrics(out, song, &writer);
+}
+
+void nsub_writer_jsonl(writer_t *writer) {
+	writer->write_header = nsub_write_jsonl_header;
+	writer->write_lyric = nsub_write_jsonl_lyric;
+	writer->init_state = NULL;
+	writer->state_size = 0;
+}
+
+/* Private */
+
+void nsub_write_jsonl_header(FILE *out, song_t *song) {
+	// header: one object, always first
+	fputs("{\"type\":\"header\"", out);
+
+	if (song->lang) {
+		put_key(out, "lang", 0);
+		put_string(out, song->lang);
+	}
+
+	// offset is supported in JSON Lines (see NSUB_STAGE_APPLY_OFFSET)
+	put_key(out, "offset", 0);
+	put_int(out, song->offset);
+
+	// metas: all of them, in order
+	put_key(out, "metas", 0);
+	putc('{', out);
+	int first = 1;
+	array_loop(song->metas, meta, meta_t)
+	{
+		if (!meta->key)
+			continue;
+		put_key(out, meta->key, first);
+		put_string(out, meta->value ? meta->value : "");
+		first = 0;
+	}
+	fputs("}}\n", out);
+}
+
+void nsub_write_jsonl_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state) {
+	// Every type is kept, so a round-trip loses nothing
+	switch (lyric->type) {
+	case NSUB_LYRIC:
+		fputs("{\"type\":\"lyric\"", out);
+		put_key(out, "num", 0);
+		put_int(out, lyric->num);
+		if (lyric->id) {
+			put_key(out, "id", 0);
+			put_int(out, lyric->id);
+		}
+		put_key(out, "start", 0);
+		put_int(out, lyric->start);
+		put_key(out, "stop", 0);
+		put_int(out, lyric->stop);
+		break;
+	case NSUB_COMMENT:
+		fputs("{\"type\":\"comment\"", out);
+		break;
+	case NSUB_EMPTY:
+		fputs("{\"type\":\"empty\"", out);
+		break;
+	default:
+		fputs("{\"type\":\"unknown\"", out);
+		break;
+	}
+
+	if (lyric->name) {
+		put_key(out, "name", 0);
+		put_string(out, lyric->name);
+	}
+
+	if (lyric->text) {
+		put_key(out, "text", 0);
+		put_string(out, lyric->text);
+	}
+
+	// words: [offset in the text, start], in order
+	if (lyric->words) {
+		put_key(out, "words", 0);
+		putc('[', out);
+		for (int i = 0; i < lyric->words; i++) {
+			word_t *word = array_get(song->words, lyric->word + i);
+			fputs(i ? ",[" : "[", out);
+			put_int(out, word->offset);
+			putc(',', out);
+			put_int(out, word->start);
+			putc(']', out);
+		}
+		putc(']', out);
+	}
+
+	fputs("}\n", out);
+}
+
+static void put_key(FILE *out, const char *key, int first) {
+	if (!first)
+		putc(',', out);
+	put_string(out, key);
+	putc(':', out);
+}
+
+static void put_string(FILE *out, const char *text) {
+	putc('"', out);
+
+	const char *run = text;
+	const char *ptr = text;
+	for (; *ptr; ptr++) {
+		unsigned char car = *ptr;
+		if (car >= 0x20 && car != '"' && car != '\\')
+			continue;
+
+		fwrite(run, 1, ptr - run, out);
+		run = ptr + 1;
+
+		switch (car) {
+		case '"':
+			fputs("\\\"", out);
+			break;
+		case '\\':
+			fputs("\\\\", out);
+			break;
+		case '\n':
+			fputs("\\n", out);
+			break;
+		case '\r':
+			fputs("\\r", out);
+			break;
+		case '\t':
+			fputs("\\t", out);
+			break;
+		default:
+			fprintf(out, "\\u%04x", car);
+			break;
+		}
+	}
+	fwrite(run, 1, ptr - run, out);
+
+	putc('"', out);
+}
+
+static void put_int(FILE *out, int value) {
+	char buf[16];
+	char *ptr = buf + sizeof(buf);
+	unsigned int abs = value < 0 ? 0u - (unsigned int) value
+			: (unsigned int) value;
+
+	do {
+		*--ptr = '0' + abs % 10;
+		abs /= 10;
+	} while (abs);
+	if (value < 0)
+		*--ptr = '-';
+
+	fwrite(ptr, 1, buf + sizeof(buf) - ptr, out);
+}
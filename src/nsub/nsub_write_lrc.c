@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "nsub.h"
 #include "cutils/cutils.h"
@@ -25,31 +26,51 @@
 /* Declarations */
 
 char *nsub_lrc_time_str(int time, int show_sign);
-void nsub_write_lrc_lyric(FILE *out, lyric_t *lyric, int offset, double conv);
+// the stop time of the previous lyric, for the gap lines (0 if none)
+typedef struct {
+	int last_stop;
+} lrc_state_t;
+
+void nsub_write_lrc_header(FILE *out, song_t *song);
+void nsub_write_lrc_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state);
+void nsub_lrc_init_state(song_t *song, size_t ilyric, void *state);
 
 /* Public */
 
-int nsub_write_lrc(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv) {
-	int offset = add_offset;
+int nsub_write_lrc(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	writer_t writer;
+	nsub_writer_lrc(&writer);
+
+	writer.write_header(out, song);
+	return nsub_write_lyrics(out, song, &writer);
+}
+
+void nsub_writer_lrc(writer_t *writer) {
+	writer->write_header = nsub_write_lrc_header;
+	writer->write_lyric = nsub_write_lrc_lyric;
+	writer->init_state = nsub_lrc_init_state;
+	writer->state_size = sizeof(lrc_state_t);
+}
+
+/* Private */
 
+void nsub_write_lrc_header(FILE *out, song_t *song) {
 	// header: none
 
 	// metas
 	array_loop(song->metas, meta, meta_t)
 	{
+		// ASS styles and script info mean nothing in LRC
+		if (!strncmp(meta->key, "ass.", 4))
+			continue;
+
 		fprintf(out, "[%s: %s]\n", meta->key, meta->value);
 	}
 
 	// offset
 	{
-		char *offset_str;
-		if (apply_offset) {
-			offset += song->offset;
-			offset_str = nsub_lrc_time_str(0, 1);
-		} else {
-			offset_str = nsub_lrc_time_str(song->offset, 1);
-		}
+		char *offset_str = nsub_lrc_time_str(song->offset, 1);
 		fprintf(out, "[offset: %s]\n", offset_str);
 		free(offset_str);
 	}
@@ -60,20 +81,11 @@ int nsub_write_lrc(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
 		if (song->lang)
 			fprintf(out, "[language: %s]\n", song->lang);
 	}
-
-	// lyrics
-	array_loop(song->lyrics, lyric, lyric_t)
-	{
-		nsub_write_lrc_lyric(out, lyric, offset, conv);
-	}
-
-	return 1;
 }
 
-/* Private */
-
-void nsub_write_lrc_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
-	static int lrc_last_stop = 0;
+void nsub_write_lrc_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state) {
+	int *lrc_last_stop = &((lrc_state_t *) state)->last_stop;
 
 	if (lyric->type == NSUB_EMPTY) {
 		fprintf(out, "\n");
@@ -92,13 +104,13 @@ void nsub_write_lrc_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
 		return;
 	}
 	
-	int start_time = apply_conv(lyric->start, conv) + offset;
-	if (lrc_last_stop && lrc_last_stop != start_time) {
-		char *time = nsub_lrc_time_str(lrc_last_stop, 0);
+	int start_time = lyric->start;
+	if (*lrc_last_stop && *lrc_last_stop != start_time) {
+		char *time = nsub_lrc_time_str(*lrc_last_stop, 0);
 		fprintf(out, "[%s]\n", time);
 		fprintf(out, "\n");
 		free(time);
-		lrc_last_stop = 0;
+		*lrc_last_stop = 0;
 	}
 	
 
@@ -114,7 +126,7 @@ void nsub_write_lrc_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
 	}
 	
 	char *time = nsub_lrc_time_str(start_time, 0);
-	cstring_t *tmp = cstring_clone(lyric->text);
+	cstring_t *tmp = nsub_word_text(song, lyric, nsub_lrc_time_str, 0);
 	if (tmp) {
 		cstring_replace(tmp, "\n", "\\n");
 	}
@@ -122,7 +134,20 @@ void nsub_write_lrc_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
 	free(time);
 	free_cstring(tmp);
 
-	lrc_last_stop = apply_conv(lyric->stop, conv) + offset;
+	*lrc_last_stop = lyric->stop;
+}
+
+void nsub_lrc_init_state(song_t *song, size_t ilyric, void *state) {
+	// Only the real lyrics change the state
+	lrc_state_t *lrc = state;
+	lrc->last_stop = 0;
+	while (ilyric--) {
+		lyric_t *lyric = array_get(song->lyrics, ilyric);
+		if (lyric->type == NSUB_LYRIC) {
+			lrc->last_stop = lyric->stop;
+			break;
+		}
+	}
 }
 
 char *nsub_lrc_time_str(int time, int show_sign) {
@@ -0,0 +1,141 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// open_memstream()
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+// the number of lyrics formatted by a thread at once
+#define SLICE_LYRICS 4096
+// the number of slices per thread formatted before writing them
+#define SLICE_ROUND 2
+
+// what to write and how
+typedef struct {
+	song_t *song;
+	const writer_t *writer;
+} job_t;
+
+// a slice of lyrics [from..to[ and its formatted text
+typedef struct {
+	size_t from;
+	size_t to;
+	char *buf;
+	size_t size;
+	int ok;
+} slice_t;
+
+// write the lyrics [from..to[ into out
+static void write_range(job_t *job, FILE *out, size_t from, size_t to);
+// format a slice into its buffer (the work of the pool)
+static void format_slice(void *data, void *item, int ithread);
+
+/* Public */
+
+int nsub_write_lyrics(FILE *out, song_t *song, const writer_t *writer) {
+	job_t job = { song, writer };
+	size_t count = array_count(song->lyrics);
+
+	// Small songs are not worth the threads
+	pool_t *pool = NULL;
+	if (song->threads > 1 && count >= 2 * SLICE_LYRICS)
+		pool = new_pool(song->threads, format_slice, &job);
+
+	if (!pool) {
+		write_range(&job, out, 0, count);
+		return 1;
+	}
+
+	// Format a few slices per thread, then write them in order
+	size_t max = SLICE_ROUND * pool_threads(pool);
+	slice_t *slices = malloc(max * sizeof(slice_t));
+	int ok = 1;
+	for (size_t from = 0; ok && from < count;) {
+		size_t nslices = 0;
+		for (; nslices < max && from < count; nslices++) {
+			slice_t *slice = &slices[nslices];
+			slice->from = from;
+			slice->to = from + SLICE_LYRICS < count ?
+					from + SLICE_LYRICS : count;
+			slice->buf = NULL;
+			slice->size = 0;
+			slice->ok = 0;
+			pool_add(pool, slice);
+			from = slice->to;
+		}
+
+		pool_wait(pool);
+
+		for (size_t i = 0; i < nslices; i++) {
+			if (!slices[i].ok) {
+				fprintf(stderr, "Cannot format the lyrics\n");
+				ok = 0;
+			} else if (ok) {
+				fwrite(slices[i].buf, 1, slices[i].size, out);
+			}
+			free(slices[i].buf);
+		}
+	}
+
+	free(slices);
+	free_pool(pool);
+	return ok;
+}
+
+/* Private */
+
+static void write_range(job_t *job, FILE *out, size_t from, size_t to) {
+	const writer_t *writer = job->writer;
+	void *state = NULL;
+	if (writer->state_size) {
+		state = calloc(1, writer->state_size);
+		if (writer->init_state)
+			writer->init_state(job->song, from, state);
+	}
+
+	for (size_t i = from; i < to; i++) {
+		lyric_t *lyric = array_get(job->song->lyrics, i);
+		writer->write_lyric(out, job->song, lyric, state);
+	}
+
+	free(state);
+}
+
+static void format_slice(void *data, void *item, int ithread) {
+	job_t *job = data;
+	slice_t *slice = item;
+
+	FILE *out = open_memstream(&slice->buf, &slice->size);
+	if (!out)
+		return;
+
+	write_range(job, out, slice->from, slice->to);
+	slice->ok = !ferror(out);
+
+	// The buffer and its size are only up to date after fclose()
+	if (fclose(out))
+		slice->ok = 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+void nsub_write_microdvd_lyric(FILE *out, lyric_t *lyric, ratio_t to_frames);
+
+/* Public */
+
+int nsub_write_microdvd(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	ratio_t fps = song->fps;
+	if (!fps.num) {
+		fps.num = 24000;
+		fps.den = 1001;
+	}
+
+	// header: the frame rate, with 3 decimals at most
+	{
+		long long fps1000 = (fps.num * 1000 + fps.den / 2) / fps.den;
+		long long deci = fps1000 % 1000;
+		int digits = 3;
+		while (deci && !(deci % 10)) {
+			deci /= 10;
+			digits--;
+		}
+
+		if (deci)
+			fprintf(out, "{1}{1}%lld.%0*lld\n", fps1000 / 1000, digits, deci);
+		else
+			fprintf(out, "{1}{1}%lld\n", fps1000 / 1000);
+	}
+
+	// metas: not supported in MicroDVD
+
+	// offset is not supported in MicroDVD (see NSUB_STAGE_APPLY_OFFSET)
+
+	// lyrics
+	ratio_t to_frames = { fps.num, fps.den * 1000 };
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		nsub_write_microdvd_lyric(out, lyric, to_frames);
+	}
+
+	return 1;
+}
+
+/* Private */
+
+void nsub_write_microdvd_lyric(FILE *out, lyric_t *lyric, ratio_t to_frames) {
+	// Only the lyrics, no comments in MicroDVD
+	if (lyric->type != NSUB_LYRIC)
+		return;
+
+	int start = apply_ratio(lyric->start < 0 ? 0 : lyric->start, to_frames);
+	int stop = apply_ratio(lyric->stop < 0 ? 0 : lyric->stop, to_frames);
+
+	cstring_t *text = cstring_clone(lyric->text ? lyric->text : "");
+	cstring_replace(text, "\n", "|");
+	fprintf(out, "{%d}{%d}%s\n", start, stop, text->string);
+	free_cstring(text);
+}
@@ -25,37 +25,41 @@
 /* Declarations */
 
 char *nsub_srt_time_str(int time, int show_sign);
-void nsub_write_srt_lyric(FILE *out, lyric_t *lyric, int offset, double conv);
+void nsub_write_srt_header(FILE *out, song_t *song);
+void nsub_write_srt_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state);
 
 /* Public */
 
-int nsub_write_srt(FILE *out, song_t *song, NSUB_FORMAT fmt, int apply_offset,
-		int add_offset, double conv) {
-	int offset = add_offset;
+int nsub_write_srt(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	writer_t writer;
+	nsub_writer_srt(&writer);
 
+	writer.write_header(out, song);
+	return nsub_write_lyrics(out, song, &writer);
+}
+
+void nsub_writer_srt(writer_t *writer) {
+	writer->write_header = nsub_write_srt_header;
+	writer->write_lyric = nsub_write_srt_lyric;
+	writer->init_state = NULL;
+	writer->state_size = 0;
+}
+
+/* Private */
+
+void nsub_write_srt_header(FILE *out, song_t *song) {
 	// header: none
 
 	// metas: none
 
-	// offset is not supported in SRT (so, always applied)
-	{
-		offset += song->offset;
-	}
+	// offset is not supported in SRT (see NSUB_STAGE_APPLY_OFFSET)
 
 	// other metas: none
-
-	// lyrics
-	array_loop(song->lyrics, lyric, lyric_t)
-	{
-		nsub_write_srt_lyric(out, lyric, offset, conv);
-	}
-
-	return 1;
 }
 
-/* Private */
-
-void nsub_write_srt_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
+void nsub_write_srt_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state) {
 	if (lyric->type == NSUB_EMPTY) {
 		// not supported, ignored
 		return;
@@ -72,13 +76,10 @@ void nsub_write_srt_lyric(FILE *out, lyric_t *lyric, int offset, double conv) {
 	//if (lyric->name)
 	// not supported, ignored
 
-	char *start = nsub_srt_time_str(
-		apply_conv(lyric->start, conv) + offset, 
-	0);
-	char *stop = nsub_srt_time_str(
-		apply_conv(lyric->stop , conv) + offset, 
-	0);
-	fprintf(out, "%s --> %s\n%s\n\n", start, stop, lyric->text);
+	char *start = nsub_srt_time_str(lyric->start, 0);
+	char *stop = nsub_srt_time_str(lyric->stop, 0);
+	fprintf(out, "%s --> %s\n%s\n\n", start, stop,
+			lyric->text ? lyric->text : "");
 	free(start);
 	free(stop);
 }
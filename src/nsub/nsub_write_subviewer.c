@@ -0,0 +1,104 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+char *nsub_subviewer_time_str(int time);
+void nsub_write_subviewer_lyric(FILE *out, lyric_t *lyric);
+
+/* Public */
+
+int nsub_write_subviewer(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	char *title = "";
+	char *author = "";
+
+	// metas: only the title and the author are supported
+	array_loop(song->metas, meta, meta_t)
+	{
+		if (!strcmp(meta->key, "ti"))
+			title = meta->value;
+		else if (!strcmp(meta->key, "au"))
+			author = meta->value;
+	}
+
+	// header
+	{
+		fprintf(out, "[INFORMATION]\n");
+		fprintf(out, "[TITLE]%s\n", title);
+		fprintf(out, "[AUTHOR]%s\n", author);
+		fprintf(out, "[SOURCE]\n");
+		fprintf(out, "[PRG]nsub (https://github.com/nikiroo/nsub)\n");
+		fprintf(out, "[FILEPATH]\n");
+		fprintf(out, "[DELAY]0\n");
+		fprintf(out, "[CD TRACK]0\n");
+		fprintf(out, "[COMMENT]\n");
+		fprintf(out, "[END INFORMATION]\n");
+		fprintf(out, "[SUBTITLE]\n");
+		fprintf(out, "[COLF]&HFFFFFF,[STYLE]bd,[SIZE]18,[FONT]Arial\n");
+	}
+
+	// offset is not supported in SubViewer (see NSUB_STAGE_APPLY_OFFSET)
+
+	// lyrics
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		nsub_write_subviewer_lyric(out, lyric);
+	}
+
+	return 1;
+}
+
+/* Private */
+
+void nsub_write_subviewer_lyric(FILE *out, lyric_t *lyric) {
+	// Only the lyrics, no comments in SubViewer
+	if (lyric->type != NSUB_LYRIC)
+		return;
+
+	char *start = nsub_subviewer_time_str(lyric->start);
+	char *stop = nsub_subviewer_time_str(lyric->stop);
+	cstring_t *text = cstring_clone(lyric->text ? lyric->text : "");
+	cstring_replace(text, "\n", "[br]");
+	fprintf(out, "%s,%s\n%s\n\n", start, stop, text->string);
+	free_cstring(text);
+	free(start);
+	free(stop);
+}
+
+char *nsub_subviewer_time_str(int time) {
+	// no negative timings in SubViewer
+	if (time < 0)
+		time = 0;
+
+	int h = (time / 1000) / 3600;
+	int m = ((time / 1000) / 60) % 60;
+	int s = ((time / 1000)) % 60;
+	int c = (time / 10) % 100;
+
+	char *time_str = malloc(16 * sizeof(char));
+	sprintf(time_str, "%02d:%02d:%02d.%02d", h, m, s, c);
+
+	return time_str;
+}
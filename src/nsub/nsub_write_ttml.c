@@ -0,0 +1,154 @@
+/*
+ * NSub: Subtitle/Lyrics conversion program (webvtt/srt/lrc)
+ *
+ * Copyright (C) 2022 Niki Roo
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "nsub.h"
+#include "cutils/cutils.h"
+
+/* Declarations */
+
+char *nsub_ttml_time_str(int time);
+void nsub_write_ttml_lyric(FILE *out, lyric_t *lyric);
+
+// escape the XML special characters (and make <br/> of the new lines)
+static cstring_t *escape(const char *text, int comment);
+
+/* Public */
+
+int nsub_write_ttml(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	// header (IMSC1 Text Profile)
+	{
+		fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		fprintf(out, "<!-- created by: nsub "
+				"(https://github.com/nikiroo/nsub) -->\n");
+
+		// IMSC1 requires a language: "und" (undetermined) if unknown
+		cstring_t *lang = escape(song->lang && *song->lang ? song->lang : "und",
+				0);
+		fprintf(out, "<tt xmlns=\"http://www.w3.org/ns/ttml\"\n"
+				"    xmlns:ttp=\"http://www.w3.org/ns/ttml#parameter\"\n"
+				"    xmlns:tts=\"http://www.w3.org/ns/ttml#styling\"\n"
+				"    ttp:profile=\"http://www.w3.org/ns/ttml/profile/imsc1/text\"\n"
+				"    ttp:timeBase=\"media\" xml:lang=\"%s\">\n", lang->string);
+		free_cstring(lang);
+
+		fprintf(out, "  <head>\n"
+				"    <styling>\n"
+				"      <style xml:id=\"s0\" tts:color=\"white\" "
+				"tts:backgroundColor=\"transparent\" "
+				"tts:fontFamily=\"proportionalSansSerif\" "
+				"tts:textAlign=\"center\"/>\n"
+				"    </styling>\n"
+				"    <layout>\n"
+				"      <region xml:id=\"r0\" tts:origin=\"10%% 80%%\" "
+				"tts:extent=\"80%% 15%%\" tts:displayAlign=\"after\"/>\n"
+				"    </layout>\n"
+				"  </head>\n");
+	}
+
+	// metas: no standard place for them in IMSC1
+
+	// offset is not supported in TTML (see NSUB_STAGE_APPLY_OFFSET)
+
+	// lyrics
+	fprintf(out, "  <body region=\"r0\" style=\"s0\">\n    <div>\n");
+	array_loop(song->lyrics, lyric, lyric_t)
+	{
+		nsub_write_ttml_lyric(out, lyric);
+	}
+	fprintf(out, "    </div>\n  </body>\n</tt>\n");
+
+	return 1;
+}
+
+/* Private */
+
+void nsub_write_ttml_lyric(FILE *out, lyric_t *lyric) {
+	if (lyric->type == NSUB_EMPTY || !lyric->text)
+		return;
+
+	if (lyric->type == NSUB_COMMENT || lyric->type == NSUB_UNKNOWN) {
+		cstring_t *text = escape(lyric->text, 1);
+		fprintf(out, "      <!-- %s -->\n", text->string);
+		free_cstring(text);
+		return;
+	}
+
+	char *start = nsub_ttml_time_str(lyric->start);
+	char *stop = nsub_ttml_time_str(lyric->stop);
+	cstring_t *text = escape(lyric->text, 0);
+	fprintf(out, "      <p xml:id=\"c%d\" begin=\"%s\" end=\"%s\">%s</p>\n",
+			lyric->num, start, stop, text->string);
+	free_cstring(text);
+	free(start);
+	free(stop);
+}
+
+char *nsub_ttml_time_str(int time) {
+	// no negative timings in TTML
+	if (time < 0)
+		time = 0;
+
+	int h = (time / 1000) / 3600;
+	int m = ((time / 1000) / 60) % 60;
+	int s = ((time / 1000)) % 60;
+	int c = (time) % 1000;
+
+	char *time_str = malloc(16 * sizeof(char));
+	sprintf(time_str, "%02d:%02d:%02d.%03d", h, m, s, c);
+
+	return time_str;
+}
+
+static cstring_t *escape(const char *text, int comment) {
+	cstring_t *out = new_cstring();
+
+	for (const char *ptr = text; *ptr; ptr++) {
+		switch (*ptr) {
+		case '&':
+			cstring_add(out, "&amp;");
+			break;
+		case '<':
+			cstring_add(out, "&lt;");
+			break;
+		case '>':
+			cstring_add(out, "&gt;");
+			break;
+		case '"':
+			cstring_add(out, "&quot;");
+			break;
+		case '\n':
+			cstring_add(out, comment ? " " : "<br/>");
+			break;
+		case '-':
+			// "--" is not allowed in an XML comment
+			if (comment && ptr[1] == '-')
+				cstring_add(out, "- ");
+			else
+				cstring_add_car(out, '-');
+			break;
+		default:
+			cstring_add_car(out, *ptr);
+			break;
+		}
+	}
+
+	return out;
+}
@@ -24,15 +24,30 @@
 /* Declarations */
 
 char *nsub_webvtt_time_str(int time, int show_sign);
-void nsub_write_webvtt_lyric(FILE *out, lyric_t *lyric, int offset, 
-		double conv);
+void nsub_write_webvtt_header(FILE *out, song_t *song);
+void nsub_write_webvtt_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state);
 
 /* Public */
 
-int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt,
-		int apply_offset, int add_offset, double conv) {
-	int offset = add_offset;
+int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt) {
+	writer_t writer;
+	nsub_writer_webvtt(&writer);
 
+	writer.write_header(out, song);
+	return nsub_write_lyrics(out, song, &writer);
+}
+
+void nsub_writer_webvtt(writer_t *writer) {
+	writer->write_header = nsub_write_webvtt_header;
+	writer->write_lyric = nsub_write_webvtt_lyric;
+	writer->init_state = NULL;
+	writer->state_size = 0;
+}
+
+/* Private */
+
+void nsub_write_webvtt_header(FILE *out, song_t *song) {
 	// header
 	{
 		fprintf(out, "WEBVTT\nKind: captions\n");
@@ -48,10 +63,7 @@ int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt,
 		//fprintf(out, "NOTE META %s: %s\n\n", meta->key, meta->value);
 	}
 
-	// offset is not supported in WebVTT (so, always applied)
-	{
-		offset += song->offset;
-	}
+	// offset is not supported in WebVTT (see NSUB_STAGE_APPLY_OFFSET)
 
 	// other metas
 	{
@@ -59,20 +71,10 @@ int nsub_write_webvtt(FILE *out, song_t *song, NSUB_FORMAT fmt,
 		//fprintf(out,
 		// "NOTE META created by: nsub (https://github.com/nikiroo/nsub)]\n");
 	}
-
-	// lyrics
-	array_loop(song->lyrics, lyric, lyric_t)
-	{
-		nsub_write_webvtt_lyric(out, lyric, offset, conv);
-	}
-
-	return 1;
 }
 
-/* Private */
-
-void nsub_write_webvtt_lyric(FILE *out, lyric_t *lyric, int offset, 
-		double conv) {
+void nsub_write_webvtt_lyric(FILE *out, song_t *song, lyric_t *lyric,
+		void *state) {
 	if (lyric->type == NSUB_EMPTY) {
 		fprintf(out, "\n\n");
 		return;
@@ -90,15 +92,16 @@ void nsub_write_webvtt_lyric(FILE *out, lyric_t *lyric, int offset,
 	// if (lyric->name)
 	//fprintf(out, "%s\n", lyric->name);
 	
-	char *start = nsub_webvtt_time_str(
-		apply_conv(lyric->start, conv) + offset, 
-	0);
-	char *stop = nsub_webvtt_time_str(
-		apply_conv(lyric->stop , conv) + offset, 
-	0);
-	fprintf(out, "%s --> %s\n%s\n\n", start, stop, lyric->text);
+	// Word timings as cue timestamps (karaoke)
+	cstring_t *text = nsub_word_text(song, lyric, nsub_webvtt_time_str, 1);
+
+	char *start = nsub_webvtt_time_str(lyric->start, 0);
+	char *stop = nsub_webvtt_time_str(lyric->stop, 0);
+	fprintf(out, "%s --> %s\n%s\n\n", start, stop, text->string);
 	free(start);
 	free(stop);
+
+	free_cstring(text);
 }
 
 char *nsub_webvtt_time_str(int time, int show_sign) {